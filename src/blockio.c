@@ -17,13 +17,17 @@
  */
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/mount.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include <limits.h>
+#include <sched.h>
 #include <assert.h>
 #include "blockio.h"
 #include "bitmap.h"
@@ -33,6 +37,7 @@
 #include "util.h"
 #include "gcry.h"
 #include "ecch.h"
+#include "uring.h"
 
 /* stream (FILE*) stuff */
 
@@ -58,40 +63,326 @@ static void stream_write(void *fp, const void *buf, uint64_t offset,
 	stream_io(fp, (void*)buf, offset, size, fwrite, "writing");
 }
 
+static void stream_sync(void *fp) {
+	/* the stream is unbuffered, so our writes are in the kernel */
+	if (fdatasync(fileno(fp)))
+		FATAL("error syncing: %s", strerror(errno));
+}
+
 static void stream_close(void *fp) {
 	fclose(fp);
 }
 
-static void *stream_open(const char *path) {
+static void *stream_open(const blockio_file_t *f) {
 	void *ret;
-	if (!(ret = fopen(path, "r+")))
+	if (!(ret = fopen(f->path, "r+")))
 		ecch_throw(ECCH_DEFAULT, "fopening %s: %s",
-				path, strerror(errno));
+				f->path, strerror(errno));
+
+	/* other handles (the writer and the readahead thread)
+	 * must see our writes and we must see theirs */
+	setvbuf(ret, NULL, _IONBF, 0);
 
 	return ret;
 }
 
 /* end stream stuff */
 
-#define BASE			(dev->tmp_macroblock)
+/* fd stuff, pread/pwrite don't touch the file offset, so
+ * multiple threads can use the same handle at the same time */
+
+typedef struct fd_priv_s {
+	int fd;
+	int direct; /* opened with O_DIRECT */
+} fd_priv_t;
+
+static void fd_io(void *priv, void *buf, uint64_t offset, uint32_t size,
+		ssize_t (*io)(), const char *rwing) {
+	ssize_t ret;
+	assert(priv && ((!buf && !size) || (buf && size)) && io);
+
+	while (size) {
+		ret = io(((fd_priv_t*)priv)->fd, buf, size, offset);
+		if (ret < 0) {
+			if (errno == EINTR) continue;
+			FATAL("error %s %u bytes at byte %lu: %s", rwing, size,
+					offset, strerror(errno));
+		}
+		if (!ret) FATAL("error %s %u bytes at byte %lu: "
+				"unexpected end of file", rwing, size, offset);
+
+		buf += ret;
+		offset += ret;
+		size -= ret;
+	}
+}
+
+/* with O_DIRECT the buffer must be aligned, offsets and sizes are
+ * always multiples of the mesoblock size, so they are fine */
+#define UNALIGNED(a)	(((uintptr_t)(a))&(BLOCKIO_ALIGN - 1))
+
+static void fd_read(void *priv, void *buf, uint64_t offset, uint32_t size) {
+	void *bounce;
+
+	if (!((fd_priv_t*)priv)->direct || !UNALIGNED(buf)) {
+		fd_io(priv, buf, offset, size, pread, "reading");
+		return;
+	}
+
+	bounce = ecalloc_aligned(BLOCKIO_ALIGN, size);
+	fd_io(priv, bounce, offset, size, pread, "reading");
+	memcpy(buf, bounce, size);
+	free(bounce);
+}
+
+static void fd_write(void *priv, const void *buf, uint64_t offset,
+		uint32_t size) {
+	void *bounce;
+
+	if (!((fd_priv_t*)priv)->direct || !UNALIGNED(buf)) {
+		fd_io(priv, (void*)buf, offset, size, pwrite, "writing");
+		return;
+	}
+
+	bounce = ecalloc_aligned(BLOCKIO_ALIGN, size);
+	memcpy(bounce, buf, size);
+	fd_io(priv, bounce, offset, size, pwrite, "writing");
+	free(bounce);
+}
+
+static void fd_sync(void *priv) {
+	if (fdatasync(((fd_priv_t*)priv)->fd))
+		FATAL("error syncing: %s", strerror(errno));
+}
+
+static void fd_close(void *priv) {
+	close(((fd_priv_t*)priv)->fd);
+	free(priv);
+}
+
+static void *fd_open_common(const char *path, int direct) {
+	fd_priv_t *priv = ecalloc(1, sizeof(fd_priv_t));
+
+	priv->direct = direct;
+	if ((priv->fd = open(path, O_RDWR|(direct?O_DIRECT:0))) < 0) {
+		free(priv);
+		ecch_throw(ECCH_DEFAULT, "opening %s%s: %s", path,
+				direct?" with O_DIRECT":"", strerror(errno));
+	}
+
+	return priv;
+}
+
+static void *fd_open(const blockio_file_t *f) {
+	return fd_open_common(f->path, 0);
+}
+
+/* bypass the page cache, we never read back what we write */
+static void *fd_open_direct(const blockio_file_t *f) {
+	return fd_open_common(f->path, 1);
+}
+
+/* end fd stuff */
+
+/* the never written parts of the sparse and mem backends read as
+ * pseudorandom bytes that only depend on the offset, like a base
+ * that was filled with random data once (splitmix64) */
+static uint64_t synth_word(uint64_t word) {
+	uint64_t z = (word + 1)*0x9e3779b97f4a7c15ULL;
+
+	z = (z^(z>>30))*0xbf58476d1ce4e5b9ULL;
+	z = (z^(z>>27))*0x94d049bb133111ebULL;
+
+	return z^(z>>31);
+}
+
+static void synth(void *buf, uint64_t offset, uint32_t size) {
+	uint32_t in, n;
+	uint64_t w;
+
+	while (size) {
+		in = offset&7;
+		n = 8 - in;
+		if (n > size) n = size;
+		w = synth_word(offset>>3);
+		memcpy(buf, (char*)&w + in, n);
+		buf += n;
+		offset += n;
+		size -= n;
+	}
+}
+
+/* sparse stuff, a (sparse) file where the holes are synthesized, the
+ * filesystem must support SEEK_DATA and SEEK_HOLE, or else the holes
+ * read as zeroes; it is created with truncate(1) */
+
+static void sparse_read(void *priv, void *buf, uint64_t offset,
+		uint32_t size) {
+	int fd = ((fd_priv_t*)priv)->fd;
+	off_t data, hole;
+	uint32_t n;
+
+	while (size) {
+		/* the file offset is changed, but pread doesn't use it */
+		if ((data = lseek(fd, offset, SEEK_DATA)) < 0) {
+			if (errno != ENXIO) FATAL("error seeking data at "
+					"byte %lu: %s", offset, strerror(errno));
+			data = offset + size; /* only a hole follows */
+		}
+
+		if (data > offset) {
+			n = (data - offset < size)?data - offset:size;
+			synth(buf, offset, n);
+			buf += n;
+			offset += n;
+			size -= n;
+			continue;
+		}
+
+		if ((hole = lseek(fd, offset, SEEK_HOLE)) < 0)
+			FATAL("error seeking hole at byte %lu: %s",
+					offset, strerror(errno));
+
+		n = (hole - offset < size)?hole - offset:size;
+		fd_io(priv, buf, offset, n, pread, "reading");
+		buf += n;
+		offset += n;
+		size -= n;
+	}
+}
+
+/* end sparse stuff */
+
+/* mem stuff, the base is anonymous memory that is only backed by RAM
+ * where it is written, a bit for each mesoblock tells which parts
+ * are written, the rest is synthesized; all handles are the same */
+
+static void *mem_open(const blockio_file_t *f) {
+	return (void*)f;
+}
+
+static int mem_written(const blockio_file_t *f, uint64_t meso) {
+	return (__atomic_load_n(&f->written[meso>>6], __ATOMIC_ACQUIRE)&
+		(1ULL<<(meso&63))) != 0;
+}
+
+static void mem_read(void *priv, void *buf, uint64_t offset, uint32_t size) {
+	const blockio_file_t *f = priv;
+	uint64_t meso;
+	uint32_t n;
+
+	assert(offset + size <= f->size);
+
+	while (size) {
+		meso = offset>>f->mem_log;
+		n = (1<<f->mem_log) - (offset&((1<<f->mem_log) - 1));
+		if (n > size) n = size;
+		if (mem_written(f, meso)) memcpy(buf, f->mem + offset, n);
+		else synth(buf, offset, n);
+		buf += n;
+		offset += n;
+		size -= n;
+	}
+}
+
+/* writes are always whole mesoblocks */
+static void mem_write(void *priv, const void *buf, uint64_t offset,
+		uint32_t size) {
+	blockio_file_t *f = priv;
+	uint64_t meso;
+
+	assert(offset + size <= f->size);
+	assert(!(offset&((1<<f->mem_log) - 1)) &&
+			!(size&((1<<f->mem_log) - 1)));
+
+	memcpy(f->mem + offset, buf, size);
+
+	for (meso = offset>>f->mem_log; meso < (offset + size)>>f->mem_log;
+			meso++)
+		__atomic_fetch_or(&f->written[meso>>6], 1ULL<<(meso&63),
+				__ATOMIC_RELEASE);
+}
+
+/* there is nothing to lose that we wouldn't lose anyway */
+static void mem_sync(void *priv) {
+}
+
+static void mem_close(void *priv) {
+}
+
+/* end mem stuff */
+
+typedef struct blockio_engine_s {
+	const char *name;
+	void *(*open)(const blockio_file_t*);
+	void (*read)(void*, void*, uint64_t, uint32_t);
+	void (*write)(void*, const void*, uint64_t, uint32_t);
+	void (*close)(void*);
+	void (*sync)(void*); /* the writes are on stable storage */
+	void (*read_batch)(void*, blockio_req_t*, uint32_t);
+	void (*write_batch)(void*, blockio_req_t*, uint32_t);
+	int (*available)(void); /* if NULL, it is always available */
+	uint32_t io_align; /* sizes must be a multiple of this */
+} blockio_engine_t;
+
+/* the first engine is the fallback for unavailable engines */
+static const blockio_engine_t engines[] = {
+	{ "pread", fd_open, fd_read, fd_write, fd_close, fd_sync },
+	{ "direct", fd_open_direct, fd_read, fd_write, fd_close, fd_sync,
+		NULL, NULL, NULL, BLOCKIO_ALIGN },
+	{ "stream", stream_open, stream_read, stream_write, stream_close,
+		stream_sync },
+	{ "uring", uring_open, uring_read, uring_write, uring_close,
+		uring_sync, uring_read_batch, uring_write_batch,
+		uring_available },
+	{ "sparse", fd_open, sparse_read, fd_write, fd_close, fd_sync },
+};
+
+/* not in the list, it is selected with a base of the form mem:BLOCKS */
+static const blockio_engine_t mem_engine =
+	{ "mem", mem_open, mem_read, mem_write, mem_close, mem_sync };
+
+#define NO_ENGINES (sizeof(engines)/sizeof(engines[0]))
+
+#define BASE			(base)
 #define INDEXBLOCK_SHA256	(BASE + 0x000)
 #define DATABLOCKS_SHA256	(BASE + 0x020)
 #define SEQNOS_SHA256		(BASE + 0x040)
 #define SEQNO_UINT64		(BASE + 0x060)
 #define NEXT_SEQNO_UINT64	(BASE + 0x068)
-#define MAGIC64			(BASE + 0x070)
+#define MAGIC64_OFFSET		0x070
+#define MAGIC64			(BASE + MAGIC64_OFFSET)
 #define NO_MACROBLOCKS_UINT32	(BASE + 0x078)
 #define RESERVED_BLOCKS_UINT32	(BASE + 0x07C)
 #define RESERVED_SPACE1024	(BASE + 0x080)
 #define NO_INDICES_UINT32	(BASE + 0x100)
 #define BITMAP			(BASE + dev->b->bitmap_offset)
 
+/* read this much to be able to check the magic */
+#define PROBE_SIZE		(MAGIC64_OFFSET + 16)
+
 void blockio_free(blockio_t *b) {
 	assert(b);
+	if (b->open_priv) {
+		blockio_file_t *f = b->open_priv;
+		free(f->path);
+		if (f->mem) munmap(f->mem, f->size);
+		free(f->written);
+	}
 	free(b->open_priv);
-	dllarr_free(&b->unallocated);
+	idset_free(&b->unallocated);
 	free(b->blockio_infos);
+	pthd_cond_destroy(&b->scans_cond);
 	pthd_mutex_destroy(&b->unallocated_mutex);
+	hdrcache_free(&b->hdrcache);
+}
+
+/* size is in bytes, only the part of the header that is
+ * needed to probe the magic is cached */
+void blockio_hdrcache_init(blockio_t *b, size_t size) {
+	assert(b);
+
+	hdrcache_init(&b->hdrcache, size/PROBE_SIZE, PROBE_SIZE);
 }
 
 uint32_t blockio_get_macroblock_index(blockio_info_t *bi) {
@@ -99,57 +390,47 @@ uint32_t blockio_get_macroblock_index(blockio_info_t *bi) {
 	return bi - bi->dev->b->blockio_infos;
 }
 
-/* open backing file and set macroblock size */
-void blockio_init_file(blockio_t *b, const char *path, uint8_t macroblock_log,
-		uint8_t mesoblk_log) {
-	struct stat stat_info;
-	struct flock lock;
-	uint64_t tmp;
-	void *priv; /* FILE* */
-	assert(b);
-	assert(sizeof(off_t)==8);
-	assert(macroblock_log < 8*sizeof(uint32_t));
+/* engines without batch support do one request at a time */
+void blockio_read_batch(blockio_t *b, void *io, blockio_req_t *reqs,
+		uint32_t n) {
+	uint32_t i;
+	assert(b && reqs);
 
-	b->open_priv = strdup(path);
-	if (!b->open_priv) FATAL("out of memory");
-	b->macroblock_log = macroblock_log;
-	b->macroblock_size = 1<<macroblock_log;
-	b->mesoblk_log = mesoblk_log;
-	b->mmpm = (1<<(b->macroblock_log - b->mesoblk_log)) - 1;
-
-        VERBOSE("mesoblock size %d bytes, macroblock size %d bytes",
-			1<<b->mesoblk_log, b->macroblock_size);
+	if (b->read_batch) b->read_batch(io, reqs, n);
+	else for (i = 0; i < n; i++)
+		b->read(io, reqs[i].buf, reqs[i].offset, reqs[i].size);
+}
 
-	VERBOSE("%ld mesoblocks per macroblock, including index",
-			1L<<(macroblock_log - mesoblk_log));
+void blockio_write_batch(blockio_t *b, void *io, blockio_req_t *reqs,
+		uint32_t n) {
+	uint32_t i;
+	assert(b && reqs);
 
-        b->bitmap_offset = 256 + (4<<(macroblock_log - mesoblk_log));
-	if (b->bitmap_offset >= 1<<mesoblk_log)
-		FATAL("not enough room for indexblock in mesoblock");
-        VERBOSE("required minimumsize of indexblock excluding macroblock "
-			"index is %d bytes", b->bitmap_offset);
-
-        b->max_macroblocks = ((1L<<mesoblk_log) - b->bitmap_offset)<<3;
-        VERBOSE("maximum amount of macroblocks supported %d",
-			b->max_macroblocks);
+	if (b->write_batch) b->write_batch(io, reqs, n);
+	else for (i = 0; i < n; i++)
+		b->write(io, reqs[i].buf, reqs[i].offset, reqs[i].size);
+}
 
-	b->open = (void* (*)(const void*))stream_open;
-	b->read = stream_read;
-	b->write = stream_write;
-	b->close = stream_close;
+/* the size of the base file or device, it is locked */
+static uint64_t file_size(const char *path) {
+	struct stat stat_info;
+	struct flock lock;
+	uint64_t tmp;
+	int fd;
 
 	/* each scubed device has it's own handle
 	 * to the file (for thead safity), we open the
 	 * file here temporarily to look at it */
-	priv = stream_open(b->open_priv);
+	if ((fd = open(path, O_RDWR)) < 0)
+		FATAL("opening %s: %s", path, strerror(errno));
 
 	lock.l_type = F_WRLCK;
 	lock.l_whence = SEEK_SET;
 	lock.l_start = 0;
 	lock.l_len = 0;  /* whole file */
 
-	if (fcntl(fileno(priv), F_SETLK, &lock) == -1) {
-		if (fcntl(fileno(priv), F_GETLK, &lock) == -1) assert(0);
+	if (fcntl(fd, F_SETLK, &lock) == -1) {
+		if (fcntl(fd, F_GETLK, &lock) == -1) assert(0);
 
 		FATAL("process with PID %d has already locked %s",
 				lock.l_pid, path);
@@ -162,15 +443,105 @@ void blockio_init_file(blockio_t *b, const char *path, uint8_t macroblock_log,
 	if (S_ISREG(stat_info.st_mode)) {
 		tmp = stat_info.st_size;
 		DEBUG("%s is a regular file", path);
-
-		b->total_macroblocks = stat_info.st_size>>b->macroblock_log;
 	} else if (S_ISBLK(stat_info.st_mode)) {
 		DEBUG("%s is a block device", path);
-		if (ioctl(fileno(priv), BLKGETSIZE64, &tmp))
+		if (ioctl(fd, BLKGETSIZE64, &tmp))
 			FATAL("error querying size of blockdevice %s", path);
 
 	} else FATAL("%s is not a regular file or a block device", path);
 
+	close(fd);
+
+	return tmp;
+}
+
+/* a base of the form mem:BLOCKS */
+static uint64_t mem_size(const char *blocks, uint8_t macroblock_log) {
+	char *end;
+	unsigned long no = strtoul(blocks, &end, 10);
+
+	if (*end || !*blocks || !no) FATAL("size of memory base "
+			"\"%s\" must be a positive number of blocks", blocks);
+
+	return ((uint64_t)no)<<macroblock_log;
+}
+
+static void mem_map(blockio_file_t *f, uint64_t size, uint8_t mesoblk_log) {
+	f->size = size;
+	f->mem_log = mesoblk_log;
+	if ((f->mem = mmap(NULL, size, PROT_READ|PROT_WRITE,
+			MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,
+			-1, 0)) == MAP_FAILED)
+		FATAL("unable to map %lu bytes of memory: %s", size,
+				strerror(errno));
+	f->written = ecalloc(((size>>mesoblk_log) + 63)/64, sizeof(uint64_t));
+}
+
+/* open backing file and set macroblock size */
+void blockio_init_file(blockio_t *b, const char *path, const char *engine,
+		uint32_t queue_depth, uint8_t macroblock_log,
+		uint8_t mesoblk_log) {
+	uint64_t tmp;
+	const blockio_engine_t *e = NULL;
+	blockio_file_t *f;
+	int i;
+	assert(b && engine);
+	assert(sizeof(off_t)==8);
+	assert(macroblock_log < 8*sizeof(uint32_t));
+
+	if (!queue_depth) FATAL("queue depth must be at least 1");
+	b->queue_depth = queue_depth;
+
+	f = ecalloc(1, sizeof(blockio_file_t));
+	f->path = estrdup(path);
+	f->queue_depth = queue_depth;
+	b->open_priv = f;
+	b->macroblock_log = macroblock_log;
+	b->macroblock_size = 1<<macroblock_log;
+	b->mesoblk_log = mesoblk_log;
+	b->mmpm = (1<<(b->macroblock_log - b->mesoblk_log)) - 1;
+
+        VERBOSE("mesoblock size %d bytes, macroblock size %d bytes",
+			1<<b->mesoblk_log, b->macroblock_size);
+
+	VERBOSE("%ld mesoblocks per macroblock, including index",
+			1L<<(macroblock_log - mesoblk_log));
+
+        b->bitmap_offset = 256 + (4<<(macroblock_log - mesoblk_log));
+	if (b->bitmap_offset >= 1<<mesoblk_log)
+		FATAL("not enough room for indexblock in mesoblock");
+        VERBOSE("required minimumsize of indexblock excluding macroblock "
+			"index is %d bytes", b->bitmap_offset);
+
+        b->max_macroblocks = ((1L<<mesoblk_log) - b->bitmap_offset)<<3;
+        VERBOSE("maximum amount of macroblocks supported %d",
+			b->max_macroblocks);
+
+	if (!strncmp(path, BLOCKIO_MEM_PREFIX, strlen(BLOCKIO_MEM_PREFIX)))
+		e = &mem_engine;
+	else for (i = 0; i < NO_ENGINES; i++)
+		if (!strcmp(engine, engines[i].name)) e = &engines[i];
+	if (!e) FATAL("unknown I/O engine \"%s\"", engine);
+	if (e->available && !e->available()) {
+		WARNING("I/O engine \"%s\" not available, falling back "
+				"to \"%s\"", e->name, engines[0].name);
+		e = &engines[0];
+	}
+	VERBOSE("using I/O engine \"%s\"", e->name);
+
+	b->open = (void* (*)(const void*))e->open;
+	b->read = e->read;
+	b->write = e->write;
+	b->close = e->close;
+	b->sync = e->sync;
+	b->read_batch = e->read_batch;
+	b->write_batch = e->write_batch;
+	b->io_align = e->io_align;
+
+	if (e == &mem_engine) tmp = mem_size(path + strlen(BLOCKIO_MEM_PREFIX),
+			macroblock_log);
+	else tmp = file_size(path);
+
 	DEBUG("backing size in bytes %ld having %ld macroblocks of size %u",
 			tmp, tmp>>b->macroblock_log, b->macroblock_size);
 
@@ -179,18 +550,316 @@ void blockio_init_file(blockio_t *b, const char *path, uint8_t macroblock_log,
 	if (tmp > b->max_macroblocks) FATAL("device is too large");
 	b->total_macroblocks = tmp;
 
+	if (e == &mem_engine) mem_map(f, tmp<<b->macroblock_log,
+			b->mesoblk_log);
+
 	b->blockio_infos = ecalloc(sizeof(blockio_info_t),
 			b->total_macroblocks);
 
-	dllarr_init(&b->unallocated, offsetof(blockio_info_t, ur));
+	idset_init(&b->unallocated, b->total_macroblocks);
 	for (uint32_t i = 0; i < b->total_macroblocks; i++) 
-		dllarr_append(&b->unallocated, &b->blockio_infos[i]);
+		idset_add(&b->unallocated, i);
 
-	stream_close(priv);
 	pthd_mutex_init(&b->unallocated_mutex);
+	pthd_cond_init(&b->scans_cond);
+}
+
+/* by format, see BLOCKIO_FORMAT_* */
+static const char magics[][8] = { "SSS3v0.1", "SSS3v0.2" };
+
+#define NO_FORMATS (sizeof(magics)/sizeof(magics[0]))
+
+/* returns the format of a header with this magic, 0 if it is unknown */
+static int header_format(const char *magic) {
+	int i;
+
+	for (i = 0; i < NO_FORMATS; i++)
+		if (!memcmp(magics[i], magic, sizeof(magics[i]))) return i + 1;
+
+	return 0;
+}
+
+typedef struct seal_chunk_s {
+	blockio_dev_t *dev;
+	cipher_req_t *reqs;
+	int n;
+} seal_chunk_t;
+
+static void seal_chunk(void *arg, uint32_t worker) {
+	seal_chunk_t *chunk = arg;
+
+	cipher_enc_batch(&chunk->dev->ciphers[worker], chunk->reqs, chunk->n);
+}
+
+/* the datablocks are encrypted by the worker pool in chunks of
+ * CIPHER_INTERLEAVE mesoblocks, the SHA-256 of the data can not
+ * be split, so we hash the chunks in order as they are done */
+static void seal_datablocks(blockio_dev_t *dev, char *base,
+		cipher_req_t *reqs) {
+	uint32_t no_chunks = (dev->b->mmpm + CIPHER_INTERLEAVE - 1)/
+		CIPHER_INTERLEAVE, k;
+	workpool_task_t tasks[no_chunks];
+	seal_chunk_t chunks[no_chunks];
+	gcry_md_hd_t hd;
+
+	for (k = 0; k < no_chunks; k++) {
+		chunks[k].dev = dev;
+		chunks[k].reqs = reqs + k*CIPHER_INTERLEAVE;
+		chunks[k].n = dev->b->mmpm - k*CIPHER_INTERLEAVE;
+		if (chunks[k].n > CIPHER_INTERLEAVE)
+			chunks[k].n = CIPHER_INTERLEAVE;
+		tasks[k].fn = seal_chunk;
+		tasks[k].arg = &chunks[k];
+	}
+
+	workpool_submit(&dev->b->pool, tasks, no_chunks);
+
+	gcry_call(md_open, &hd, GCRY_MD_SHA256, 0);
+
+	for (k = 0; k < no_chunks; k++) {
+		workpool_wait(&dev->b->pool, &tasks[k]);
+		gcry_md_write(hd, chunks[k].reqs->out,
+				chunks[k].n<<dev->b->mesoblk_log);
+	}
+
+	memcpy(DATABLOCKS_SHA256, gcry_md_read(hd, GCRY_MD_SHA256), 32);
+	gcry_md_close(hd);
+}
+
+/* runs in the writer thread, the index is already filled in */
+static void seal_and_write(blockio_dev_t *dev, blockio_wbuf_t *w) {
+	char *base = w->data;
+	cipher_req_t reqs[dev->b->mmpm];
+	int i;
+
+	/* encrypt datablocks (also the unused ones), they are
+	 * independent chains, so they are encrypted as a batch */
+	for (i = 1; i <= dev->b->mmpm; i++) {
+		reqs[i-1].out = BASE + (i<<dev->b->mesoblk_log);
+		reqs[i-1].in = reqs[i-1].out;
+		reqs[i-1].iv0 = w->seqno;
+		reqs[i-1].iv1 = i;
+		reqs[i-1].iv2 = w->id;
+	}
+
+	/* and calculate hash of data, store in index */
+	if (dev->b->pool.no_threads) seal_datablocks(dev, base, reqs);
+	else {
+		cipher_enc_batch(&dev->writer_c, reqs, dev->b->mmpm);
+		gcry_md_hash_buffer(GCRY_MD_SHA256, DATABLOCKS_SHA256,
+				BASE + (1<<dev->b->mesoblk_log),
+				dev->b->mmpm<<dev->b->mesoblk_log);
+	}
+	//verbose_buffer("sha256_data", DATABLOCKS_HASH, 32);
+
+	/* calculate hash of indexblock */
+	gcry_md_hash_buffer(GCRY_MD_SHA256, INDEXBLOCK_SHA256,
+			BASE + 32 /* size of hash */,
+			(1<<dev->b->mesoblk_log) - 32 /* size of hash */);
+
+	/* encrypt index */
+	cipher_enc(&dev->writer_c, BASE, BASE, 0, 0, w->id);
+	hdrcache_put(&dev->b->hdrcache, BASE, w->id);
+
+	/* with an engine that can have multiple requests in flight
+	 * we split the macroblock in queue_depth parts */
+	if (dev->b->write_batch && dev->b->queue_depth > 1) {
+		uint32_t n = dev->b->queue_depth, size;
+		blockio_req_t breqs[n];
+
+		if (n > dev->b->mmpm + 1) n = dev->b->mmpm + 1;
+		size = (((dev->b->mmpm + 1)/n)<<dev->b->mesoblk_log);
+
+		for (i = 0; i < n; i++) {
+			breqs[i].buf = BASE + i*size;
+			breqs[i].offset =
+				(((off_t)w->id)<<dev->b->macroblock_log) +
+				i*size;
+			breqs[i].size = (i == n - 1)?
+				(1<<dev->b->macroblock_log) - i*size:size;
+		}
+
+		blockio_write_batch(dev->b, dev->writer_io, breqs, n);
+	} else dev->b->write(dev->writer_io, BASE,
+			((off_t)w->id)<<dev->b->macroblock_log,
+			1<<dev->b->macroblock_log);
+}
+
+/* the writer thread seals and writes the queued
+ * macroblocks in the order in which they were filled */
+static void *writer_thread(void *arg) {
+	blockio_dev_t *dev = arg;
+	blockio_wbuf_t *w;
+
+	pthd_mutex_lock(&dev->writer_mutex);
+	while (1) {
+		while (!dev->wlen && !dev->writer_stop)
+			pthd_cond_wait(&dev->writer_cond, &dev->writer_mutex);
+
+		/* the queue is always drained before we stop */
+		if (!dev->wlen) break;
+
+		w = dev->wqueue[dev->whead];
+		pthd_mutex_unlock(&dev->writer_mutex);
+
+		seal_and_write(dev, w);
+
+		pthd_mutex_lock(&dev->writer_mutex);
+		dev->whead = (dev->whead + 1)%BLOCKIO_WRITE_BUFFERS;
+		dev->wlen--;
+		w->queued = 0;
+		pthd_cond_broadcast(&dev->writer_cond);
+	}
+	pthd_mutex_unlock(&dev->writer_mutex);
+
+	return NULL;
 }
 
-static const char magic[8] = "SSS3v0.1";
+static void writer_start(blockio_dev_t *dev) {
+	int i, err;
+
+	for (i = 0; i < BLOCKIO_WRITE_BUFFERS; i++) {
+		/* aligned, so that the direct engine can use it as is */
+		dev->wbufs[i].data = ecalloc_aligned(BLOCKIO_ALIGN,
+				1<<dev->b->macroblock_log);
+		dev->wbufs[i].queued = 0;
+	}
+	dev->tmp_macroblock = dev->wbufs[0].data;
+	dev->whead = dev->wlen = 0;
+	dev->writer_stop = 0;
+
+	dev->writer_io = dev->b->open(dev->b->open_priv);
+	cipher_dup(&dev->writer_c, dev->c);
+
+	pthd_mutex_init(&dev->writer_mutex);
+	pthd_cond_init(&dev->writer_cond);
+
+	if ((err = pthread_create(&dev->writer, NULL, writer_thread, dev)))
+		FATAL("unable to create writer thread: %s", strerror(err));
+}
+
+static void writer_stop(blockio_dev_t *dev) {
+	int i;
+
+	if (!dev->wbufs[0].data) return; /* never started */
+
+	pthd_mutex_lock(&dev->writer_mutex);
+	dev->writer_stop = 1;
+	pthd_cond_broadcast(&dev->writer_cond);
+	pthd_mutex_unlock(&dev->writer_mutex);
+
+	pthread_join(dev->writer, NULL);
+
+	pthd_cond_destroy(&dev->writer_cond);
+	pthd_mutex_destroy(&dev->writer_mutex);
+	cipher_free(&dev->writer_c);
+	dev->b->close(dev->writer_io);
+
+	for (i = 0; i < BLOCKIO_WRITE_BUFFERS; i++) free(dev->wbufs[i].data);
+	dev->tmp_macroblock = NULL;
+}
+
+static int writer_queued(blockio_dev_t *dev, uint32_t id) {
+	uint32_t i;
+
+	for (i = 0; i < dev->wlen; i++) if (dev->wqueue[(dev->whead + i)%
+				BLOCKIO_WRITE_BUFFERS]->id == id) return 1;
+
+	return 0;
+}
+
+/* a macroblock that is waiting for the writer has not reached the
+ * disk yet, so everyone who reads from disk must wait for it */
+void blockio_dev_wait_written(blockio_dev_t *dev, uint32_t id) {
+	if (!dev->wbufs[0].data) return;
+
+	pthd_mutex_lock(&dev->writer_mutex);
+	while (writer_queued(dev, id))
+		pthd_cond_wait(&dev->writer_cond, &dev->writer_mutex);
+	pthd_mutex_unlock(&dev->writer_mutex);
+}
+
+/* wait for the writer to empty its queue and ask the
+ * engine to put what was written on stable storage */
+void blockio_dev_sync(blockio_dev_t *dev) {
+	if (dev->wbufs[0].data) {
+		pthd_mutex_lock(&dev->writer_mutex);
+		while (dev->wlen)
+			pthd_cond_wait(&dev->writer_cond, &dev->writer_mutex);
+		pthd_mutex_unlock(&dev->writer_mutex);
+	}
+
+	dev->b->sync(dev->io);
+}
+
+/* readers take a context from the free list, the contexts are
+ * created when needed, at most BLOCKIO_READERS per device */
+blockio_reader_t *blockio_dev_get_reader(blockio_dev_t *dev) {
+	blockio_reader_t *r;
+
+	pthd_mutex_lock(&dev->readers_mutex);
+	while (!dev->free_readers && dev->no_readers == BLOCKIO_READERS)
+		pthd_cond_wait(&dev->readers_cond, &dev->readers_mutex);
+
+	if ((r = dev->free_readers)) dev->free_readers = r->next;
+	else {
+		r = &dev->readers[dev->no_readers++];
+		cipher_dup(&r->c, dev->c);
+		r->io = dev->b->open(dev->b->open_priv);
+	}
+	pthd_mutex_unlock(&dev->readers_mutex);
+
+	return r;
+}
+
+void blockio_dev_put_reader(blockio_dev_t *dev, blockio_reader_t *r) {
+	assert(r >= dev->readers && r < dev->readers + dev->no_readers);
+
+	pthd_mutex_lock(&dev->readers_mutex);
+	r->next = dev->free_readers;
+	dev->free_readers = r;
+	pthd_cond_signal(&dev->readers_cond);
+	pthd_mutex_unlock(&dev->readers_mutex);
+}
+
+static void readers_free(blockio_dev_t *dev) {
+	uint32_t i;
+
+	for (i = 0; i < dev->no_readers; i++) {
+		cipher_free(&dev->readers[i].c);
+		dev->b->close(dev->readers[i].io);
+	}
+	dev->no_readers = 0;
+	dev->free_readers = NULL;
+
+	pthd_cond_destroy(&dev->readers_cond);
+	pthd_mutex_destroy(&dev->readers_mutex);
+}
+
+/* there is only one writer per device, readers retry if the
+ * seqcount was odd or has changed while they looked */
+void blockio_dev_seq_write_begin(blockio_dev_t *dev) {
+	__atomic_store_n(&dev->seq, dev->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void blockio_dev_seq_write_end(blockio_dev_t *dev) {
+	__atomic_store_n(&dev->seq, dev->seq + 1, __ATOMIC_RELEASE);
+}
+
+uint32_t blockio_dev_seq_read_begin(blockio_dev_t *dev) {
+	uint32_t seq;
+
+	while ((seq = __atomic_load_n(&dev->seq, __ATOMIC_ACQUIRE))&1)
+		sched_yield();
+
+	return seq;
+}
+
+int blockio_dev_seq_read_retry(blockio_dev_t *dev, uint32_t seq) {
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&dev->seq, __ATOMIC_RELAXED) != seq;
+}
 
 void blockio_dev_free(blockio_dev_t *dev) {
 	int i;
@@ -198,6 +867,9 @@ void blockio_dev_free(blockio_dev_t *dev) {
 	VERBOSE("closing \"%s\", %s", dev->name,
 			dev->updated?"SHOULD BE WRITTEN":"no updates");
 	if (dev->updated) blockio_dev_write_current_macroblock(dev);
+	writer_stop(dev);
+	readers_free(dev);
+	cache_free(&dev->cache);
 	random_free(&dev->r);
 	bitmap_free(&dev->status);
 
@@ -206,45 +878,75 @@ void blockio_dev_free(blockio_dev_t *dev) {
 	/* going to modify bi->dev pointer and the unallocated list */
 	pthd_mutex_lock(&dev->b->unallocated_mutex);
 
+	/* re-add blocks to unallocated, these are the blocks in the
+	 * juggler and the blocks that are still in the replay
+	 * list for whatever reason (creating an existing
+	 * device for example) */
 	for (i = 0; i < dev->b->total_macroblocks; i++) {
 		bi = &dev->b->blockio_infos[i];
 		if (bi->dev == dev) {
 			free(bi->indices);
 			bi->dev = NULL;
+			idset_add(&dev->b->unallocated, i);
 		}
 	}
 
-	/* re-add blocks to unallocated */
-	juggler_free_and_empty_into(&dev->j, dllarr_append,
-			&dev->b->unallocated);
+	juggler_free(&dev->j);
 
-	
-	/* also add blocks that are still in the replay
-	 * list for whatever reason (creating an existing
-	 * device for example) */
-	while ((bi = dllarr_last(&dev->replay))) {
+	while ((bi = dllarr_last(&dev->replay)))
 		dllarr_remove(&dev->replay, bi);
-		dllarr_append(&dev->b->unallocated, bi);
-	}
 
 	pthd_mutex_unlock(&dev->b->unallocated_mutex);
 
 	dllarr_free(&dev->replay);
-	free(dev->tmp_macroblock);
+	if (dev->ciphers) for (i = 0; i < dev->b->pool.no_threads; i++)
+		cipher_free(&dev->ciphers[i]);
+	free(dev->ciphers);
 	free(dev->name);
 	if (dev->b && dev->b->close) dev->b->close(dev->io);
 }
 
+char *blockio_dev_seqnos_hash(blockio_dev_t *dev, char *hash) {
+	if (dev->format == BLOCKIO_FORMAT_SHA256)
+		return juggler_hash_scheduled_seqnos(&dev->j, hash);
+
+	return juggler_digest_scheduled(&dev->j, hash);
+}
+
 void blockio_dev_select_next_macroblock(blockio_dev_t *dev) {
 	assert(!dev->bi);
 
 	dev->updated = 0;
 
+	/* the seqno of the selected block changes */
+	blockio_dev_seq_write_begin(dev);
 	dev->bi = juggler_get_devblock(&dev->j, 0);
 	dev->tail_macroblock = juggler_get_obsoleted(&dev->j);
+	blockio_dev_seq_write_end(dev);
 
 	assert(dev->bi);
 
+	/* if the block reappears right after itself, anything written
+	 * to it would be lost without being collected, so it is
+	 * written empty (it can't hold data, its previous contents
+	 * were collected when it was selected) and we select again */
+	while (dev->tail_macroblock == dev->bi) {
+		assert(!dev->bi->no_indices);
+		VERBOSE("filler block %d seqno=%ld",
+				blockio_get_macroblock_index(dev->bi),
+				dev->bi->seqno);
+		blockio_dev_write_current_macroblock(dev);
+		blockio_dev_seq_write_begin(dev);
+		dev->bi = juggler_get_devblock(&dev->j, 0);
+		dev->tail_macroblock = juggler_get_obsoleted(&dev->j);
+		blockio_dev_seq_write_end(dev);
+		assert(dev->bi);
+	}
+
+	/* the old contents of this block will be overwritten */
+	cache_invalidate_macroblock(&dev->cache,
+			blockio_get_macroblock_index(dev->bi), dev->b->mmpm);
+
 	VERBOSE("new block %d seqno=%ld next_seqno=%ld",
 			blockio_get_macroblock_index(dev->bi),
 			dev->bi->seqno, dev->bi->next_seqno);
@@ -256,152 +958,90 @@ void blockio_dev_write_current_and_select_next_macroblock(
 	blockio_dev_select_next_macroblock(dev);
 }
 
-void blockio_dev_init(blockio_dev_t *dev, blockio_t *b, cipher_t *c,
-		const char *name) {
-	int i; 
-	uint64_t seqno = 0;
-
-	assert(b && c);
-	assert(b->mesoblk_log < b->macroblock_log);
-	random_init(&dev->r);
-	dllarr_init(&dev->replay, offsetof(blockio_info_t, ur));
-	bitmap_init(&dev->status, b->max_macroblocks);
-	juggler_init(&dev->j, &dev->r);
-
-	dev->b = b;
-	dev->c = c;
-	assert(bitmap_size(&dev->status) + 260 + (dev->b->mmpm<<2) ==
-			1<<dev->b->mesoblk_log);
-
-	assert(b->open);
-	dev->io = (b->open)(b->open_priv);
-
-	dev->tmp_macroblock = ecalloc(1, 1<<b->macroblock_log);
-
-	/* read macroblock headers, protected by mutex,
-	 * because we will maybe touch blocks that are owned
-	 * by other devices and the also touch the list
-	 * of unallocated blocks */
-	pthd_mutex_lock(&b->unallocated_mutex);
-
-	for (i = 0; i < b->total_macroblocks; i++)
-		blockio_dev_scan_header(&dev->replay, dev,
-				dev->b->blockio_infos + i, &seqno);
-
-	pthd_mutex_unlock(&b->unallocated_mutex);
-
-	if (!dllarr_count(&dev->replay)) {
-		assert(!seqno);
-		return;
-	}
-
-	VERBOSE("we currently got %d blocks, and we expect %d blocks",
-			dllarr_count(&dev->replay), dev->no_macroblocks);
-
-	pthd_mutex_lock(&b->unallocated_mutex);
-
-	for (i = 0; i < dev->b->max_macroblocks; i++) {
-		if (blockio_dev_get_macroblock_status_bynum(dev, i) == USED) {
-			if (i >= dev->b->total_macroblocks)
-				FATAL("macroblock marked as USED that "
-						"does not exist");
-
-			blockio_info_t *bi = &dev->b->blockio_infos[i];
-			if (bi->dev == dev) continue; // ok
-			else if (bi->dev)
-				FATAL("block %u USED by us but claimed "
-						"by another device", i);
+/* only the first bytes of the header are read, to see if the magic
+ * matches, with CBC only one cipherblock needs to be decrypted,
+ * returns 1 if the complete header must be read */
+static int probe_header(cipher_t *c, const char *probe, uint32_t no) {
+	char plain[16];
 
-			dllarr_remove(&dev->b->unallocated, bi);
-			bi->dev = dev;
-			blockio_prepare_block(bi);
-			juggler_add_macroblock(&dev->j, bi);
-		}	
-	}
-
-	pthd_mutex_unlock(&b->unallocated_mutex);
-
-	if (dev->no_macroblocks !=
-			dllarr_count(&dev->replay) + juggler_count(&dev->j))
-		FATAL("count of macroblocks does not match "
-				"the amount of blocks we have");
-}
+	if (!cipher_dec_part(c, plain, probe, 0, 0, no,
+				MAGIC64_OFFSET, sizeof(plain))) return 1;
 
-static void sort_to_replay(dllarr_t *replay, blockio_info_t *bi) {
-	void *compare_seqno(blockio_info_t *bi, uint64_t *seqno) {
-		assert(*seqno != bi->seqno);
-		if (*seqno > bi->seqno) return NULL;
-		else return bi;
-	}
-	dllarr_insert(replay, bi, dllarr_iterate(replay,
-				(dllarr_iterator_t)compare_seqno,
-				&bi->seqno));
+	return header_format(plain) != 0;
 }
 
-void blockio_dev_scan_header(dllarr_t *replay, blockio_dev_t *dev,
-		blockio_info_t *bi, uint64_t *seqno) {
-	assert(dev && dev->b);
+/* a header that belongs to devs[dev], found by a scan task */
+typedef struct scan_match_s {
+	uint32_t dev;
+	uint32_t no;
+	uint64_t seqno, next_seqno;
+	char data_hash[32];
+	uint32_t no_indices;
+	uint32_t *indices;
+} scan_match_t;
+
+/* scans count candidate macroblocks, starting at nos, for
+ * all devices that are being opened */
+typedef struct scan_task_s {
+	blockio_dev_t **devs;
+	uint32_t no_devs;
+	const uint32_t *nos;
+	uint32_t count;
+
+	scan_match_t *matches;
+	uint32_t no_matches, size;
+
+	/* decrypted header with the highest seqno, per device */
+	char **best;
+	uint64_t *best_seqno;
+} scan_task_t;
+
+/* header is the (encrypted) first mesoblock of the macroblock, it is
+ * decrypted in base, returns 1 and fills in m if it belongs to us */
+static int parse_header(blockio_dev_t *dev, cipher_t *c, char *base,
+		const void *header, uint32_t no, scan_match_t *m) {
 	int i;
 	char zero[128] = { };
-	uint32_t no = bi - dev->b->blockio_infos;
-
-	assert(no < dev->b->total_macroblocks);
-
 	char sha256[32];
 
-	if (bi->dev) {
-		//VERBOSE("macroblock %d already taken", no);
-		return;
-	}
-
-	/* read header */
-	dev->b->read(dev->io, BASE, ((off_t)no)<<dev->b->macroblock_log,
-			1<<dev->b->mesoblk_log);
-
 	// decrypt indexblock with IV=0: ciphertext is unique due to
 	// first block being a hash of the whole index and the index
 	// containing a unique seqno (ONLY TRUE FOR CBC(LIKE)!!!!!)
 	//
 	// the seqno is used as IV for all the other mesoblocks
 	// in the datablock
-	cipher_dec(dev->c, BASE, BASE, 0, 0, no);
+	cipher_dec(c, BASE, header, 0, 0, no);
 
 	/* check magic */
-	if (memcmp(magic, MAGIC64, sizeof(magic))) {
-//		DEBUG("magic \"%.*s\" not found in macroblock %u",
-//				(int)sizeof(magic), magic, no);
-		return;
-	} //else DEBUG("magic \"%.*s\" found in macroblock %u",
-	//		(int)sizeof(magic), magic, no);
-
+	if (!header_format(MAGIC64)) return 0;
 
 	/* check indexblock hash */
 	gcry_md_hash_buffer(GCRY_MD_SHA256, sha256, BASE + sizeof(sha256),
 			(1<<dev->b->mesoblk_log) - sizeof(sha256));
 	if (memcmp(INDEXBLOCK_SHA256, sha256, sizeof(sha256))) {
 		DEBUG("sha256 hash of index block %d failed", no);
-		return;
+		return 0;
 	}
 
 	/* block seems to belong to us */
 	/* store the hash of the datablocks, seqno and next_seqno */
-	memcpy(bi->data_hash, DATABLOCKS_SHA256, 32);
-	bi->seqno = binio_read_uint64_be(SEQNO_UINT64);
-	bi->next_seqno = binio_read_uint64_be(NEXT_SEQNO_UINT64);
+	m->no = no;
+	memcpy(m->data_hash, DATABLOCKS_SHA256, 32);
+	m->seqno = binio_read_uint64_be(SEQNO_UINT64);
+	m->next_seqno = binio_read_uint64_be(NEXT_SEQNO_UINT64);
 
 	if (memcmp(zero, RESERVED_SPACE1024, 128))
 		FATAL("reserved space is not zeroed out");
-	if (bi->seqno == 0) 
+	if (m->seqno == 0) 
 		FATAL("block found with seqno 0, not possibile");
-	if (bi->next_seqno <= bi->seqno)
+	if (m->next_seqno <= m->seqno)
 		FATAL("block found with seqno >= next_seqno, not possible");
 
-	bi->no_nonobsolete = bi->no_indices =
-		binio_read_uint32_be(NO_INDICES_UINT32);
-	bi->indices = ecalloc(dev->b->mmpm, sizeof(uint32_t));
+	m->no_indices = binio_read_uint32_be(NO_INDICES_UINT32);
+	m->indices = ecalloc(dev->b->mmpm, sizeof(uint32_t));
 	
-	for (i = 1; i <= bi->no_indices; i++) {
-		bi->indices[i-1] = binio_read_uint32_be(
+	for (i = 1; i <= m->no_indices; i++) {
+		m->indices[i-1] = binio_read_uint32_be(
 				((uint32_t*)NO_INDICES_UINT32) + i);
 	}
 
@@ -412,50 +1052,470 @@ void blockio_dev_scan_header(dllarr_t *replay, blockio_dev_t *dev,
 
 	VERBOSE("block %u (seqno=%lu) of \"%s\" has %d indices, "
 			"next_seqno=%lu",
-			no, bi->seqno, dev->name, bi->no_indices,
-			bi->next_seqno);
+			no, m->seqno, dev->name, m->no_indices,
+			m->next_seqno);
+
+	return 1;
+}
+
+static cipher_t *worker_cipher(blockio_dev_t *dev, uint32_t worker) {
+	return dev->b->pool.no_threads?&dev->ciphers[worker]:dev->c;
+}
+
+/* runs in the worker pool, with its own I/O handle; probes the
+ * candidates queue_depth at a time, the complete header is only
+ * read if the magic matches with the key of one of the devices,
+ * so every header is read once, whatever the number of devices */
+static void scan_task(void *arg, uint32_t worker) {
+	scan_task_t *t = arg;
+	blockio_t *b = t->devs[0]->b;
+	uint32_t nos[b->queue_depth], probe_size = PROBE_SIZE, i = 0, k;
+	blockio_req_t reqs[b->queue_depth];
+	char *headers = ecalloc_aligned(BLOCKIO_ALIGN,
+			((size_t)b->queue_depth)<<b->mesoblk_log);
+	char base[1<<b->mesoblk_log];
+	char *probes, *bufs[b->queue_depth];
+	void *io = b->open(b->open_priv);
+	scan_match_t *m;
+
+	if (probe_size < b->io_align) probe_size = b->io_align;
+	probes = ecalloc_aligned(BLOCKIO_ALIGN,
+			((size_t)b->queue_depth)*probe_size);
+
+	while (i < t->count) {
+		uint32_t n = 0, no_read = 0, no_full = 0, j;
+
+		/* only the probes that are not in the header cache
+		 * are read, the others are copied from the cache */
+		for (; i < t->count && n < b->queue_depth; i++) {
+			nos[n] = t->nos[i];
+			bufs[n] = probes + n*probe_size;
+			n++;
+			if (hdrcache_get(&b->hdrcache, bufs[n-1], nos[n-1]))
+				continue;
+			reqs[no_read].buf = bufs[n-1];
+			reqs[no_read].offset =
+				((off_t)nos[n-1])<<b->macroblock_log;
+			reqs[no_read].size = probe_size;
+			no_read++;
+		}
+
+		if (no_read) blockio_read_batch(b, io, reqs, no_read);
+
+		/* a block that was claimed meanwhile may have been
+		 * written by its device, which updated the cache itself,
+		 * so our probe may be stale; the claim takes the mutex */
+		pthd_mutex_lock(&b->unallocated_mutex);
+		for (j = 0; j < no_read; j++) {
+			k = reqs[j].offset>>b->macroblock_log;
+			if (!b->blockio_infos[k].dev)
+				hdrcache_put(&b->hdrcache, reqs[j].buf, k);
+		}
+		pthd_mutex_unlock(&b->unallocated_mutex);
+
+		for (j = 0; j < n; j++) {
+			for (k = 0; k < t->no_devs; k++)
+				if (probe_header(worker_cipher(t->devs[k],
+								worker),
+							bufs[j], nos[j]))
+					break;
+			if (k == t->no_devs) continue;
+			nos[no_full] = nos[j];
+			reqs[no_full].buf =
+				headers + (no_full<<b->mesoblk_log);
+			reqs[no_full].offset =
+				((off_t)nos[j])<<b->macroblock_log;
+			reqs[no_full].size = 1<<b->mesoblk_log;
+			no_full++;
+		}
+
+		if (!no_full) continue;
+
+		blockio_read_batch(b, io, reqs, no_full);
+
+		for (j = 0; j < no_full; j++) {
+			if (t->no_matches == t->size) {
+				t->size = t->size?2*t->size:16;
+				t->matches = erealloc(t->matches, t->size,
+						sizeof(scan_match_t));
+			}
+			m = &t->matches[t->no_matches];
+
+			/* the probe is repeated on the complete header, a
+			 * key only gets a full trial decryption if its
+			 * probe matches or if it cannot probe */
+			for (k = 0; k < t->no_devs; k++) {
+				cipher_t *c = worker_cipher(t->devs[k], worker);
+
+				if (probe_header(c, reqs[j].buf, nos[j]) &&
+						parse_header(t->devs[k], c,
+							base, reqs[j].buf,
+							nos[j], m)) break;
+			}
+
+			if (k == t->no_devs) continue;
+
+			m->dev = k;
+
+			if (m->seqno > t->best_seqno[k]) {
+				t->best_seqno[k] = m->seqno;
+				if (!t->best[k]) t->best[k] =
+					ecalloc(1, 1<<b->mesoblk_log);
+				memcpy(t->best[k], base, 1<<b->mesoblk_log);
+			}
+
+			t->no_matches++;
+		}
+	}
+
+	wipememory(base, sizeof(base));
+	b->close(io);
+	free(probes);
+	free(headers);
+}
+
+/* by device, then by seqno */
+static int match_cmp(const void *a, const void *b) {
+	const scan_match_t *m1 = a, *m2 = b;
+
+	if (m1->dev != m2->dev) return m1->dev < m2->dev?-1:1;
+
+	assert(m1->seqno != m2->seqno);
+
+	return m1->seqno < m2->seqno?-1:1;
+}
 
-	dllarr_remove(&dev->b->unallocated, bi);
-	sort_to_replay(replay, bi);
+/* take ownership of the blocks of dev that were found, they are
+ * in the replay list in order of seqno, and of the other blocks that
+ * are USED according to the bitmap of the block with the highest
+ * seqno, they go to the juggler; the caller has the unallocated_mutex */
+static void claim_blocks(blockio_dev_t *dev, char *best,
+		scan_match_t *matches, uint32_t no_matches) {
+	blockio_t *b = dev->b;
+	blockio_info_t *bi;
+	uint32_t i;
 
-	assert(bi->seqno != *seqno);
-	if (bi->seqno > *seqno) { // candidate found for highest seqno
-		*seqno = bi->seqno;
+	if (best) {
+		char *base = best;
 
 		bitmap_read(&dev->status, (uint32_t*)BITMAP);
 
 		memcpy(dev->seqnos_hash, SEQNOS_SHA256, 32);
+		dev->format = header_format(MAGIC64);
 
 		dev->no_macroblocks = binio_read_uint32_be(
 				NO_MACROBLOCKS_UINT32);
 		dev->reserved_macroblocks = binio_read_uint32_be(
 				RESERVED_BLOCKS_UINT32);
+	}
+
+	for (i = 0; i < no_matches; i++) {
+		bi = &b->blockio_infos[matches[i].no];
+
+		/* allocation waits for us and the other scans only
+		 * claim the blocks of their own devices */
+		assert(!bi->dev);
+
+		memcpy(bi->data_hash, matches[i].data_hash, 32);
+		bi->seqno = matches[i].seqno;
+		bi->next_seqno = matches[i].next_seqno;
+		bi->no_nonobsolete = bi->no_indices = matches[i].no_indices;
+		bi->indices = matches[i].indices;
+
+		idset_remove(&b->unallocated, matches[i].no);
+		dllarr_append(&dev->replay, bi);
+
+		/* mark the block as ours */
+		bi->dev = dev;
+	}
+
+	for (i = 0; dllarr_count(&dev->replay) && i < b->max_macroblocks;
+			i++) {
+		if (blockio_dev_get_macroblock_status_bynum(dev, i) == USED) {
+			if (i >= b->total_macroblocks)
+				FATAL("macroblock marked as USED that "
+						"does not exist");
+
+			bi = &b->blockio_infos[i];
+			if (bi->dev == dev) continue; // ok
+			else if (bi->dev)
+				FATAL("block %u USED by us but claimed "
+						"by another device", i);
 
-		//VERBOSE("block %u is candidate for highest seqno", no);
+			idset_remove(&b->unallocated, i);
+			bi->dev = dev;
+			blockio_prepare_block(bi);
+			juggler_add_macroblock(&dev->j, bi);
+		}	
 	}
+}
+
+static void scan_done(blockio_t *b) {
+	assert(b->scans);
+	if (!--b->scans) pthd_cond_broadcast(&b->scans_cond);
+}
+
+/* find the macroblocks of the devices, the unowned blocks are divided
+ * over the workers of the pool, the unallocated_mutex is only held
+ * to get the candidates and to claim the blocks we found; the
+ * candidates can not be allocated in between, see scans */
+static void scan_headers(blockio_dev_t **devs, uint32_t no_devs) {
+	blockio_t *b = devs[0]->b;
+	uint32_t *nos = ecalloc(b->total_macroblocks, sizeof(uint32_t));
+	uint32_t count = 0, no_tasks, per_task, no_matches = 0, i, k, start;
+	scan_match_t *matches;
+	char *best[no_devs];
+	uint64_t best_seqno[no_devs];
+
+	pthd_mutex_lock(&b->unallocated_mutex);
+	for (i = 0; i < b->total_macroblocks; i++)
+		if (!b->blockio_infos[i].dev) nos[count++] = i;
+	if (count) b->scans++;
+	pthd_mutex_unlock(&b->unallocated_mutex);
+
+	if (!count) {
+		free(nos);
+		return;
+	}
+
+	/* a few tasks per worker, so that they can be balanced */
+	no_tasks = 4*(b->pool.no_threads?b->pool.no_threads:1);
+	per_task = (count + no_tasks - 1)/no_tasks;
+	if (per_task < b->queue_depth) per_task = b->queue_depth;
+	no_tasks = (count + per_task - 1)/per_task;
+
+	workpool_task_t tasks[no_tasks];
+	scan_task_t scans[no_tasks];
+
+	for (i = 0; i < no_tasks; i++) {
+		memset(&scans[i], 0, sizeof(scan_task_t));
+		scans[i].devs = devs;
+		scans[i].no_devs = no_devs;
+		scans[i].nos = nos + i*per_task;
+		scans[i].count = (i == no_tasks - 1)?
+			count - i*per_task:per_task;
+		scans[i].best = ecalloc(no_devs, sizeof(char*));
+		scans[i].best_seqno = ecalloc(no_devs, sizeof(uint64_t));
+		tasks[i].fn = scan_task;
+		tasks[i].arg = &scans[i];
+	}
+
+	workpool_submit(&b->pool, tasks, no_tasks);
+
+	for (k = 0; k < no_devs; k++) {
+		best[k] = NULL;
+		best_seqno[k] = 0;
+	}
+
+	for (i = 0; i < no_tasks; i++) {
+		workpool_wait(&b->pool, &tasks[i]);
+		no_matches += scans[i].no_matches;
+		for (k = 0; k < no_devs; k++)
+			if (scans[i].best_seqno[k] > best_seqno[k]) {
+				best_seqno[k] = scans[i].best_seqno[k];
+				best[k] = scans[i].best[k];
+			}
+	}
+
+	DEBUG("probed %u headers of unowned macroblocks for %u device(s) "
+			"in %u tasks, %u matches",
+			count, no_devs, no_tasks, no_matches);
+
+	/* merge and sort by device and seqno */
+	matches = ecalloc(no_matches + 1, sizeof(scan_match_t));
+	for (i = 0, k = 0; i < no_tasks; i++) {
+		memcpy(matches + k, scans[i].matches,
+				scans[i].no_matches*sizeof(scan_match_t));
+		k += scans[i].no_matches;
+		free(scans[i].matches);
+	}
+	qsort(matches, no_matches, sizeof(scan_match_t), match_cmp);
+
+	pthd_mutex_lock(&b->unallocated_mutex);
+	for (k = 0, start = 0; k < no_devs; k++) {
+		for (i = start; i < no_matches && matches[i].dev == k; i++);
+		claim_blocks(devs[k], best[k], matches + start, i - start);
+		start = i;
+	}
+	scan_done(b);
+	pthd_mutex_unlock(&b->unallocated_mutex);
+
+	for (i = 0; i < no_tasks; i++) {
+		for (k = 0; k < no_devs; k++) if (scans[i].best[k]) {
+			wipememory(scans[i].best[k], 1<<b->mesoblk_log);
+			free(scans[i].best[k]);
+		}
+		free(scans[i].best);
+		free(scans[i].best_seqno);
+	}
+	free(matches);
+	free(nos);
+}
+
+/* the key of the digest of the schedule is derived from the
+ * device key, by encrypting a mesoblock with an IV that is
+ * never used for data (there is no seqno UINT64_MAX) */
+static void digest_key(blockio_dev_t *dev) {
+	char *buf = ecalloc(1, 1<<dev->b->mesoblk_log);
+
+	cipher_enc(dev->c, buf, buf, UINT64_MAX, 0, 0);
+	juggler_digest_init(&dev->j, buf, 32);
+	wipememory(buf, 1<<dev->b->mesoblk_log);
+	free(buf);
+}
+
+static void dev_setup(blockio_dev_t *dev, blockio_t *b, cipher_t *c) {
+	int i; 
+
+	assert(b && c);
+	assert(b->mesoblk_log < b->macroblock_log);
+	random_init(&dev->r);
+	dllarr_init(&dev->replay, offsetof(blockio_info_t, ur));
+	bitmap_init(&dev->status, b->max_macroblocks);
+	juggler_init(&dev->j, &dev->r);
+	cache_init(&dev->cache, b->cache_size, b->mesoblk_log);
+
+	dev->b = b;
+	dev->c = c;
+	dev->format = BLOCKIO_FORMAT_DIGEST;
+	digest_key(dev);
+
+	/* every worker needs its own copy of the cipher */
+	if (b->pool.no_threads) dev->ciphers =
+		ecalloc(b->pool.no_threads, sizeof(cipher_t));
+	for (i = 0; i < b->pool.no_threads; i++)
+		cipher_dup(&dev->ciphers[i], c);
+
+	assert(bitmap_size(&dev->status) + 260 + (dev->b->mmpm<<2) ==
+			1<<dev->b->mesoblk_log);
+
+	assert(b->open);
+	dev->io = (b->open)(b->open_priv);
+
+	pthd_mutex_init(&dev->readers_mutex);
+	pthd_cond_init(&dev->readers_cond);
+
+	writer_start(dev);
+}
+
+static void dev_check(blockio_dev_t *dev) {
+	if (!dllarr_count(&dev->replay)) return;
+
+	VERBOSE("we currently got %d blocks, and we expect %d blocks",
+			dllarr_count(&dev->replay), dev->no_macroblocks);
 
-	/* mark the block as ours */
-	bi->dev = dev;
+	if (dev->no_macroblocks !=
+			dllarr_count(&dev->replay) + juggler_count(&dev->j))
+		FATAL("count of macroblocks does not match "
+				"the amount of blocks we have");
 }
 
-void blockio_dev_read_mesoblk_part(blockio_dev_t *dev, void *buf, uint32_t id,
-		uint32_t no, uint32_t offset, uint32_t len) {
+void blockio_dev_init(blockio_dev_t *dev, blockio_t *b, cipher_t *c,
+		const char *name) {
+	blockio_dev_init_many(&dev, b, &c, 1);
+}
+
+/* initialize several devices with one scan of the base device,
+ * each header is trial-decrypted with all keys */
+void blockio_dev_init_many(blockio_dev_t **devs, blockio_t *b,
+		cipher_t **cs, uint32_t no_devs) {
+	uint32_t i;
+	assert(devs && cs && no_devs > 0);
+
+	for (i = 0; i < no_devs; i++) dev_setup(devs[i], b, cs[i]);
+
+	scan_headers(devs, no_devs);
+
+	for (i = 0; i < no_devs; i++) dev_check(devs[i]);
+}
+
+
+void blockio_dev_read_mesoblk_part(blockio_dev_t *dev, blockio_reader_t *r,
+		void *buf, uint32_t id, uint32_t no, uint64_t seqno,
+		uint32_t offset, uint32_t len) {
 	assert(dev->b && dev->b->read && id < dev->b->total_macroblocks &&
 			no < dev->b->mmpm);
 	unsigned char mesoblk[1<<dev->b->mesoblk_log];
 
-	/* FIXME: maybe do some caching */
-	blockio_dev_read_mesoblk(dev, mesoblk, id, no);
+	if (cache_get(&dev->cache, buf, id, no, seqno, offset, len)) return;
+
+	blockio_dev_read_mesoblk(dev, r, mesoblk, id, no, seqno);
+	cache_put(&dev->cache, mesoblk, id, no, seqno, 0);
 	memcpy(buf, mesoblk + offset, len);
+	wipememory(mesoblk, 1<<dev->b->mesoblk_log);
 }
 
-void blockio_dev_read_mesoblk(blockio_dev_t *dev,
-		void *buf, uint32_t id, uint32_t no) {
-	dev->b->read(dev->io, buf, (((off_t)id)<<dev->b->macroblock_log) +
+void blockio_dev_read_mesoblk(blockio_dev_t *dev, blockio_reader_t *r,
+		void *buf, uint32_t id, uint32_t no, uint64_t seqno) {
+	blockio_dev_wait_written(dev, id);
+	dev->b->read(r?r->io:dev->io, buf,
+			(((off_t)id)<<dev->b->macroblock_log) +
 			((no + 1)<<dev->b->mesoblk_log) +
 			0, 1<<dev->b->mesoblk_log);
-	cipher_dec(dev->c, buf, buf, dev->b->blockio_infos[id].seqno,
-			no + 1, id);
+	cipher_dec(r?&r->c:dev->c, buf, buf, seqno, no + 1, id);
+}
+
+/* read count mesoblocks that are stored in consecutive slots of
+ * macroblock id with one read and decrypt them in place */
+void blockio_dev_read_mesoblks(blockio_dev_t *dev, blockio_reader_t *r,
+		void *buf, uint32_t id, uint32_t no, uint64_t seqno,
+		uint32_t count) {
+	cipher_req_t reqs[count];
+	uint32_t i;
+	assert(dev->b && dev->b->read && id < dev->b->total_macroblocks &&
+			count > 0 && no + count <= dev->b->mmpm);
+
+	blockio_dev_wait_written(dev, id);
+	dev->b->read(r?r->io:dev->io, buf,
+			(((off_t)id)<<dev->b->macroblock_log) +
+			((no + 1)<<dev->b->mesoblk_log),
+			count<<dev->b->mesoblk_log);
+
+	for (i = 0; i < count; i++) {
+		reqs[i].out = buf + (i<<dev->b->mesoblk_log);
+		reqs[i].in = reqs[i].out;
+		reqs[i].iv0 = seqno;
+		reqs[i].iv1 = no + i + 1;
+		reqs[i].iv2 = id;
+	}
+	cipher_dec_batch(r?&r->c:dev->c, reqs, count);
+}
+
+/* read the mesoblocks nos[0..count) of macroblock id into consecutive
+ * mesoblocks of buf, with at most queue_depth requests in flight, the
+ * mesoblocks that are in consecutive slots are read with one request */
+void blockio_dev_read_mesoblk_list(blockio_dev_t *dev, void *buf,
+		uint32_t id, const uint32_t *nos, uint32_t count) {
+	blockio_req_t reqs[dev->b->queue_depth];
+	cipher_req_t creqs[count];
+	uint32_t i = 0, n, run;
+	assert(dev->b && id < dev->b->total_macroblocks && nos);
+
+	blockio_dev_wait_written(dev, id);
+
+	while (i < count) {
+		for (n = 0; i < count && n < dev->b->queue_depth; n++) {
+			assert(nos[i] < dev->b->mmpm);
+			for (run = 1; i + run < count &&
+					nos[i + run] == nos[i] + run; run++);
+			reqs[n].buf = buf + (i<<dev->b->mesoblk_log);
+			reqs[n].offset = (((off_t)id)<<dev->b->macroblock_log) +
+				((nos[i] + 1)<<dev->b->mesoblk_log);
+			reqs[n].size = run<<dev->b->mesoblk_log;
+			i += run;
+		}
+
+		blockio_read_batch(dev->b, dev->io, reqs, n);
+	}
+
+	for (i = 0; i < count; i++) {
+		creqs[i].out = buf + (i<<dev->b->mesoblk_log);
+		creqs[i].in = creqs[i].out;
+		creqs[i].iv0 = dev->b->blockio_infos[id].seqno;
+		creqs[i].iv1 = nos[i] + 1;
+		creqs[i].iv2 = id;
+	}
+	cipher_dec_batch(dev->c, creqs, count);
 }
 
 int blockio_check_data_hash(blockio_info_t *bi) {
@@ -464,6 +1524,8 @@ int blockio_check_data_hash(blockio_info_t *bi) {
 		(1<<bi->dev->b->mesoblk_log);
 	char data[size];
 	char hash[32];
+
+	blockio_dev_wait_written(bi->dev, id);
 	bi->dev->b->read(bi->dev->io, data,
 			(((off_t)id)<<bi->dev->b->macroblock_log) +
 			(1<<bi->dev->b->mesoblk_log), size);
@@ -477,8 +1539,13 @@ int blockio_check_data_hash(blockio_info_t *bi) {
 	return 1;
 }
 
+/* fill in the index of the current macroblock and queue it for the
+ * writer thread, the next buffer is available immediately, unless
+ * all buffers are in flight */
 void blockio_dev_write_current_macroblock(blockio_dev_t *dev) {
 	uint32_t id = blockio_get_macroblock_index(dev->bi);
+	char *base = dev->tmp_macroblock;
+	blockio_wbuf_t *w = NULL;
 	int i;
 	assert(dev->bi && id < dev->b->total_macroblocks);
 	
@@ -493,25 +1560,13 @@ void blockio_dev_write_current_macroblock(blockio_dev_t *dev) {
 				0, 1<<dev->b->mesoblk_log);
 	}
 
-	/* encrypt datablocks (also the unused ones) */
-	for (i = 1; i <= dev->b->mmpm; i++)
-		cipher_enc(dev->c, BASE + (i<<dev->b->mesoblk_log),
-			BASE + (i<<dev->b->mesoblk_log),
-			dev->bi->seqno, i, id);
-
-	/* calculate hash of data, store in index */
-	gcry_md_hash_buffer(GCRY_MD_SHA256, DATABLOCKS_SHA256,
-			BASE + (1<<dev->b->mesoblk_log),
-			dev->b->mmpm<<dev->b->mesoblk_log);
-	//verbose_buffer("sha256_data", DATABLOCKS_HASH, 32);
-
 	/* calculate hash of seqnos */
-	juggler_hash_scheduled_seqnos(&dev->j, SEQNOS_SHA256);
+	blockio_dev_seqnos_hash(dev, SEQNOS_SHA256);
 
 	/* write static data */
 	binio_write_uint64_be(SEQNO_UINT64, dev->bi->seqno);
 	binio_write_uint64_be(NEXT_SEQNO_UINT64, dev->bi->next_seqno);
-	memcpy(MAGIC64, magic, sizeof(magic));
+	memcpy(MAGIC64, magics[dev->format - 1], sizeof(magics[0]));
 	binio_write_uint32_be(RESERVED_BLOCKS_UINT32,
 			dev->reserved_macroblocks);
 	binio_write_uint32_be(NO_MACROBLOCKS_UINT32, dev->no_macroblocks);
@@ -529,18 +1584,33 @@ void blockio_dev_write_current_macroblock(blockio_dev_t *dev) {
 
 	bitmap_write((uint32_t*)(BASE + dev->b->bitmap_offset), &dev->status);
 
-	/* calculate hash of indexblock */
-	gcry_md_hash_buffer(GCRY_MD_SHA256, INDEXBLOCK_SHA256,
-			dev->tmp_macroblock + 32 /* size of hash */,
-			(1<<dev->b->mesoblk_log) - 32 /* size of hash */);
+	pthd_mutex_lock(&dev->writer_mutex);
 
-	/* encrypt index */
-	cipher_enc(dev->c, BASE, BASE, 0, 0, id);
+	for (i = 0; i < BLOCKIO_WRITE_BUFFERS; i++)
+		if (dev->wbufs[i].data == base) w = &dev->wbufs[i];
+	assert(w && !w->queued);
 
-	dev->b->write(dev->io, BASE, ((off_t)id)<<dev->b->macroblock_log,
-			1<<dev->b->macroblock_log);
+	w->id = id;
+	w->seqno = dev->bi->seqno;
+	w->queued = 1;
+	dev->wqueue[(dev->whead + dev->wlen)%BLOCKIO_WRITE_BUFFERS] = w;
+	dev->wlen++;
+	pthd_cond_broadcast(&dev->writer_cond);
+
+	/* backpressure */
+	if (dev->wlen == BLOCKIO_WRITE_BUFFERS) dev->write_stalls++;
+	while (dev->wlen == BLOCKIO_WRITE_BUFFERS)
+		pthd_cond_wait(&dev->writer_cond, &dev->writer_mutex);
 
+	for (i = 0; i < BLOCKIO_WRITE_BUFFERS; i++)
+		if (!dev->wbufs[i].queued) break;
+	dev->tmp_macroblock = dev->wbufs[i].data;
+
+	pthd_mutex_unlock(&dev->writer_mutex);
+
+	blockio_dev_seq_write_begin(dev);
 	dev->bi = NULL; /* there is no current block */
+	blockio_dev_seq_write_end(dev);
 }
 
 blockio_dev_macroblock_status_t blockio_dev_get_macroblock_status_bynum(
@@ -582,16 +1652,21 @@ int blockio_dev_allocate_macroblocks(blockio_dev_t *dev, uint32_t size) {
 
 	pthd_mutex_lock(&dev->b->unallocated_mutex);
 
-	if (dllarr_count(&dev->b->unallocated) < size) {
+	/* the candidates of a scan must stay unowned until it claims */
+	while (dev->b->scans)
+		pthd_cond_wait(&dev->b->scans_cond, &dev->b->unallocated_mutex);
+
+	if (idset_count(&dev->b->unallocated) < size) {
 		err = -1; // not enough unclaimed blocks avaiable
 		// fall through to unlock
 	} else while (size--) {
 		blockio_info_t *bi;
-		uint32_t no = random_custom(&dev->r,
-				dllarr_count(&dev->b->unallocated));
+		uint32_t no = idset_nth(&dev->b->unallocated,
+				random_custom(&dev->r,
+					idset_count(&dev->b->unallocated)));
 
-		bi = dllarr_remove(&dev->b->unallocated,
-					dllarr_nth(&dev->b->unallocated, no));
+		idset_remove(&dev->b->unallocated, no);
+		bi = &dev->b->blockio_infos[no];
 
 		bi->dev = dev;
 
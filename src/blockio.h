@@ -25,6 +25,14 @@
 #include "bitmap.h"
 #include "random.h"
 #include "pthd.h"
+#include "cache.h"
+#include "workpool.h"
+#include "hdrcache.h"
+#include "idset.h"
+
+/* buffers that are passed to the I/O engine should be aligned at this,
+ * otherwise the direct engine has to copy them */
+#define BLOCKIO_ALIGN	4096
 
 typedef struct blockio_info_s blockio_info_t;
 
@@ -33,10 +41,63 @@ typedef struct blockio_info_s blockio_info_t;
 
 typedef struct blockio_s blockio_t;
 
+/* a base of the form mem:BLOCKS is kept in memory */
+#define BLOCKIO_MEM_PREFIX "mem:"
+
+/* passed to the open function of the I/O engine */
+typedef struct blockio_file_s {
+	char *path;
+	uint32_t queue_depth; /* max requests in flight */
+
+	/* the mem backend, written has a bit for each mesoblock */
+	char *mem;
+	uint64_t size;
+	uint8_t mem_log;
+	uint64_t *written;
+} blockio_file_t;
+
+/* one request of a batch */
+typedef struct blockio_req_s {
+	void *buf;
+	uint64_t offset;
+	uint32_t size;
+} blockio_req_t;
+
+/* a filled macroblock, the writer thread seals and writes it */
+typedef struct blockio_wbuf_s {
+	char *data;
+	uint32_t id;
+	uint64_t seqno;
+	int queued; /* waiting for or being handled by the writer */
+} blockio_wbuf_t;
+
+/* formats of the header, they differ in the hash of the seqnos of
+ * the scheduled blocks: format 1 has the SHA256 hash of the seqnos in
+ * order of next_seqno, format 2 has a digest that is kept up to date
+ * by the juggler (keyed by the device key); new devices get format 2 */
+#define BLOCKIO_FORMAT_SHA256	1
+#define BLOCKIO_FORMAT_DIGEST	2
+
+/* buffers for filled macroblocks per device, one is filled while
+ * the others are sealed and written in the background */
+#define BLOCKIO_WRITE_BUFFERS	2
+
+/* max concurrent readers per device, each has its own
+ * cipher context and handle on the base device */
+#define BLOCKIO_READERS	8
+
+/* a reader context, readers of a device run in parallel with
+ * each other and with the writer (which uses c and io of the device) */
+typedef struct blockio_reader_s {
+	cipher_t c;
+	void *io;
+	struct blockio_reader_s *next; /* on the free list */
+} blockio_reader_t;
+
 struct blockio_info_s {
 	struct blockio_info_s *next; // for use with random juggler
 
-	dllarr_elt_t ur; // for unallocated and replay (possibly juggler?)
+	dllarr_elt_t ur; // for replay (possibly juggler?)
 	uint64_t seqno, next_seqno;
 	char data_hash[32];
 	//char seqnos_hash[32];
@@ -53,7 +114,9 @@ typedef struct blockio_dev_s {
 	char *name;
 	blockio_t *b;
 	cipher_t *c;
+	cipher_t *ciphers; /* a copy of c for each worker of the pool */
 	char seqnos_hash[32];
+	int format; /* BLOCKIO_FORMAT_* */
 	dllarr_t replay;
 	int updated; /* do we need to write this block? */
 	bitmap_t status; // record status of all macroblocks with
@@ -68,15 +131,45 @@ typedef struct blockio_dev_s {
 	juggler_t j;
 
 	/* here we build the macroblock
-	 * to be written out to disk */
+	 * to be written out to disk, it is the data
+	 * of one of the buffers that are not queued */
 	char *tmp_macroblock;
 
+	/* write-behind, the writer thread has its own cipher and io
+	 * handle, wqueue, whead and wlen and the queued flag of the
+	 * buffers are protected by writer_mutex */
+	blockio_wbuf_t wbufs[BLOCKIO_WRITE_BUFFERS];
+	blockio_wbuf_t *wqueue[BLOCKIO_WRITE_BUFFERS];
+	uint32_t whead, wlen;
+	pthread_t writer;
+	pthread_mutex_t writer_mutex;
+	pthread_cond_t writer_cond;
+	int writer_stop;
+	cipher_t writer_c;
+	void *writer_io;
+
+	/* reader contexts, created on demand */
+	blockio_reader_t readers[BLOCKIO_READERS];
+	blockio_reader_t *free_readers;
+	uint32_t no_readers;
+	pthread_mutex_t readers_mutex;
+	pthread_cond_t readers_cond;
+
+	/* seqcount, odd while the writer changes bi, the seqnos of
+	 * the blocks or the mapping of mesoblocks to blocks, so that
+	 * readers can find a mesoblock without waiting for the writer */
+	uint32_t seq;
+
 	// use one random_t per dev, to avoid locking issues
 	random_t r;
 
+	/* decrypted mesoblocks that were read from disk */
+	cache_t cache;
+
 	/* stats */
 
 	uint32_t writes; // no macroblocks
+	uint32_t write_stalls; // all write buffers were in flight
 
 	void *io;
 } blockio_dev_t;
@@ -88,12 +181,17 @@ struct blockio_s {
 	uint32_t max_macroblocks;
 	uint32_t bitmap_offset;
 	
-	/* the mutex protects the unallocated list
+	/* the mutex protects the unallocated set
 	 * and the associated *bi->dev pointer in each
 	 * blockio_info_t, which is * NULL if and only if
 	 * the block is in unallocated */
 	pthread_mutex_t unallocated_mutex;
-	dllarr_t unallocated;
+	idset_t unallocated;
+
+	/* scans in progress, allocation waits until they have
+	 * claimed their blocks; protected by unallocated_mutex */
+	uint32_t scans;
+	pthread_cond_t scans_cond;
 
 	/* provide access to the thread that takes care of writing blocks
 	 * (either on it's own or at the request of (a) scubed3 partition(s) */
@@ -102,40 +200,91 @@ struct blockio_s {
 	uint8_t mesoblk_log;
 	uint16_t mmpm; /* max mesoblocks per macroblock */
 
+	uint32_t cache_size; /* mesoblocks in the read cache of each device */
+	uint32_t readahead; /* max readahead window, in mesoblocks */
+
+	/* encrypts and hashes macroblocks for all devices */
+	workpool_t pool;
+
+	/* raw headers of macroblocks, shared by all scans */
+	hdrcache_t hdrcache;
+
 	blockio_info_t *blockio_infos;
 
 	void *(*open)(const void*);
-	void *open_priv; /* filename, required for open */
+	void *open_priv; /* blockio_file_t, required for open */
 	void (*read)(void*, void*, uint64_t, uint32_t);
 	void (*write)(void*, const void*, uint64_t, uint32_t);
 	void (*close)(void*);
+	void (*sync)(void*);
+
+	/* optional, engines that can have multiple requests
+	 * in flight, use blockio_{read,write}_batch */
+	void (*read_batch)(void*, blockio_req_t*, uint32_t);
+	void (*write_batch)(void*, blockio_req_t*, uint32_t);
+	uint32_t queue_depth;
+	uint32_t io_align; /* sizes of requests must be a multiple of this */
 };
 
 uint32_t blockio_get_macroblock_index(blockio_info_t*);
 
-void blockio_init_file(blockio_t*, const char*, uint8_t, uint8_t);
+void blockio_init_file(blockio_t*, const char*, const char*, uint32_t,
+		uint8_t, uint8_t);
+
+void blockio_hdrcache_init(blockio_t*, size_t);
+
+void blockio_read_batch(blockio_t*, void*, blockio_req_t*, uint32_t);
+
+void blockio_write_batch(blockio_t*, void*, blockio_req_t*, uint32_t);
 
 void blockio_dev_init(blockio_dev_t*, blockio_t*, cipher_t*,
 		const char*);
 
-void blockio_dev_free(blockio_dev_t*);
+void blockio_dev_init_many(blockio_dev_t**, blockio_t*, cipher_t**,
+		uint32_t);
 
-void blockio_dev_scan_header(dllarr_t*, blockio_dev_t*,
-		blockio_info_t*, uint64_t*);
+void blockio_dev_free(blockio_dev_t*);
 
 blockio_info_t *blockio_dev_get_new_macroblock(blockio_dev_t*);
 
-void blockio_dev_read_mesoblk(blockio_dev_t*, void*, uint32_t, uint32_t);
+/* the reader context may be NULL, in that case the cipher and I/O
+ * handle of the device are used, which is reserved for the writer */
+void blockio_dev_read_mesoblk(blockio_dev_t*, blockio_reader_t*, void*,
+		uint32_t, uint32_t, uint64_t);
+
+void blockio_dev_read_mesoblks(blockio_dev_t*, blockio_reader_t*, void*,
+		uint32_t, uint32_t, uint64_t, uint32_t);
+
+void blockio_dev_read_mesoblk_list(blockio_dev_t*, void*, uint32_t,
+		const uint32_t*, uint32_t);
+
+void blockio_dev_read_mesoblk_part(blockio_dev_t*, blockio_reader_t*,
+		void*, uint32_t, uint32_t, uint64_t, uint32_t, uint32_t);
+
+blockio_reader_t *blockio_dev_get_reader(blockio_dev_t*);
+
+void blockio_dev_put_reader(blockio_dev_t*, blockio_reader_t*);
 
-void blockio_dev_read_mesoblk_part(blockio_dev_t*, void*, uint32_t,
-		uint32_t, uint32_t, uint32_t);
+void blockio_dev_seq_write_begin(blockio_dev_t*);
+
+void blockio_dev_seq_write_end(blockio_dev_t*);
+
+uint32_t blockio_dev_seq_read_begin(blockio_dev_t*);
+
+int blockio_dev_seq_read_retry(blockio_dev_t*, uint32_t);
 
 int blockio_check_data_hash(blockio_info_t*);
 
 void blockio_dev_write_current_macroblock(blockio_dev_t*);
 
+void blockio_dev_wait_written(blockio_dev_t*, uint32_t);
+
+void blockio_dev_sync(blockio_dev_t*);
+
 void blockio_free(blockio_t*);
 
+char *blockio_dev_seqnos_hash(blockio_dev_t*, char*);
+
 void blockio_dev_select_next_macroblock(blockio_dev_t*);
 
 void blockio_dev_write_current_and_select_next_macroblock(
@@ -0,0 +1,254 @@
+/* cache.c - cache of decrypted mesoblocks
+ *
+ * Copyright (C) 2019  Rik Snel <rik@snel.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <assert.h>
+#include "verbose.h"
+#include "util.h"
+#include "cipher.h"
+#include "pthd.h"
+#include "cache.h"
+
+static uint32_t hash(cache_t *c, uint32_t id, uint32_t no) {
+	return ((id*0x01000193U^no)*0x9E3779B1U)>>(32 - c->hash_bits);
+}
+
+static void lru_unlink(cache_entry_t *e) {
+	e->prev->next = e->next;
+	e->next->prev = e->prev;
+}
+
+static void lru_add_head(cache_t *c, cache_entry_t *e) {
+	e->prev = &c->head;
+	e->next = c->head.next;
+	c->head.next->prev = e;
+	c->head.next = e;
+}
+
+static void lru_add_tail(cache_t *c, cache_entry_t *e) {
+	e->next = &c->head;
+	e->prev = c->head.prev;
+	c->head.prev->next = e;
+	c->head.prev = e;
+}
+
+void cache_init(cache_t *c, uint32_t no_entries, uint8_t mesoblk_log) {
+	uint32_t i;
+	assert(c);
+
+	c->no_entries = no_entries;
+	c->mesoblk_log = mesoblk_log;
+	c->hits = c->misses = 0;
+	c->prefetch_hits = c->prefetch_wasted = 0;
+	c->head.next = c->head.prev = &c->head;
+
+	pthd_mutex_init(&c->mutex);
+
+	if (!no_entries) return;
+
+	/* at least twice as much buckets as entries */
+	c->hash_bits = 1;
+	while (c->hash_bits < 31 && (1U<<c->hash_bits) < 2*no_entries)
+		c->hash_bits++;
+
+	c->buckets = ecalloc(1<<c->hash_bits, sizeof(cache_entry_t*));
+	c->entries = ecalloc(no_entries, sizeof(cache_entry_t));
+	c->data = ecalloc(no_entries, 1<<mesoblk_log);
+
+	/* the process is normally locked in RAM as a whole, but we
+	 * make sure that decrypted data never hits the swap */
+	if (mlock(c->data, ((size_t)no_entries)<<mesoblk_log) < 0)
+		WARNING("failed locking mesoblock cache in RAM: %s",
+				strerror(errno));
+
+	for (i = 0; i < no_entries; i++) {
+		c->entries[i].data = c->data + (((size_t)i)<<mesoblk_log);
+		lru_add_tail(c, &c->entries[i]);
+	}
+
+	VERBOSE("mesoblock cache has %u entries (%lu bytes)", no_entries,
+			((size_t)no_entries)<<mesoblk_log);
+}
+
+static cache_entry_t **find(cache_t *c, uint32_t id, uint32_t no) {
+	cache_entry_t **e = &c->buckets[hash(c, id, no)];
+
+	while (*e && ((*e)->id != id || (*e)->no != no)) e = &(*e)->hnext;
+
+	return e;
+}
+
+static void drop(cache_t *c, cache_entry_t **e) {
+	cache_entry_t *tmp = *e;
+	assert(tmp->valid);
+
+	*e = tmp->hnext;
+	tmp->hnext = NULL;
+	tmp->valid = 0;
+	if (tmp->prefetched) c->prefetch_wasted++;
+	tmp->prefetched = 0;
+	wipememory(tmp->data, 1<<c->mesoblk_log);
+
+	/* invalid entries are reused first */
+	lru_unlink(tmp);
+	lru_add_tail(c, tmp);
+}
+
+/* returns 1 and copies the requested part of the mesoblock to
+ * buf on a hit, returns 0 on a miss */
+/* on a hit, fn is called on the cached data with the mutex held,
+ * the hit only counts if fn returns nonzero */
+int cache_use(cache_t *c, uint32_t id, uint32_t no, uint64_t seqno,
+		uint32_t offset, uint32_t len,
+		int (*fn)(const void*, uint32_t, void*), void *arg) {
+	cache_entry_t *e;
+	assert(c && fn && offset + len <= 1<<c->mesoblk_log);
+
+	if (!c->no_entries) return 0;
+
+	pthd_mutex_lock(&c->mutex);
+
+	e = *find(c, id, no);
+	if (!e || e->seqno != seqno || !fn(e->data + offset, len, arg)) {
+		c->misses++;
+		pthd_mutex_unlock(&c->mutex);
+		return 0;
+	}
+
+	c->hits++;
+	if (e->prefetched) {
+		c->prefetch_hits++;
+		e->prefetched = 0;
+	}
+
+	lru_unlink(e);
+	lru_add_head(c, e);
+
+	pthd_mutex_unlock(&c->mutex);
+
+	return 1;
+}
+
+static int copy(const void *data, uint32_t len, void *buf) {
+	memcpy(buf, data, len);
+	return 1;
+}
+
+int cache_get(cache_t *c, void *buf, uint32_t id, uint32_t no,
+		uint64_t seqno, uint32_t offset, uint32_t len) {
+	assert(buf);
+
+	return cache_use(c, id, no, seqno, offset, len, copy, buf);
+}
+
+/* like cache_get, but without touching the data, the LRU list or the stats */
+int cache_contains(cache_t *c, uint32_t id, uint32_t no, uint64_t seqno) {
+	cache_entry_t *e;
+	int ret;
+	assert(c);
+
+	if (!c->no_entries) return 0;
+
+	pthd_mutex_lock(&c->mutex);
+	e = *find(c, id, no);
+	ret = e && e->seqno == seqno;
+	pthd_mutex_unlock(&c->mutex);
+
+	return ret;
+}
+
+void cache_put(cache_t *c, const void *mesoblk, uint32_t id, uint32_t no,
+		uint64_t seqno, int prefetched) {
+	cache_entry_t **ep, *e;
+	assert(c && mesoblk);
+
+	if (!c->no_entries) return;
+
+	pthd_mutex_lock(&c->mutex);
+
+	/* an older incarnation may still be here */
+	ep = find(c, id, no);
+	if (*ep) drop(c, ep);
+
+	/* recycle the least recently used entry */
+	e = c->head.prev;
+	if (e->valid) drop(c, find(c, e->id, e->no));
+
+	e->id = id;
+	e->no = no;
+	e->seqno = seqno;
+	e->valid = 1;
+	e->prefetched = prefetched;
+	memcpy(e->data, mesoblk, 1<<c->mesoblk_log);
+
+	ep = &c->buckets[hash(c, id, no)];
+	e->hnext = *ep;
+	*ep = e;
+
+	lru_unlink(e);
+	lru_add_head(c, e);
+
+	pthd_mutex_unlock(&c->mutex);
+}
+
+void cache_invalidate(cache_t *c, uint32_t id, uint32_t no) {
+	cache_entry_t **ep;
+	assert(c);
+
+	if (!c->no_entries) return;
+
+	pthd_mutex_lock(&c->mutex);
+	ep = find(c, id, no);
+	if (*ep) drop(c, ep);
+	pthd_mutex_unlock(&c->mutex);
+}
+
+void cache_invalidate_macroblock(cache_t *c, uint32_t id, uint32_t mmpm) {
+	cache_entry_t **ep;
+	uint32_t no;
+	assert(c);
+
+	if (!c->no_entries) return;
+
+	pthd_mutex_lock(&c->mutex);
+	for (no = 0; no < mmpm; no++) {
+		ep = find(c, id, no);
+		if (*ep) drop(c, ep);
+	}
+	pthd_mutex_unlock(&c->mutex);
+}
+
+void cache_free(cache_t *c) {
+	assert(c);
+
+	if (!c->head.next) return; /* never initialized */
+
+	pthd_mutex_destroy(&c->mutex);
+
+	if (!c->no_entries) return;
+
+	VERBOSE("mesoblock cache: %lu hits, %lu misses", c->hits, c->misses);
+
+	wipememory(c->data, ((size_t)c->no_entries)<<c->mesoblk_log);
+	munlock(c->data, ((size_t)c->no_entries)<<c->mesoblk_log);
+	free(c->data);
+	free(c->entries);
+	free(c->buckets);
+}
@@ -0,0 +1,79 @@
+/* cache.h - cache of decrypted mesoblocks
+ *
+ * Copyright (C) 2019  Rik Snel <rik@snel.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef INCLUDE_SCUBED3_CACHE_H
+#define INCLUDE_SCUBED3_CACHE_H 1
+
+#include <stdint.h>
+#include <pthread.h>
+
+/* an entry is identified by the macroblock id, the index of the
+ * mesoblock in the macroblock and the seqno of the macroblock, the
+ * seqno makes sure that we never see data of a previous incarnation
+ * of the macroblock */
+typedef struct cache_entry_s {
+	struct cache_entry_s *hnext; /* hash chain */
+	struct cache_entry_s *prev, *next; /* LRU list */
+	uint64_t seqno;
+	uint32_t id, no;
+	int valid;
+	int prefetched; /* put by readahead and not yet used */
+	char *data;
+} cache_entry_t;
+
+/* all functions take the mutex, the cache is shared
+ * with the readahead thread of the device */
+typedef struct cache_s {
+	pthread_mutex_t mutex;
+	uint32_t no_entries;
+	uint8_t mesoblk_log;
+	uint8_t hash_bits;
+
+	cache_entry_t **buckets;
+	cache_entry_t *entries;
+
+	/* head.next is the most recently used entry, head.prev
+	 * is the least recently used (or an invalid) entry */
+	cache_entry_t head;
+
+	char *data; /* decrypted data, locked in RAM */
+
+	/* stats */
+	uint64_t hits, misses;
+	uint64_t prefetch_hits, prefetch_wasted;
+} cache_t;
+
+/* a cache with 0 entries is valid, it caches nothing */
+void cache_init(cache_t*, uint32_t, uint8_t);
+
+int cache_get(cache_t*, void*, uint32_t, uint32_t, uint64_t,
+		uint32_t, uint32_t);
+
+int cache_use(cache_t*, uint32_t, uint32_t, uint64_t, uint32_t, uint32_t,
+		int (*)(const void*, uint32_t, void*), void*);
+
+int cache_contains(cache_t*, uint32_t, uint32_t, uint64_t);
+
+void cache_put(cache_t*, const void*, uint32_t, uint32_t, uint64_t, int);
+
+void cache_invalidate(cache_t*, uint32_t, uint32_t);
+
+void cache_invalidate_macroblock(cache_t*, uint32_t, uint32_t);
+
+void cache_free(cache_t*);
+
+#endif /* INCLUDE_SCUBED3_CACHE_H */
@@ -30,7 +30,7 @@ const cipher_spec_t *cipher_specs[] = {
 #define NO_CIPHERS (sizeof(cipher_specs)/sizeof(cipher_specs[0]))
 
 void cipher_open_set_and_destroy_key(gcry_cipher_hd_t *hd, const char *name,
-		const void *key, size_t key_len) {
+		int mode, const void *key, size_t key_len) {
 	size_t tmp, algo;
 
 	algo = gcry_cipher_map_name(name);
@@ -45,8 +45,7 @@ void cipher_open_set_and_destroy_key(gcry_cipher_hd_t *hd, const char *name,
 	if (key_len != tmp) ecch_throw(ECCH_DEFAULT,
 			"supplied key has wrong length");
 
-	gcry_call(cipher_open, hd, algo,
-			GCRY_CIPHER_MODE_ECB, GCRY_CIPHER_SECURE);
+	gcry_call(cipher_open, hd, algo, mode, GCRY_CIPHER_SECURE);
 
 	gcry_call(cipher_setkey, *hd, key, key_len);
 }
@@ -116,6 +115,68 @@ void cipher_dec(cipher_t *w, char *out,
 	w->spec->dec(w->ctx, out, in, iv);
 }
 
+/* decrypt len bytes at offset of the wide block at in, only the
+ * bytes that are needed are accessed (for CBC the preceding cipherblock
+ * and the range itself), offset and len must be multiples of 16,
+ * returns 0 if the mode can only decrypt whole wide blocks */
+int cipher_dec_part(cipher_t *w, char *out, const char *in, uint64_t iv0,
+		uint32_t iv1, uint32_t iv2, size_t offset, size_t len) {
+	char iv[16];
+
+	assert(w && w->spec && w->ctx && !(offset%16) && !(len%16));
+
+	if (!w->spec->dec_part) return 0;
+
+	set_iv(iv, iv0, iv1, iv2);
+	w->spec->dec_part(w->ctx, out, in, iv, offset, len);
+
+	return 1;
+}
+
+/* the output of the batched functions must be identical
+ * to calling cipher_enc/cipher_dec for every request */
+void cipher_enc_batch(cipher_t *w, cipher_req_t *reqs, int n) {
+	int i;
+	assert(w && w->spec && w->spec->enc && w->ctx && (reqs || !n));
+
+	if (!w->spec->enc_batch || n < 2) {
+		for (i = 0; i < n; i++) cipher_enc(w, reqs[i].out,
+				reqs[i].in, reqs[i].iv0, reqs[i].iv1,
+				reqs[i].iv2);
+		return;
+	}
+
+	char ivs[n][16];
+	for (i = 0; i < n; i++)
+		set_iv(ivs[i], reqs[i].iv0, reqs[i].iv1, reqs[i].iv2);
+
+	w->spec->enc_batch(w->ctx, reqs, n, ivs[0]);
+}
+
+void cipher_dec_batch(cipher_t *w, cipher_req_t *reqs, int n) {
+	int i;
+	assert(w && w->spec && w->spec->dec && w->ctx && (reqs || !n));
+
+	if (!w->spec->dec_batch || n < 2) {
+		for (i = 0; i < n; i++) cipher_dec(w, reqs[i].out,
+				reqs[i].in, reqs[i].iv0, reqs[i].iv1,
+				reqs[i].iv2);
+		return;
+	}
+
+	char ivs[n][16];
+	for (i = 0; i < n; i++)
+		set_iv(ivs[i], reqs[i].iv0, reqs[i].iv1, reqs[i].iv2);
+
+	w->spec->dec_batch(w->ctx, reqs, n, ivs[0]);
+}
+
+void cipher_dup(cipher_t *w, const cipher_t *src) {
+	assert(w && src && src->spec && src->spec->dup && src->ctx);
+	w->spec = src->spec;
+	w->ctx = src->spec->dup(src->ctx);
+}
+
 void cipher_free(cipher_t *w) {
 	assert(w);
 	if (w->spec && w->spec->free && w->ctx)
@@ -35,11 +35,31 @@
  * of 16 bytes, amount of cipherblocks in wide blocks must be fixed
  * the iv is assumed to be one cipherblock */
 
+/* a request for the batched functions, the iv of a request
+ * is constructed from iv0, iv1 and iv2, like in cipher_enc */
+typedef struct cipher_req_s {
+	char *out;
+	const char *in;
+	uint64_t iv0;
+	uint32_t iv1, iv2;
+} cipher_req_t;
+
+/* amount of independent CBC chains that are encrypted together */
+#define CIPHER_INTERLEAVE 8
+
 typedef struct cipher_spec_s {
 	void *(*init)(const char*, size_t, const void*, size_t);
 	void (*enc)(void*, char*, const char*, const char*);
 	void (*dec)(void*, char*, const char*, const char*);
 	void (*free)(void*);
+	void *(*dup)(void*); /* independent copy, for use in another thread */
+	/* optional, the ivs are in the last argument, 16 bytes per request */
+	void (*enc_batch)(void*, cipher_req_t*, int, const char*);
+	void (*dec_batch)(void*, cipher_req_t*, int, const char*);
+	/* optional, decrypt a range of cipherblocks of a wide block,
+	 * arguments: out, in (start of the wide block), iv, offset, len */
+	void (*dec_part)(void*, char*, const char*, const char*,
+			size_t, size_t);
 	const char *name;
 } cipher_spec_t;
 
@@ -59,9 +79,18 @@ void cipher_enc(cipher_t*, char*, const char*, uint64_t, uint32_t, uint32_t);
 
 void cipher_dec(cipher_t*, char*, const char*, uint64_t, uint32_t, uint32_t);
 
+int cipher_dec_part(cipher_t*, char*, const char*, uint64_t, uint32_t,
+		uint32_t, size_t, size_t);
+
+void cipher_enc_batch(cipher_t*, cipher_req_t*, int);
+
+void cipher_dec_batch(cipher_t*, cipher_req_t*, int);
+
 void cipher_free(cipher_t*);
 
+void cipher_dup(cipher_t*, const cipher_t*);
+
 void cipher_open_set_and_destroy_key(gcry_cipher_hd_t*, const char*,
-		const void*, size_t);
+		int, const void*, size_t);
 
 #endif /* INCLUDE_SCUBED3_CIPHER_H */
@@ -25,9 +25,17 @@
 
 typedef char block_t[16];
 
+/* the handle is in libgcrypt's CBC mode, so a mesoblock is
+ * en/decrypted with one call (which allows libgcrypt to use
+ * its fast paths, like parallel AES-NI decryption) */
 typedef struct cbc_plain_s {
 	gcry_cipher_hd_t hd;
+	gcry_cipher_hd_t ecb; /* for interleaved encryption of chains */
 	size_t no_blocks;
+	/* kept (in secure memory) to be able to duplicate the context */
+	char *name;
+	void *key;
+	size_t key_len;
 } cbc_plain_t;
 
 typedef struct cbc_essiv_s {
@@ -36,8 +44,6 @@ typedef struct cbc_essiv_s {
 } cbc_essiv_t;
 
 static void xor_block(block_t out, const block_t in1, const block_t in2) {
-	//int i;
-	//for (i = 0; i < 16; i++) out[i] = in1[i] ^ in2[i];
 	*((uint64_t*)out) = *((uint64_t*)in1) ^ *((uint64_t*)in2);
 	*((uint64_t*)out + 1) = *((uint64_t*)in1 + 1) ^ *((uint64_t*)in2 + 1);
 }
@@ -49,7 +55,16 @@ static void *init_plain(const char *name, size_t no_blocks,
 	priv = ecalloc(1, sizeof(cbc_plain_t));
 
 	priv->no_blocks = no_blocks;
-	cipher_open_set_and_destroy_key(&priv->hd, name, key, key_len);
+	cipher_open_set_and_destroy_key(&priv->hd, name,
+			GCRY_CIPHER_MODE_CBC, key, key_len);
+	cipher_open_set_and_destroy_key(&priv->ecb, name,
+			GCRY_CIPHER_MODE_ECB, key, key_len);
+
+	priv->name = estrdup(name);
+	priv->key_len = key_len;
+	if (!(priv->key = gcry_malloc_secure(key_len)))
+		FATAL("out of secure memory");
+	memcpy(priv->key, key, key_len);
 
 	return priv;
 }
@@ -69,7 +84,7 @@ static void *init_essiv(const char *name, size_t no_blocks,
 	gcry_md_write(hd, key, key_len);
 
 	cipher_open_set_and_destroy_key(&priv->hd, name,
-			gcry_md_read(hd, ESSIV_HASH),
+			GCRY_CIPHER_MODE_ECB, gcry_md_read(hd, ESSIV_HASH),
 			gcry_md_get_algo_dlen(ESSIV_HASH));
 
 	gcry_md_close(hd);
@@ -82,17 +97,49 @@ static void *init_essiv(const char *name, size_t no_blocks,
 static void enc_plain(void *priv, char *out,
 		const char *in, const char *iv) {
 	cbc_plain_t *ctx = priv;
-	int i = ctx->no_blocks;
+	size_t len = ctx->no_blocks<<4;
+
+	gcry_call(cipher_setiv, ctx->hd, iv, 16);
+	if (out == in) gcry_call(cipher_encrypt, ctx->hd, out, len, NULL, 0);
+	else gcry_call(cipher_encrypt, ctx->hd, out, len, in, len);
+}
+
+/* CBC encryption is serial within a chain, so we take the n-th
+ * cipherblock of up to CIPHER_INTERLEAVE chains and encrypt
+ * them with one ECB call, this keeps the AES pipeline full */
+static void enc_batch_plain(void *priv, cipher_req_t *reqs, int n,
+		const char *ivs) {
+	cbc_plain_t *ctx = priv;
+	block_t buf[CIPHER_INTERLEAVE];
+	const char *prev[CIPHER_INTERLEAVE];
+	size_t off;
+	int i, k, m;
+
+	for (k = 0; k < n; k += m) {
+		m = n - k;
+		if (m > CIPHER_INTERLEAVE) m = CIPHER_INTERLEAVE;
 
-	xor_block(out, in, iv);
-	do {
-		gcry_call(cipher_encrypt, ctx->hd, out, 16, NULL, 0);
-		if (!(--i)) return;
+		if (m == 1) {
+			enc_plain(ctx, reqs[k].out, reqs[k].in, ivs + (k<<4));
+			break;
+		}
 
-		out += 16;
-		in += 16;
-		xor_block(out, in, out - 16);
-	} while (1);
+		for (i = 0; i < m; i++) prev[i] = ivs + ((k + i)<<4);
+
+		for (off = 0; off < ctx->no_blocks<<4; off += 16) {
+			for (i = 0; i < m; i++)
+				xor_block(buf[i], reqs[k + i].in + off, prev[i]);
+
+			gcry_call(cipher_encrypt, ctx->ecb, buf, m<<4, NULL, 0);
+
+			for (i = 0; i < m; i++) {
+				memcpy(reqs[k + i].out + off, buf[i], 16);
+				prev[i] = reqs[k + i].out + off;
+			}
+		}
+	}
+
+	wipememory(buf, sizeof(buf));
 }
 
 static void enc_essiv(void *priv, char *out,
@@ -105,33 +152,24 @@ static void enc_essiv(void *priv, char *out,
 	enc_plain(ctx->plain, out, in, newiv);
 }
 
+static void enc_batch_essiv(void *priv, cipher_req_t *reqs, int n,
+		const char *ivs) {
+	cbc_essiv_t *ctx = priv;
+	char newivs[n<<4];
+
+	gcry_call(cipher_encrypt, ctx->hd, newivs, n<<4, ivs, n<<4);
+
+	enc_batch_plain(ctx->plain, reqs, n, newivs);
+}
+
 static void dec_plain(void *priv, char *out,
 		const char *in, const char *iv) {
 	cbc_plain_t *ctx = priv;
-	block_t tmp, tmp2;
-	const char *gcry_in = in;
-	size_t gcry_inlen = 16;
-	int i = ctx->no_blocks;
-
-	if (out == in) {
-		gcry_in = NULL;
-		gcry_inlen = 0;
-	}
-
-	memcpy(tmp, iv, 16);
+	size_t len = ctx->no_blocks<<4;
 
-	while (i--) {
-		memcpy(tmp2, in, 16);
-		gcry_call(cipher_decrypt, ctx->hd, out, 16,
-				gcry_in, gcry_inlen);
-		xor_block(out, out, tmp);
-		memcpy(tmp, tmp2, 16);
-		out += 16;
-		in += 16;
-	}
-
-	wipememory(tmp, 16);
-	wipememory(tmp2, 16);
+	gcry_call(cipher_setiv, ctx->hd, iv, 16);
+	if (out == in) gcry_call(cipher_decrypt, ctx->hd, out, len, NULL, 0);
+	else gcry_call(cipher_decrypt, ctx->hd, out, len, in, len);
 }
 
 static void dec_essiv(void *priv, char *out,
@@ -144,8 +182,69 @@ static void dec_essiv(void *priv, char *out,
 	dec_plain(ctx->plain, out, in, newiv);
 }
 
+/* in CBC mode a plaintext block only depends on its own
+ * and the preceding cipherblock (or the iv) */
+static void dec_part_plain(void *priv, char *out, const char *in,
+		const char *iv, size_t offset, size_t len) {
+	cbc_plain_t *ctx = priv;
+
+	assert(offset + len <= ctx->no_blocks<<4);
+
+	gcry_call(cipher_setiv, ctx->hd, offset?in + offset - 16:iv, 16);
+	gcry_call(cipher_decrypt, ctx->hd, out, len, in + offset, len);
+}
+
+static void dec_part_essiv(void *priv, char *out, const char *in,
+		const char *iv, size_t offset, size_t len) {
+	block_t newiv;
+	cbc_essiv_t *ctx = priv;
+
+	/* the iv is only needed for the first cipherblock */
+	if (!offset) gcry_call(cipher_encrypt, ctx->hd, newiv, 16, iv, 16);
+
+	dec_part_plain(ctx->plain, out, in, newiv, offset, len);
+}
+
+/* libgcrypt already decrypts the cipherblocks of a chain in
+ * parallel, so there is nothing to interleave */
+static void dec_batch_plain(void *priv, cipher_req_t *reqs, int n,
+		const char *ivs) {
+	int i;
+
+	for (i = 0; i < n; i++)
+		dec_plain(priv, reqs[i].out, reqs[i].in, ivs + (i<<4));
+}
+
+static void dec_batch_essiv(void *priv, cipher_req_t *reqs, int n,
+		const char *ivs) {
+	cbc_essiv_t *ctx = priv;
+	char newivs[n<<4];
+
+	gcry_call(cipher_encrypt, ctx->hd, newivs, n<<4, ivs, n<<4);
+
+	dec_batch_plain(ctx->plain, reqs, n, newivs);
+}
+
+static void *dup_plain(void *priv) {
+	cbc_plain_t *ctx = priv;
+
+	return init_plain(ctx->name, ctx->no_blocks, ctx->key, ctx->key_len);
+}
+
+static void *dup_essiv(void *priv) {
+	cbc_plain_t *ctx = ((cbc_essiv_t*)priv)->plain;
+
+	return init_essiv(ctx->name, ctx->no_blocks, ctx->key, ctx->key_len);
+}
+
 static void free_plain(void *priv) {
-	gcry_cipher_close(((cbc_plain_t*)priv)->hd);
+	cbc_plain_t *ctx = priv;
+
+	gcry_cipher_close(ctx->hd);
+	gcry_cipher_close(ctx->ecb);
+	wipememory(ctx->key, ctx->key_len);
+	gcry_free(ctx->key);
+	free(ctx->name);
 	wipememory(priv, sizeof(cbc_plain_t));
 	free(priv);
 }
@@ -162,6 +261,10 @@ const cipher_spec_t cipher_cbc_plain = {
 	.enc = enc_plain,
 	.dec = dec_plain,
 	.free = free_plain,
+	.dup = dup_plain,
+	.enc_batch = enc_batch_plain,
+	.dec_batch = dec_batch_plain,
+	.dec_part = dec_part_plain,
 	.name = "CBC_PLAIN"
 };
 
@@ -170,5 +273,9 @@ const cipher_spec_t cipher_cbc_essiv = {
 	.enc = enc_essiv,
 	.dec = dec_essiv,
 	.free = free_essiv,
+	.dup = dup_essiv,
+	.enc_batch = enc_batch_essiv,
+	.dec_batch = dec_batch_essiv,
+	.dec_part = dec_part_essiv,
 	.name = "CBC_ESSIV"
 };
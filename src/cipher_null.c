@@ -32,13 +32,24 @@ static void null_cipher(void *priv, char *out,
 	if (in != out) memmove(out, in, (size_t)priv*16);
 }
 
+static void null_dec_part(void *priv, char *out, const char *in,
+		const char *iv, size_t offset, size_t len) {
+	memmove(out, in + offset, len);
+}
+
 static void null_free(void *priv) {
 }
 
+static void *null_dup(void *priv) {
+	return priv;
+}
+
 const cipher_spec_t cipher_null = {
 	.init = null_init,
 	.enc = null_cipher,
 	.dec = null_cipher,
 	.free = null_free,
+	.dup = null_dup,
+	.dec_part = null_dec_part,
 	.name = "NULL"
 };
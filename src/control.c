@@ -31,10 +31,11 @@
 #include "hashtbl.h"
 #include "control.h"
 #include "fuse_io.h"
+#include "libscubed3_int.h"
 #include "ecch.h"
 
 #define BUF_SIZE 8192
-#define MAX_ARGC 10
+#define MAX_ARGC 31
 
 int control_write_string(int s, const char *string, ssize_t len) {
 	ssize_t sent = 0, n;
@@ -117,7 +118,7 @@ int control_write_complete(int s, int err, const char *format, ...) {
 typedef struct control_command {
 	hashtbl_elt_t head;
 	int (*command)(int, control_thread_priv_t*, char**);
-	int argc;
+	int argc; /* if negative: one or more groups of -argc arguments */
 	char *usage;
 } control_command_t;
 
@@ -176,7 +177,10 @@ static int control_verbose_juggler(int s, control_thread_priv_t *priv, char *arg
 		return bi - (blockio_info_t*)priv;
 	}
 
+	/* the writer of the partition changes the juggler */
+	pthd_mutex_lock(&entry->l.mutex);
 	juggler_verbose(&entry->d.j, getnum, entry->d.b->blockio_infos);
+	pthd_mutex_unlock(&entry->l.mutex);
 
 	pthread_cleanup_pop(1);
 
@@ -211,10 +215,18 @@ static int control_check_data_integrity(int s, control_thread_priv_t *priv,
 }
 
 static int control_static_info(int s, control_thread_priv_t *priv, char *argv[]) {
-	return control_write_complete(s, 0, "%s\n%d\n%s",
+	hdrcache_t *h = &priv->b->hdrcache;
+
+	return control_write_complete(s, 0, "%s\n%d\n%s\n"
+			"header cache: %u/%u entries (%lu bytes), "
+			"%lu hits, %lu misses",
 			priv->mountpoint,
 			priv->b->total_macroblocks,
-			VERSION);
+			VERSION,
+			__atomic_load_n(&h->used, __ATOMIC_RELAXED),
+			h->no_entries, ((size_t)h->no_entries)*h->entry_size,
+			__atomic_load_n(&h->hits, __ATOMIC_RELAXED),
+			__atomic_load_n(&h->misses, __ATOMIC_RELAXED));
 }
 
 static int control_exit(int s, control_thread_priv_t *priv, char *argv[]) {
@@ -295,106 +307,163 @@ static int check_name(const char *ptr) {
 	return 0;
 }
 
-static int control_open_create_common(int s, control_thread_priv_t *priv, char *argv[], int add) {
-	fuse_io_entry_t *entry;
-	int ret;
+typedef struct open_entries_s {
+	fuse_io_entry_t **entries;
+	int no;
+} open_entries_t;
+
+static void unlock_entries(void *arg) {
+	open_entries_t *o = arg;
+	int i;
+
+	for (i = 0; i < o->no; i++)
+		hashtbl_unlock_element_byptr(o->entries[i]);
+}
+
+/* prepare the cipher and the unique id of the entry,
+ * argv is NAME CIPHER_SPEC KEY */
+static void open_entry_setup(control_thread_priv_t *priv,
+		fuse_io_entry_t *entry, char *argv[]) {
+	size_t key_len;
+
+	key_len = strlen(argv[2]);
+	if (key_len%2) ecch_throw(ECCH_DEFAULT, "cipher key not valid "
+			"base16 (uneven number of chars)");
+
+	if (unbase16(argv[2], key_len)) ecch_throw(ECCH_DEFAULT, "cipher "
+			"key not valid base16 (invalid chars)");
+
+	libscubed3_part_setup(priv->b, &entry->c, argv[1], argv[2],
+			key_len/2, entry->unique_id.id);
+	entry->unique_id.head.key = entry->unique_id.id;
+	entry->unique_id.name = entry->head.key;
+	entry->d.name = estrdup(entry->head.key);
+	if (!hashtbl_add_element(priv->ids, &entry->unique_id))
+		ecch_throw(ECCH_DEFAULT, "cipher(mode)/key combination already in use");
+	hashtbl_unlock_element_byptr(&entry->unique_id);
+	entry->ids = priv->ids;
+}
+
+/* the blocks of the device are found, check them and start */
+static void open_entry_finish(fuse_io_entry_t *entry, int add) {
+	entry->size = libscubed3_part_start(&entry->d, &entry->l, add);
+}
+
+/* argv contains no triples NAME CIPHER_SPEC KEY, the base device is
+ * scanned once for all of them; a partition that fails does not
+ * prevent the others from being opened */
+static int control_open_create_many(int s, control_thread_priv_t *priv,
+		char *argv[], int no, int add) {
+	fuse_io_entry_t *entries[no];
+	blockio_dev_t *devs[no];
+	cipher_t *cs[no];
+	char errs[no][ECCH_MSG_SIZE];
+	open_entries_t o = { .entries = entries, .no = 0 };
+	int i, no_devs = 0, failed = 0, ret = 0;
 	char *allocname;
 
-	if (check_name(argv[0])) return control_write_complete(s, 1,
+	for (i = 0; i < no; i++) if (check_name(argv[3*i]))
+		return control_write_complete(s, 1,
 				"illegal name specified for partition, "
 				"it may only contain letters, digits and "
 				"the underscore");
 
-	allocname = estrdup(argv[0]);
-	entry = hashtbl_allocate_and_add_element(priv->h,
-			allocname, sizeof(*entry));
+	pthread_cleanup_push(unlock_entries, &o);
 
-	if (!entry) {
-		free(allocname);
-		return control_write_complete(s, 1,
-				"unable to %s partition \"%s\", duplicate "
-				"name?", add?"create":"open", argv[0]);
-	}
-
-	pthread_cleanup_push(hashtbl_unlock_element_byptr, entry);
+	for (i = 0; i < no; i++) {
+		allocname = estrdup(argv[3*i]);
+		entries[i] = hashtbl_allocate_and_add_element(priv->h,
+				allocname, sizeof(*entries[i]));
 
-	pthd_cond_init(&entry->cond);
-	entry->to_be_deleted = 0;
-	assert(!entry->close_on_release);
-	entry->inuse = 0;
-
-	ecch_try {
-		/* if any of this fails, we cannot add the partition */
-		size_t key_len;
-		char buf[1<<priv->b->mesoblk_log];
-
-		memset(buf, 0, 1<<priv->b->mesoblk_log);
-
-		key_len = strlen(argv[2]);
-		if (key_len%2) ecch_throw(ECCH_DEFAULT, "cipher key not valid "
-				"base16 (uneven number of chars)");
-
-		if (unbase16(argv[2], key_len)) ecch_throw(ECCH_DEFAULT, "cipher "
-				"key not valid base16 (invalid chars)");
-
-		cipher_init(&entry->c, argv[1], 1<<(priv->b->mesoblk_log - 4),
-				(unsigned char*)argv[2], key_len/2);
-
-		// encrypt zeroed buffer and hash the result
-		// the output of the hash is used to ID ciphermode + key
-		cipher_enc(&entry->c, buf, buf, 0, 0, 0);
-		gcry_md_hash_buffer(GCRY_MD_SHA256, entry->unique_id.id, buf, sizeof(buf));
-		entry->unique_id.head.key = entry->unique_id.id;
-		entry->unique_id.name = allocname;
-		entry->d.name = estrdup(allocname);
-		if (!hashtbl_add_element(priv->ids, &entry->unique_id))
-			ecch_throw(ECCH_DEFAULT, "cipher(mode)/key combination already in use");
-		hashtbl_unlock_element_byptr(&entry->unique_id);
-		entry->ids = priv->ids;
-
-		/* scan base file/device for our blocks */
-		blockio_dev_init(&entry->d, priv->b, &entry->c, argv[0]);
-
-		/* if we used 'create' we should not have found any blocks */
-		if (add && entry->d.no_macroblocks) {
-			ecch_throw(ECCH_DEFAULT, "unable to create device: "
-					"it already exists, use `open' instead");
+		if (!entries[i]) {
+			free(allocname);
+			ret = control_write_complete(s, 1,
+					"unable to %s partition \"%s\", "
+					"duplicate name?", add?"create":"open",
+					argv[3*i]);
+			break;
 		}
 
-		/* if we used 'open' we expect to find at least one block */
-		if (!add & !entry->d.no_macroblocks)
-			ecch_throw(ECCH_DEFAULT, "no blocks found: passphrase wrong?");
+		o.no++;
 
-		entry->size = 0;
-		if (entry->d.no_macroblocks > entry->d.reserved_macroblocks) entry->size = ((entry->d.no_macroblocks-entry->d.reserved_macroblocks)<<entry->d.b->mesoblk_log)*entry->d.b->mmpm;
+		pthd_cond_init(&entries[i]->cond);
+		entries[i]->to_be_deleted = 0;
+		assert(!entries[i]->close_on_release);
+		entries[i]->inuse = 0;
+		errs[i][0] = '\0';
+	}
 
-		scubed3_init(&entry->l, &entry->d);
+	if (o.no < no) {
+		/* nothing happened yet, undo */
+		for (i = 0; i < o.no; i++) entries[i]->to_be_deleted = 1;
+		goto end;
+	}
 
-		assert(!entry->d.bi);
-		if (entry->size > 0) blockio_dev_select_next_macroblock(&entry->d);
+	/* if any of this fails, we cannot add the partition */
+	for (i = 0; i < no; i++) {
+		ecch_try {
+			open_entry_setup(priv, entries[i], argv + 3*i);
+			devs[no_devs] = &entries[i]->d;
+			cs[no_devs++] = &entries[i]->c;
+		}
+		ecch_catch_all {
+			entries[i]->to_be_deleted = 1;
+			strcpy(errs[i], ecch_context.ecch.msg);
+		}
+		ecch_endtry;
+	}
 
-		ret = control_write_silent_success(s);
+	/* scan base file/device for our blocks */
+	if (no_devs) blockio_dev_init_many(devs, priv->b, cs, no_devs);
+
+	for (i = 0; i < no; i++) {
+		if (entries[i]->to_be_deleted) continue;
+		ecch_try {
+			open_entry_finish(entries[i], add);
+		}
+		ecch_catch_all {
+			entries[i]->to_be_deleted = 1;
+			strcpy(errs[i], ecch_context.ecch.msg);
+		}
+		ecch_endtry;
 	}
-	ecch_catch_all {
-		entry->to_be_deleted = 1;
-		ret = control_write_complete(s, 1, "%s",
-				ecch_context.ecch.msg);
+
+	for (i = 0; i < no; i++) if (entries[i]->to_be_deleted) failed++;
+
+	if (!failed) ret = control_write_silent_success(s);
+	else if (no == 1) ret = control_write_complete(s, 1, "%s", errs[0]);
+	else {
+		if (control_write_status(s, 1)) ret = -1;
+		for (i = 0; !ret && i < no; i++) if (errs[i][0] &&
+				control_write_line(s, "%s: %s\n",
+					argv[3*i], errs[i])) ret = -1;
+		if (!ret) ret = control_write_terminate(s);
 	}
-	ecch_endtry;
 
+end:
 	pthread_cleanup_pop(1);
 
-	if (entry->to_be_deleted) hashtbl_delete_element_byptr(priv->h, entry);
+	for (i = 0; i < o.no; i++) if (entries[i]->to_be_deleted)
+		hashtbl_delete_element_byptr(priv->h, entries[i]);
 
 	return ret;
 }
 
 static int control_open(int s, control_thread_priv_t *priv, char *argv[]) {
-	return control_open_create_common(s, priv, argv, 0);
+	return control_open_create_many(s, priv, argv, 1, 0);
 }
 
 static int control_create(int s, control_thread_priv_t *priv, char *argv[]) {
-	return control_open_create_common(s, priv, argv, 1);
+	return control_open_create_many(s, priv, argv, 1, 1);
+}
+
+static int control_open_many(int s, control_thread_priv_t *priv,
+		char *argv[]) {
+	int argc = 0;
+
+	while (argv[argc]) argc++;
+
+	return control_open_create_many(s, priv, argv, argc/3, 0);
 }
 
 static int control_check_available(int s,
@@ -519,7 +588,7 @@ static int control_set_close_on_release(int s,
 
 static int control_info(int s, control_thread_priv_t *priv, char *argv[]) {
 	__label__ end;
-	int ret;
+	int ret, no_indices = -1;
 	fuse_io_entry_t *entry = hashtbl_find_element_bykey(priv->h, argv[0]);
 
 	if (!entry) return control_write_complete(s, 1,
@@ -527,6 +596,11 @@ static int control_info(int s, control_thread_priv_t *priv, char *argv[]) {
 
 	pthread_cleanup_push(hashtbl_unlock_element_byptr, entry);
 
+	/* writes to the partition don't hold the entry */
+	pthd_mutex_lock(&entry->l.mutex);
+	if (entry->d.bi) no_indices = entry->d.bi->no_indices;
+	pthd_mutex_unlock(&entry->l.mutex);
+
 	if (control_write_status(s, 0)) {
 		ret = -1;
 		goto end;
@@ -544,14 +618,24 @@ static int control_info(int s, control_thread_priv_t *priv, char *argv[]) {
 		goto end;
 	}
 
+	if (control_write_line(s, "format=%d\n", entry->d.format)) {
+		ret = -1;
+		goto end;
+	}
+
 	if (control_write_line(s, "writes=%d\n",entry->d.writes)) {
 		ret = -1;
 		goto end;
 	}
 
-	if (entry->d.bi) {
-		if (control_write_line(s, "no_indices=%d\n",
-					entry->d.bi->no_indices)) {
+	if (control_write_line(s, "write_stalls=%u\n",
+				entry->d.write_stalls)) {
+		ret = -1;
+		goto end;
+	}
+
+	if (no_indices >= 0) {
+		if (control_write_line(s, "no_indices=%d\n", no_indices)) {
 			ret = -1;
 			goto end;
 		}
@@ -562,6 +646,41 @@ static int control_info(int s, control_thread_priv_t *priv, char *argv[]) {
 		goto end;
 	}
 
+	if (control_write_line(s, "cache_hits=%lu\n", entry->d.cache.hits)) {
+		ret = -1;
+		goto end;
+	}
+
+	if (control_write_line(s, "cache_misses=%lu\n",
+				entry->d.cache.misses)) {
+		ret = -1;
+		goto end;
+	}
+
+	if (control_write_line(s, "readahead_window=%u\n",
+				entry->l.ra.window)) {
+		ret = -1;
+		goto end;
+	}
+
+	if (control_write_line(s, "readahead_issued=%lu\n",
+				entry->l.ra.issued)) {
+		ret = -1;
+		goto end;
+	}
+
+	if (control_write_line(s, "readahead_hits=%lu\n",
+				entry->d.cache.prefetch_hits)) {
+		ret = -1;
+		goto end;
+	}
+
+	if (control_write_line(s, "readahead_wasted=%lu\n",
+				entry->d.cache.prefetch_wasted)) {
+		ret = -1;
+		goto end;
+	}
+
 	ret = control_write_terminate(s);
 
 end:
@@ -575,7 +694,9 @@ static int control_close(int s, control_thread_priv_t *priv, char *argv[]) {
 	if (!entry) return control_write_complete(s, 1,
 			"partition \"%s\" not found", argv[0]);
 
-	if (entry->inuse) {
+	/* open files hold a reference, and the last release
+	 * may already be deleting the entry */
+	if (entry->inuse || entry->to_be_deleted) {
 		hashtbl_unlock_element_byptr(entry);
 		return control_write_complete(s, 1,
 				"partition \"%s\" is busy", argv[0]);
@@ -596,9 +717,8 @@ static int control_close(int s, control_thread_priv_t *priv, char *argv[]) {
 
 static int control_resize(int s, control_thread_priv_t *priv, char *argv[]) {
 	int size = 0, reserved = 0; // shut compiler up
-	int err, ret;
+	int ret;
 	fuse_io_entry_t *entry = hashtbl_find_element_bykey(priv->h, argv[0]);
-	blockio_dev_t *dev;
 
 	if (!entry) return control_write_complete(s, 1,
 			"partition \"%s\" not found", argv[0]);
@@ -608,61 +728,30 @@ static int control_resize(int s, control_thread_priv_t *priv, char *argv[]) {
 		return control_write_complete(s, 1,
 				"partition \"%s\" is busy", argv[0]);
 	}
-	dev = &entry->d;
 
 	if (parse_int(s, &size, argv[1])) return -1;
 	if (parse_int(s, &reserved, argv[2])) return -1;
 
-	if (!(reserved <= size) || !(size >= 0)) {
+	if (!(reserved <= size) || !(reserved >= 0)) {
 		hashtbl_unlock_element_byptr(entry);
 		return control_write_complete(s, 1,
 			"values for new_size=%d and reserved=%d make no sense",
 			size, reserved);
 	}
 
-	if (size < dev->no_macroblocks) {
-		hashtbl_unlock_element_byptr(entry);
-		return control_write_complete(s, 1, "shrinking device is not yet supported");
-	}
-
-	if (size > dev->b->total_macroblocks) {
-		hashtbl_unlock_element_byptr(entry);
-		return control_write_complete(s, 1,
-				"not enough blocks available, base device "
-				"has only %d blocks", dev->b->total_macroblocks);
-	}
-
-	size -= dev->no_macroblocks;
-
-	if (size == 0) {
-		hashtbl_unlock_element_byptr(entry);
-		return control_write_complete(s, 1, "nothing to do");
-	}
-
 	/* until here no cancellation point from aqcuisition of entry */
 	pthread_cleanup_push(hashtbl_unlock_element_byptr, entry);
 
-	VERBOSE("need to allocate %d additional blocks", size);
-	if ((err = blockio_dev_allocate_macroblocks(dev, size))) {
-		assert(err == -1);
-		ret = control_write_complete(s, 1, "not enough unclaimed "
-				"blocks available for resize");
-	} else {
-		dev->reserved_macroblocks = reserved;
-
-		if (entry->d.no_macroblocks > entry->d.reserved_macroblocks)
-			entry->size = ((entry->d.no_macroblocks -
-						entry->d.reserved_macroblocks)<<
-					entry->d.b->mesoblk_log)*entry->d.b->mmpm;
-
-		scubed3_reinit(&entry->l);
-
-		if (!dev->bi) blockio_dev_select_next_macroblock(dev);
-
-		dev->updated = 1;
-
+	ecch_try {
+		entry->size = libscubed3_part_resize(&entry->d, &entry->l,
+				size, reserved);
 		ret = control_write_silent_success(s);
 	}
+	ecch_catch_all {
+		ret = control_write_complete(s, 1, "%s",
+				ecch_context.ecch.msg);
+	}
+	ecch_endtry;
 
 	pthread_cleanup_pop(1);
 
@@ -720,6 +809,11 @@ static control_command_t control_commands[] = {
 		.command = control_open,
 		.argc = 3,
 		.usage = " NAME CIPHER_SPEC KEY"
+	}, {
+		.head.key = "open-many-internal",
+		.command = control_open_many,
+		.argc = -3,
+		.usage = " NAME CIPHER_SPEC KEY [NAME CIPHER_SPEC KEY]..."
 	}, {
 		.head.key = "info",
 		.command = control_info,
@@ -787,9 +881,13 @@ int control_call(int s, control_thread_priv_t *priv, char *command) {
 	if (!(cmnd = hashtbl_find_element_bykey(&priv->c, argv[0])))
 		return control_write_complete(s, 1, "unknown command \"%s\"", argv[0]);
 
-	if (argc - 1 != cmnd->argc) 
+	if ((cmnd->argc >= 0 && argc - 1 != cmnd->argc) ||
+			(cmnd->argc < 0 && (argc == 1 ||
+					(argc - 1)%-cmnd->argc)))
 		return control_write_complete(s, 1, "usage: %s%s", argv[0], cmnd->usage);
 
+	argv[argc] = NULL;
+
 	return (*cmnd->command)(s, priv, argv + 1);
 }
 
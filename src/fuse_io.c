@@ -31,31 +31,15 @@
 #include "control.h"
 #include "fuse_io.h"
 
-typedef struct fuse_io_priv_s {
-	hashtbl_t entries, ids;
-	pthread_t control_thread;
-	control_thread_priv_t control_thread_priv;
-	pthread_t plmgr_thread;
-	plmgr_thread_priv_t plmgr_thread_priv;
-} fuse_io_priv_t;
-
-static int fuse_io_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi) {
-	fuse_io_entry_t *entry;
-	assert(path && *path == '/');
+/* the parts below are shared with the low level frontend in fuse_ll.c,
+ * which finds the partitions by name and keeps them in fi->fh as well */
+int fuse_io_entry_getattr(hashtbl_t *entries, const char *name,
+		struct stat *stbuf) {
+	fuse_io_entry_t *entry = hashtbl_find_element_bykey(entries, name);
+	if (!entry) return -ENOENT;
 
 	memset(stbuf, 0, sizeof(*stbuf));
 
-	if (!strcmp(path, "/")) {
-		stbuf->st_mode = S_IFDIR|0755;
-		stbuf->st_nlink = 2;
-		return 0;
-	}
-
-	entry = hashtbl_find_element_bykey(
-			&((fuse_io_priv_t*)fuse_get_context()->private_data)->
-			entries, path + 1);
-	if (!entry) return -ENOENT;
-
 	if (!entry->readonly) stbuf->st_mode = S_IFREG|0600;
 	else stbuf->st_mode = S_IFREG|0400;
 
@@ -69,40 +53,12 @@ static int fuse_io_getattr(const char *path, struct stat *stbuf, struct fuse_fil
 	return 0;
 }
 
-typedef struct fuse_io_readdir_priv_s {
-	fuse_fill_dir_t filler;
-	void *buf;
-} fuse_io_readdir_priv_t;
-
-static int fuse_io_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-		off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags) {
-	fuse_io_readdir_priv_t priv = {
-		.filler = filler,
-		.buf = buf
-	};
-	int rep(fuse_io_readdir_priv_t *priv, fuse_io_entry_t *entry) {
-		priv->filler(priv->buf, entry->head.key, NULL, 0, 0);
-		return 0;
-	}
-	if (strcmp(path, "/") != 0) return -ENOENT;
-
-	filler(buf, ".", NULL, 0, 0);
-	filler(buf, "..", NULL, 0, 0);
-
-	hashtbl_ts_traverse(
-			&((fuse_io_priv_t*)fuse_get_context()->private_data)->
-			entries, (int (*)(void*, hashtbl_elt_t*))rep, &priv);
-
-	return 0;
-}
-
-static int fuse_io_open(const char *path, struct fuse_file_info *fi) {
-	fuse_io_entry_t *entry = hashtbl_find_element_bykey(
-			&((fuse_io_priv_t*)fuse_get_context()->private_data)->
-			entries, path + 1);
+int fuse_io_entry_open(hashtbl_t *entries, const char *name, int flags,
+		fuse_io_entry_t **entryp) {
+	fuse_io_entry_t *entry = hashtbl_find_element_bykey(entries, name);
 	if (!entry) return -ENOENT;
 
-	//VERBOSE("attempt to open \"%s\"", path + 1);
+	//VERBOSE("attempt to open \"%s\"", name);
 
 	if (entry->inuse || entry->to_be_deleted) {
 		hashtbl_unlock_element_byptr(entry);
@@ -110,13 +66,16 @@ static int fuse_io_open(const char *path, struct fuse_file_info *fi) {
 	}
 
 	/* enforce readonly */
-	if (entry->readonly && ((fi->flags&O_ACCMODE) != O_RDONLY)) {
+	if (entry->readonly && ((flags&O_ACCMODE) != O_RDONLY)) {
 		hashtbl_unlock_element_byptr(entry);
 		return -EACCES;
 	}
 
+	/* read, write and release find the entry through fi->fh, the
+	 * entry is not deleted as long as it has references */
 	entry->inuse++;
-	//VERBOSE("openend \"%s\"", path + 1);
+	*entryp = entry;
+	//VERBOSE("openend \"%s\"", name);
 
 	/* no cancellation point between acquisition of entry
 	 * and this unlock function */
@@ -124,21 +83,20 @@ static int fuse_io_open(const char *path, struct fuse_file_info *fi) {
 	return 0;
 }
 
-static int fuse_io_release(const char *path, struct fuse_file_info *fi) {
+void fuse_io_entry_release(hashtbl_t *entries, fuse_io_entry_t *entry) {
 	int delete = 0;
-	fuse_io_entry_t *entry = hashtbl_find_element_bykey(
-			&((fuse_io_priv_t*)fuse_get_context()->private_data)->
-			entries, path + 1);
-	if (!entry) return -ENOENT;
+
+	hashtbl_lock_element_byptr(entry);
 
 	assert(entry->inuse);
 	/* we should do some kind of cleanup here */
-	//VERBOSE("release called on %s", path);
+	//VERBOSE("release called on %s", entry->head.key);
 	entry->inuse--;
 	free(entry->mountpoint);
 	entry->mountpoint = NULL;
 
-	if (entry->close_on_release) {
+	/* the last reference is gone */
+	if (!entry->inuse && entry->close_on_release) {
 		delete = 1;
 		entry->to_be_deleted = 1;
 	}
@@ -147,80 +105,173 @@ static int fuse_io_release(const char *path, struct fuse_file_info *fi) {
 	 * and this unlock function */
 	hashtbl_unlock_element_byptr(entry);
 
-	if (delete) hashtbl_delete_element_byptr(
-			&((fuse_io_priv_t*)fuse_get_context()->
-				private_data)-> entries, entry);
+	if (delete) hashtbl_delete_element_byptr(entries, entry);
+}
+
+void fuse_io_entry_free(fuse_io_entry_t *entry) {
+	pthd_cond_destroy(&entry->cond);
+	free(entry->head.key);
+	free(entry->mountpoint);
+	scubed3_free(&entry->l);
+	blockio_dev_free(&entry->d);
+	cipher_free(&entry->c);
+	if (entry->ids) {
+		hashtbl_delete_element_byptr(entry->ids, &entry->unique_id);
+		wipememory(entry->unique_id.id, 32);
+	}
+	free(entry);
+}
+
+/* the NBD server is started if nbd has a socket path or a port */
+void fuse_io_priv_init(fuse_io_priv_t *priv, blockio_t *b,
+		const nbd_thread_priv_t *nbd) {
+	hashtbl_init_default(&priv->entries, -1, 4, 1, 1,
+			(void (*)(void*))fuse_io_entry_free);
+	hashtbl_init_default(&priv->ids, 32, 4, 1, 1, NULL);
+
+	priv->control_thread_priv.b = b;
+	priv->plmgr_thread_priv.b = b;
+	b->plmgr = &priv->plmgr_thread_priv;
+	priv->nbd_thread_priv.path = nbd->path;
+	priv->nbd_thread_priv.port = nbd->port;
+	priv->nbd_thread_priv.h = &priv->entries;
+}
+
+void fuse_io_priv_free(fuse_io_priv_t *priv) {
+	hashtbl_free(&priv->entries);
+	hashtbl_free(&priv->ids);
+}
+
+void fuse_io_start_threads(fuse_io_priv_t *priv, char *mountpoint) {
+	priv->control_thread_priv.mountpoint = mountpoint;
+
+	/* start control thread */
+	priv->control_thread_priv.h = &priv->entries;
+	priv->control_thread_priv.ids = &priv->ids;
+	pthread_create(&priv->control_thread, NULL, control_thread,
+			&priv->control_thread_priv);
+
+	/* start paranoia level manager thread */
+	pthread_create(&priv->plmgr_thread, NULL, plmgr_thread,
+			&priv->plmgr_thread_priv);
+
+	/* start NBD server */
+	if (priv->nbd_thread_priv.path || priv->nbd_thread_priv.port)
+		pthread_create(&priv->nbd_thread, NULL, nbd_thread,
+				&priv->nbd_thread_priv);
+}
+
+void fuse_io_stop_threads(fuse_io_priv_t *priv) {
+	/* the NBD connections hold partitions, they go first */
+	if (priv->nbd_thread_priv.path || priv->nbd_thread_priv.port)
+		nbd_thread_cancel_join_cleanup(priv->nbd_thread,
+				&priv->nbd_thread_priv);
+
+	/* stop paranoia level manager caand control thread */
+	plmgr_thread_cancel_join_cleanup(priv->plmgr_thread,
+			&priv->plmgr_thread_priv);
+	control_thread_cancel_join_cleanup(priv->control_thread,
+			&priv->control_thread_priv);
+}
+
+static int fuse_io_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi) {
+	assert(path && *path == '/');
+
+	if (!strcmp(path, "/")) {
+		memset(stbuf, 0, sizeof(*stbuf));
+		stbuf->st_mode = S_IFDIR|0755;
+		stbuf->st_nlink = 2;
+		return 0;
+	}
+
+	return fuse_io_entry_getattr(
+			&((fuse_io_priv_t*)fuse_get_context()->private_data)->
+			entries, path + 1, stbuf);
+}
+
+typedef struct fuse_io_readdir_priv_s {
+	fuse_fill_dir_t filler;
+	void *buf;
+} fuse_io_readdir_priv_t;
+
+static int fuse_io_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+		off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags) {
+	fuse_io_readdir_priv_t priv = {
+		.filler = filler,
+		.buf = buf
+	};
+	int rep(fuse_io_readdir_priv_t *priv, fuse_io_entry_t *entry) {
+		priv->filler(priv->buf, entry->head.key, NULL, 0, 0);
+		return 0;
+	}
+	if (strcmp(path, "/") != 0) return -ENOENT;
+
+	filler(buf, ".", NULL, 0, 0);
+	filler(buf, "..", NULL, 0, 0);
+
+	hashtbl_ts_traverse(
+			&((fuse_io_priv_t*)fuse_get_context()->private_data)->
+			entries, (int (*)(void*, hashtbl_elt_t*))rep, &priv);
 
 	return 0;
 }
 
+static int fuse_io_open(const char *path, struct fuse_file_info *fi) {
+	fuse_io_entry_t *entry;
+	int ret = fuse_io_entry_open(
+			&((fuse_io_priv_t*)fuse_get_context()->private_data)->
+			entries, path + 1, fi->flags, &entry);
+
+	if (!ret) fi->fh = (uintptr_t)entry;
 
-static int fuse_io_read(const char *path, char *buf, size_t size, off_t offset,
-		struct fuse_file_info *fi) {
-	fuse_io_entry_t *entry = hashtbl_find_element_bykey(
+	return ret;
+}
+
+static int fuse_io_release(const char *path, struct fuse_file_info *fi) {
+	fuse_io_entry_release(
 			&((fuse_io_priv_t*)fuse_get_context()->private_data)->
-			entries, path + 1);
+			entries, (fuse_io_entry_t*)(uintptr_t)fi->fh);
 
-	if (!entry) return -ENOENT;
+	return 0;
+}
 
-	pthread_cleanup_push(hashtbl_unlock_element_byptr, entry);
+/* the file is open, so the entry in fi->fh stays until it is
+ * released, do_req does the locking, reads run in parallel */
+static int fuse_io_read(const char *path, char *buf, size_t size, off_t offset,
+		struct fuse_file_info *fi) {
+	fuse_io_entry_t *entry = (fuse_io_entry_t*)(uintptr_t)fi->fh;
 
 	do_req(&entry->l, SCUBED3_READ, offset, size, (char*)buf);
 
-	pthread_cleanup_pop(1);
-
 	return size;
 }
 
 static int fuse_io_write(const char *path, const char *buf, size_t size,
 		off_t offset, struct fuse_file_info *fi) {
-	fuse_io_entry_t *entry = hashtbl_find_element_bykey(
-			&((fuse_io_priv_t*)fuse_get_context()->private_data)->
-			entries, path + 1);
-	if (!entry) return -ENOENT;
+	fuse_io_entry_t *entry = (fuse_io_entry_t*)(uintptr_t)fi->fh;
 
 	assert(!entry->readonly);
 
-	pthread_cleanup_push(hashtbl_unlock_element_byptr, entry);
-
+	/* see fuse_io_read, do_req serialises the writes */
 	do_req(&entry->l, SCUBED3_WRITE, offset, size, (char*)buf);
 
-	pthread_cleanup_pop(1);
-
 	return size;
 }
 
 void *fuse_io_init(struct fuse_conn_info *conn, struct fuse_config *config) {
-	fuse_io_priv_t *priv = fuse_get_context()->private_data;
-
 	/* we assume the mountpoint is the first entry in struct fuse_session
 	 * THIS IS VERY VERY BAD, since "struct fuse_session" is an opaque
 	 * struct, let's say it is fuse's fault to not make it available */
-	priv->control_thread_priv.mountpoint =
-			*((char**)fuse_get_session(fuse_get_context()->fuse));
-
-	/* start control thread */
-	priv->control_thread_priv.h = &priv->entries;
-	priv->control_thread_priv.ids = &priv->ids;
-	pthread_create(&priv->control_thread, NULL, control_thread,
-			&priv->control_thread_priv);
-
-	/* start paranoia level manager thread */
-	pthread_create(&priv->plmgr_thread, NULL, plmgr_thread,
-			&priv->plmgr_thread_priv);
+	fuse_io_start_threads(fuse_get_context()->private_data,
+			*((char**)fuse_get_session(fuse_get_context()->fuse)));
 
 	return fuse_get_context()->private_data;
 }
 
 void fuse_io_destroy(void *arg) {
-	fuse_io_priv_t *priv = fuse_get_context()->private_data;
 	VERBOSE("destroy called");
 
-	/* stop paranoia level manager caand control thread */
-	plmgr_thread_cancel_join_cleanup(priv->plmgr_thread,
-			&priv->plmgr_thread_priv);
-	control_thread_cancel_join_cleanup(priv->control_thread,
-			&priv->control_thread_priv);
+	fuse_io_stop_threads(fuse_get_context()->private_data);
 }
 
 #if 0
@@ -249,36 +300,16 @@ static struct fuse_operations fuse_io_operations = {
 //	.flush = fuse_io_flush
 };
 
-static void freer(fuse_io_entry_t *entry) {
-	pthd_cond_destroy(&entry->cond);
-	free(entry->head.key);
-	free(entry->mountpoint);
-	scubed3_free(&entry->l);
-	blockio_dev_free(&entry->d);
-	cipher_free(&entry->c);
-	if (entry->ids) {
-		hashtbl_delete_element_byptr(entry->ids, &entry->unique_id);
-		wipememory(entry->unique_id.id, 32);
-	}
-	free(entry);
-}
-
-int fuse_io_start(int argc, char *argv[], blockio_t *b) {
+int fuse_io_start(int argc, char *argv[], blockio_t *b,
+		const nbd_thread_priv_t *nbd) {
 	int ret;
 	fuse_io_priv_t priv = { }; /* initialize to zeroes */
-	hashtbl_init_default(&priv.entries, -1, 4, 1, 1,
-			(void (*)(void*))freer);
-	hashtbl_init_default(&priv.ids, 32, 4, 1, 1, NULL);
 
-	priv.control_thread_priv.b = b;
-	priv.plmgr_thread_priv.b = b;
-	b->plmgr = &priv.plmgr_thread_priv;
+	fuse_io_priv_init(&priv, b, nbd);
 
 	ret = fuse_main(argc, argv, &fuse_io_operations, &priv);
 
-	hashtbl_free(&priv.entries);
-	hashtbl_free(&priv.ids);
+	fuse_io_priv_free(&priv);
 
 	return ret;
 }
-
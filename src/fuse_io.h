@@ -19,16 +19,20 @@
 #define INCLUDE_SCUBED3_FUSE_IO_H 1
 
 #include <fcntl.h>
+#include <sys/stat.h>
 #include "scubed3.h"
 #include "hashtbl.h"
 #include "cipher.h"
 #include "blockio.h"
+#include "control.h"
+#include "plmgr.h"
+#include "nbd.h"
 
 typedef struct fuse_io_entry_s {
         hashtbl_elt_t head;
 
         uint64_t size;
-        int inuse;
+        int inuse; /* references, held by open files in fi->fh */
 	int readonly;
 	int to_be_deleted;
 	int close_on_release;
@@ -50,6 +54,33 @@ typedef struct fuse_io_id_s {
 	char *name;
 } fuse_io_id_t;
 
-int fuse_io_start(int, char**, blockio_t*);
+/* shared by both frontends */
+typedef struct fuse_io_priv_s {
+	hashtbl_t entries, ids;
+	pthread_t control_thread;
+	control_thread_priv_t control_thread_priv;
+	pthread_t plmgr_thread;
+	plmgr_thread_priv_t plmgr_thread_priv;
+	pthread_t nbd_thread;
+	nbd_thread_priv_t nbd_thread_priv;
+} fuse_io_priv_t;
+
+void fuse_io_priv_init(fuse_io_priv_t*, blockio_t*, const nbd_thread_priv_t*);
+
+void fuse_io_priv_free(fuse_io_priv_t*);
+
+void fuse_io_start_threads(fuse_io_priv_t*, char*);
+
+void fuse_io_stop_threads(fuse_io_priv_t*);
+
+int fuse_io_entry_getattr(hashtbl_t*, const char*, struct stat*);
+
+int fuse_io_entry_open(hashtbl_t*, const char*, int, fuse_io_entry_t**);
+
+void fuse_io_entry_release(hashtbl_t*, fuse_io_entry_t*);
+
+void fuse_io_entry_free(fuse_io_entry_t*);
+
+int fuse_io_start(int, char**, blockio_t*, const nbd_thread_priv_t*);
 
 #endif /* INCLUDE_SCUBED3_FUSE_IO_H */
@@ -0,0 +1,407 @@
+/* fuse_ll.c - interaction with fuse through the low level API
+ *
+ * Copyright (C) 2019  Rik Snel <rik@snel.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define FUSE_USE_VERSION 34
+#include <fuse3/fuse_lowlevel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include "verbose.h"
+#include "util.h"
+#include "pthd.h"
+#include "hashtbl.h"
+#include "fuse_io.h"
+#include "fuse_ll.h"
+
+/* the size of the largest read and write request we ask for */
+#define FUSE_LL_MAX_IO (1<<20)
+
+#define FUSE_LL_TIMEOUT 1.0
+
+typedef struct fuse_ll_priv_s {
+	fuse_io_priv_t io;
+	char *mountpoint;
+
+	/* inode numbers: 1 is the root directory, partitions get
+	 * numbers from 2 on when they are first seen, the numbers
+	 * are never reused, so a stale inode number can not refer
+	 * to another partition */
+	pthread_mutex_t names_mutex;
+	char **names;
+	uint32_t no_names;
+} fuse_ll_priv_t;
+
+static fuse_ino_t ll_ino(fuse_ll_priv_t *priv, const char *name) {
+	uint32_t i;
+
+	pthd_mutex_lock(&priv->names_mutex);
+	for (i = 0; i < priv->no_names; i++)
+		if (!strcmp(priv->names[i], name)) break;
+
+	if (i == priv->no_names) {
+		priv->names = erealloc(priv->names, i + 1, sizeof(char*));
+		priv->names[priv->no_names++] = estrdup(name);
+	}
+	pthd_mutex_unlock(&priv->names_mutex);
+
+	return i + 2;
+}
+
+/* the names are never freed while the filesystem is mounted */
+static const char *ll_name(fuse_ll_priv_t *priv, fuse_ino_t ino) {
+	const char *name = NULL;
+
+	pthd_mutex_lock(&priv->names_mutex);
+	if (ino >= 2 && ino - 2 < priv->no_names) name = priv->names[ino - 2];
+	pthd_mutex_unlock(&priv->names_mutex);
+
+	return name;
+}
+
+static int ll_stat(fuse_ll_priv_t *priv, fuse_ino_t ino, struct stat *stbuf) {
+	const char *name;
+	int ret;
+
+	if (ino == FUSE_ROOT_ID) {
+		memset(stbuf, 0, sizeof(*stbuf));
+		stbuf->st_ino = ino;
+		stbuf->st_mode = S_IFDIR|0755;
+		stbuf->st_nlink = 2;
+		return 0;
+	}
+
+	if (!(name = ll_name(priv, ino))) return -ENOENT;
+
+	if ((ret = fuse_io_entry_getattr(&priv->io.entries, name, stbuf)))
+		return ret;
+
+	stbuf->st_ino = ino;
+
+	return 0;
+}
+
+static void fuse_ll_init(void *userdata, struct fuse_conn_info *conn) {
+	fuse_ll_priv_t *priv = userdata;
+
+	/* let the kernel send large requests, and hand us the data of
+	 * writes in a pipe, so that it can be copied to its place in
+	 * the macroblock without going through a buffer */
+	conn->max_write = FUSE_LL_MAX_IO;
+	conn->max_read = FUSE_LL_MAX_IO;
+	conn->max_readahead = FUSE_LL_MAX_IO;
+	if (conn->capable & FUSE_CAP_SPLICE_READ)
+		conn->want |= FUSE_CAP_SPLICE_READ;
+
+	fuse_io_start_threads(&priv->io, priv->mountpoint);
+}
+
+static void fuse_ll_destroy(void *userdata) {
+	VERBOSE("destroy called");
+
+	fuse_io_stop_threads(&((fuse_ll_priv_t*)userdata)->io);
+}
+
+static void fuse_ll_lookup(fuse_req_t req, fuse_ino_t parent,
+		const char *name) {
+	fuse_ll_priv_t *priv = fuse_req_userdata(req);
+	struct fuse_entry_param e = {
+		.attr_timeout = FUSE_LL_TIMEOUT,
+		.entry_timeout = FUSE_LL_TIMEOUT
+	};
+	int ret;
+
+	if (parent != FUSE_ROOT_ID) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+
+	if ((ret = fuse_io_entry_getattr(&priv->io.entries, name, &e.attr))) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+
+	e.ino = e.attr.st_ino = ll_ino(priv, name);
+
+	fuse_reply_entry(req, &e);
+}
+
+static void fuse_ll_getattr(fuse_req_t req, fuse_ino_t ino,
+		struct fuse_file_info *fi) {
+	struct stat stbuf;
+	int ret;
+
+	if ((ret = ll_stat(fuse_req_userdata(req), ino, &stbuf)))
+		fuse_reply_err(req, -ret);
+	else fuse_reply_attr(req, &stbuf, FUSE_LL_TIMEOUT);
+}
+
+typedef struct fuse_ll_dirbuf_s {
+	fuse_req_t req;
+	fuse_ll_priv_t *priv;
+	char *buf;
+	size_t size;
+} fuse_ll_dirbuf_t;
+
+static void dirbuf_add(fuse_ll_dirbuf_t *b, const char *name,
+		fuse_ino_t ino, mode_t mode) {
+	struct stat stbuf = {
+		.st_ino = ino,
+		.st_mode = mode
+	};
+	size_t oldsize = b->size;
+
+	b->size += fuse_add_direntry(b->req, NULL, 0, name, NULL, 0);
+	b->buf = erealloc(b->buf, b->size, 1);
+	fuse_add_direntry(b->req, b->buf + oldsize, b->size - oldsize,
+			name, &stbuf, b->size);
+}
+
+/* the listing is made again for every call, the offset of an
+ * entry is the offset of the next one in the listing */
+static void fuse_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+		off_t off, struct fuse_file_info *fi) {
+	fuse_ll_dirbuf_t b = {
+		.req = req,
+		.priv = fuse_req_userdata(req)
+	};
+	int rep(fuse_ll_dirbuf_t *b, fuse_io_entry_t *entry) {
+		dirbuf_add(b, entry->head.key,
+				ll_ino(b->priv, entry->head.key), S_IFREG);
+		return 0;
+	}
+
+	if (ino != FUSE_ROOT_ID) {
+		fuse_reply_err(req, ENOTDIR);
+		return;
+	}
+
+	dirbuf_add(&b, ".", FUSE_ROOT_ID, S_IFDIR);
+	dirbuf_add(&b, "..", FUSE_ROOT_ID, S_IFDIR);
+	hashtbl_ts_traverse(&b.priv->io.entries,
+			(int (*)(void*, hashtbl_elt_t*))rep, &b);
+
+	if (off < b.size) fuse_reply_buf(req, b.buf + off,
+			b.size - off < size ? b.size - off : size);
+	else fuse_reply_buf(req, NULL, 0);
+
+	free(b.buf);
+}
+
+static void fuse_ll_open(fuse_req_t req, fuse_ino_t ino,
+		struct fuse_file_info *fi) {
+	fuse_ll_priv_t *priv = fuse_req_userdata(req);
+	fuse_io_entry_t *entry;
+	const char *name;
+	int ret;
+
+	if (ino == FUSE_ROOT_ID) {
+		fuse_reply_err(req, EISDIR);
+		return;
+	}
+
+	if (!(name = ll_name(priv, ino))) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+
+	if ((ret = fuse_io_entry_open(&priv->io.entries, name,
+					fi->flags, &entry))) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+
+	fi->fh = (uintptr_t)entry;
+
+	fuse_reply_open(req, fi);
+}
+
+static void fuse_ll_release(fuse_req_t req, fuse_ino_t ino,
+		struct fuse_file_info *fi) {
+	fuse_io_entry_release(
+			&((fuse_ll_priv_t*)fuse_req_userdata(req))->io.entries,
+			(fuse_io_entry_t*)(uintptr_t)fi->fh);
+
+	fuse_reply_err(req, 0);
+}
+
+static void reply_mem(const void *data, size_t size, void *arg) {
+	struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(size);
+
+	bufv.buf[0].mem = (void*)data;
+
+	/* a memory buffer is written to the kernel directly */
+	fuse_reply_data(arg, &bufv, 0);
+}
+
+/* a read within one mesoblock of the current macroblock, or of a
+ * cached mesoblock, is sent to the kernel from where it is, other
+ * reads are decrypted into a buffer first */
+static void fuse_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+		off_t off, struct fuse_file_info *fi) {
+	fuse_io_entry_t *entry = (fuse_io_entry_t*)(uintptr_t)fi->fh;
+	char *buf;
+
+	if (off >= entry->size) {
+		fuse_reply_buf(req, NULL, 0);
+		return;
+	}
+
+	if (size > entry->size - off) size = entry->size - off;
+
+	if (scubed3_read_inplace(&entry->l, off, size, reply_mem, req)) return;
+
+	buf = ecalloc(1, size);
+	do_req(&entry->l, SCUBED3_READ, off, size, buf);
+	reply_mem(buf, size, req);
+	wipememory(buf, size);
+	free(buf);
+}
+
+typedef struct fuse_ll_src_s {
+	struct fuse_bufvec *bufv;
+	int err;
+} fuse_ll_src_t;
+
+/* the pieces are requested in order, fuse_buf_copy keeps track of
+ * where we are in the source */
+static void fill_buf(void *dst, uint32_t len, void *arg) {
+	fuse_ll_src_t *src = arg;
+	struct fuse_bufvec dst_bufv = FUSE_BUFVEC_INIT(len);
+	ssize_t res;
+
+	dst_bufv.buf[0].mem = dst;
+
+	res = fuse_buf_copy(&dst_bufv, src->bufv, 0);
+	if (res < 0) res = 0;
+	if (res < len) {
+		memset(dst + res, 0, len - res);
+		src->err = EIO;
+	}
+}
+
+/* if the data is in a pipe, it must be read, even if it is not used */
+static void drain_buf(struct fuse_bufvec *bufv) {
+	char buf[4096];
+	struct fuse_bufvec dst_bufv = FUSE_BUFVEC_INIT(sizeof(buf));
+
+	dst_bufv.buf[0].mem = buf;
+
+	while (fuse_buf_copy(&dst_bufv, bufv, 0) > 0)
+		dst_bufv.idx = dst_bufv.off = 0;
+}
+
+static void fuse_ll_write_buf(fuse_req_t req, fuse_ino_t ino,
+		struct fuse_bufvec *bufv, off_t off,
+		struct fuse_file_info *fi) {
+	fuse_io_entry_t *entry = (fuse_io_entry_t*)(uintptr_t)fi->fh;
+	size_t size = fuse_buf_size(bufv);
+	fuse_ll_src_t src = {
+		.bufv = bufv
+	};
+
+	assert(!entry->readonly);
+
+	if (off + size > entry->size) {
+		drain_buf(bufv);
+		fuse_reply_err(req, ENOSPC);
+		return;
+	}
+
+	scubed3_write(&entry->l, off, size, fill_buf, &src);
+
+	if (src.err) fuse_reply_err(req, src.err);
+	else fuse_reply_write(req, size);
+}
+
+static struct fuse_lowlevel_ops fuse_ll_operations = {
+	.init = fuse_ll_init,
+	.destroy = fuse_ll_destroy,
+	.lookup = fuse_ll_lookup,
+	.getattr = fuse_ll_getattr,
+	.readdir = fuse_ll_readdir,
+	.open = fuse_ll_open,
+	.release = fuse_ll_release,
+	.read = fuse_ll_read,
+	.write_buf = fuse_ll_write_buf
+};
+
+int fuse_ll_start(int argc, char *argv[], blockio_t *b,
+		const nbd_thread_priv_t *nbd) {
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct fuse_cmdline_opts opts;
+	struct fuse_loop_config config;
+	struct fuse_session *se;
+	fuse_ll_priv_t priv = { }; /* initialize to zeroes */
+	char max_read[32];
+	uint32_t i;
+	int ret = 1;
+
+	if (fuse_parse_cmdline(&args, &opts)) return 1;
+
+	if (opts.show_help || opts.show_version || !opts.mountpoint) {
+		if (opts.show_version) fuse_lowlevel_version();
+		else fuse_cmdline_help();
+		free(opts.mountpoint);
+		fuse_opt_free_args(&args);
+		return !opts.show_help && !opts.show_version;
+	}
+
+	/* the kernel only sends large reads if we ask at mount time */
+	snprintf(max_read, sizeof(max_read), "-omax_read=%u", FUSE_LL_MAX_IO);
+	fuse_opt_add_arg(&args, max_read);
+
+	fuse_io_priv_init(&priv.io, b, nbd);
+	pthd_mutex_init(&priv.names_mutex);
+	priv.mountpoint = opts.mountpoint;
+
+	if (!(se = fuse_session_new(&args, &fuse_ll_operations,
+					sizeof(fuse_ll_operations), &priv)))
+		goto out;
+
+	if (fuse_set_signal_handlers(se)) goto out_destroy;
+
+	if (fuse_session_mount(se, opts.mountpoint)) goto out_remove;
+
+	fuse_daemonize(opts.foreground);
+
+	/* with clone_fd every thread reads its requests from its own
+	 * file descriptor, so they don't contend for one */
+	if (opts.singlethread) ret = fuse_session_loop(se);
+	else {
+		config.clone_fd = 1;
+		config.max_idle_threads = opts.max_idle_threads;
+		ret = fuse_session_loop_mt(se, &config);
+	}
+
+	fuse_session_unmount(se);
+out_remove:
+	fuse_remove_signal_handlers(se);
+out_destroy:
+	fuse_session_destroy(se);
+out:
+	fuse_io_priv_free(&priv.io);
+	for (i = 0; i < priv.no_names; i++) free(priv.names[i]);
+	free(priv.names);
+	pthd_mutex_destroy(&priv.names_mutex);
+	free(opts.mountpoint);
+	fuse_opt_free_args(&args);
+
+	return ret ? 1 : 0;
+}
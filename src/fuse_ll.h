@@ -0,0 +1,26 @@
+/* fuse_ll.h - interaction with fuse through the low level API
+ *
+ * Copyright (C) 2019  Rik Snel <rik@snel.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef INCLUDE_SCUBED3_FUSE_LL_H
+#define INCLUDE_SCUBED3_FUSE_LL_H 1
+
+#include "blockio.h"
+#include "nbd.h"
+
+int fuse_ll_start(int, char**, blockio_t*, const nbd_thread_priv_t*);
+
+#endif /* INCLUDE_SCUBED3_FUSE_LL_H */
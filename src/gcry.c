@@ -42,6 +42,11 @@ void gcry_global_init(void) {
 	version = gcry_check_version(NULL);
 	DEBUG("using version %s of libgcrypt", version);
 
+	/* every worker thread has its own cipher handles (in secure
+	 * memory) for each device, so the default pool is too small */
+	gcry_control(GCRYCTL_AUTO_EXPAND_SECMEM, GCRY_SECMEM_SIZE);
+	gcry_control(GCRYCTL_INIT_SECMEM, GCRY_SECMEM_SIZE, 0);
+
 	/* is this needed? */
 	gcry_control(GCRYCTL_INITIALIZATION_FINISHED, 0);
 
@@ -30,6 +30,9 @@ typedef unsigned char gcry_key128_t[GCRY_KEY128_LEN];
 typedef unsigned char gcry_key256_t[GCRY_KEY256_LEN];
 
 #define GCRY_MSG_LEN 128
+
+/* initial size of the secure memory pool, it grows when needed */
+#define GCRY_SECMEM_SIZE (256*1024)
 #define gcry_call(a,...) do { \
 	int err; \
 	if ((err = gcry_##a(__VA_ARGS__))) gcry_fatal(err, #a); \
@@ -363,6 +363,12 @@ void hashtbl_cond_wait_element_byptr(void *elt, pthread_cond_t *cond) {
 	pthd_cond_wait(cond, &((hashtbl_elt_t*)elt)->data_mutex);
 }
 
+/* the caller must make sure that the element is not deleted */
+void hashtbl_lock_element_byptr(void *elt) {
+	assert(elt);
+	pthd_mutex_lock(&((hashtbl_elt_t*)elt)->data_mutex);
+}
+
 void hashtbl_unlock_element_byptr(void *elt) {
 	assert(elt);
 	pthd_mutex_unlock(&((hashtbl_elt_t*)elt)->data_mutex);
@@ -0,0 +1,101 @@
+/* hdrcache.c - cache of the raw headers of macroblocks
+ *
+ * Copyright (C) 2019  Rik Snel <rik@snel.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <assert.h>
+#include "verbose.h"
+#include "util.h"
+#include "pthd.h"
+#include "hdrcache.h"
+
+void hdrcache_init(hdrcache_t *h, uint32_t no_entries, uint32_t entry_size) {
+	assert(h && entry_size > 0);
+
+	memset(h, 0, sizeof(*h));
+
+	if (!no_entries) return;
+
+	pthd_rwlock_init(&h->rwlock);
+	h->no_entries = no_entries;
+	h->entry_size = entry_size;
+	h->tags = ecalloc(no_entries, sizeof(uint32_t));
+	h->data = ecalloc(no_entries, entry_size);
+
+	if (mlock(h->data, ((size_t)no_entries)*entry_size) < 0)
+		WARNING("failed locking header cache in RAM: %s",
+				strerror(errno));
+
+	VERBOSE("header cache has %u entries of %u bytes (%lu bytes)",
+			no_entries, entry_size,
+			((size_t)no_entries)*entry_size);
+}
+
+static char *slot(hdrcache_t *h, uint32_t i) {
+	return h->data + ((size_t)i)*h->entry_size;
+}
+
+int hdrcache_get(hdrcache_t *h, void *buf, uint32_t id) {
+	uint32_t i;
+	int hit = 0;
+	assert(h && buf);
+
+	if (!h->no_entries) return 0;
+
+	i = id%h->no_entries;
+
+	pthd_rwlock_rdlock(&h->rwlock);
+	if (h->tags[i] == id + 1) {
+		memcpy(buf, slot(h, i), h->entry_size);
+		hit = 1;
+	}
+	pthd_rwlock_unlock(&h->rwlock);
+
+	__atomic_add_fetch(hit?&h->hits:&h->misses, 1, __ATOMIC_RELAXED);
+
+	return hit;
+}
+
+void hdrcache_put(hdrcache_t *h, const void *buf, uint32_t id) {
+	uint32_t i;
+	assert(h && buf);
+
+	if (!h->no_entries) return;
+
+	i = id%h->no_entries;
+
+	pthd_rwlock_wrlock(&h->rwlock);
+	if (!h->tags[i]) h->used++;
+	h->tags[i] = id + 1;
+	memcpy(slot(h, i), buf, h->entry_size);
+	pthd_rwlock_unlock(&h->rwlock);
+}
+
+void hdrcache_free(hdrcache_t *h) {
+	assert(h);
+
+	if (!h->no_entries) return;
+
+	VERBOSE("header cache: %lu hits, %lu misses", h->hits, h->misses);
+
+	munlock(h->data, ((size_t)h->no_entries)*h->entry_size);
+	free(h->data);
+	free(h->tags);
+	pthd_rwlock_destroy(&h->rwlock);
+}
@@ -0,0 +1,52 @@
+/* hdrcache.h - cache of the raw headers of macroblocks
+ *
+ * Copyright (C) 2019  Rik Snel <rik@snel.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef INCLUDE_SCUBED3_HDRCACHE_H
+#define INCLUDE_SCUBED3_HDRCACHE_H 1
+
+#include <stdint.h>
+#include <pthread.h>
+
+/* the first entry_size bytes of the (still encrypted) index mesoblock of
+ * macroblocks, as they are on disk; enough to probe the magic, so that
+ * a scan for another key does not need to read the base device again
+ *
+ * the cache is direct mapped, macroblock id goes to slot
+ * id%no_entries, tags[slot] is id + 1 or 0 if the slot is empty */
+typedef struct hdrcache_s {
+	pthread_rwlock_t rwlock;
+	uint32_t no_entries;
+	uint32_t entry_size;
+	uint32_t *tags;
+	char *data; /* locked in RAM */
+
+	/* stats, updated atomically, hits happen under the read lock */
+	uint64_t hits, misses;
+	uint32_t used;
+} hdrcache_t;
+
+/* a cache with 0 entries is valid, it caches nothing */
+void hdrcache_init(hdrcache_t*, uint32_t, uint32_t);
+
+/* copies the header of macroblock id to buf, returns 1 on a hit */
+int hdrcache_get(hdrcache_t*, void*, uint32_t);
+
+void hdrcache_put(hdrcache_t*, const void*, uint32_t);
+
+void hdrcache_free(hdrcache_t*);
+
+#endif /* INCLUDE_SCUBED3_HDRCACHE_H */
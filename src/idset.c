@@ -0,0 +1,90 @@
+/* idset.c - set of macroblock ids with rank and select
+ *
+ * Copyright (C) 2019  Rik Snel <rik@snel.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <assert.h>
+#include "verbose.h"
+#include "util.h"
+#include "bitmap.h"
+#include "idset.h"
+
+void idset_init(idset_t *s, uint32_t size) {
+	assert(s);
+
+	bitmap_init(&s->members, size);
+	s->tree = ecalloc(size + 1, sizeof(uint32_t));
+	s->size = size;
+	for (s->top = 1; s->top <= size/2; s->top <<= 1);
+}
+
+static void update(idset_t *s, uint32_t id, int32_t delta) {
+	uint32_t i;
+
+	for (i = id + 1; i <= s->size; i += i&-i) s->tree[i] += delta;
+}
+
+void idset_add(idset_t *s, uint32_t id) {
+	assert(s && id < s->size && !bitmap_getbit(&s->members, id));
+
+	bitmap_setbit(&s->members, id);
+	update(s, id, 1);
+}
+
+void idset_remove(idset_t *s, uint32_t id) {
+	assert(s && id < s->size && bitmap_getbit(&s->members, id));
+
+	bitmap_clearbit(&s->members, id);
+	update(s, id, -1);
+}
+
+int idset_contains(idset_t *s, uint32_t id) {
+	assert(s && id < s->size);
+
+	return bitmap_getbit(&s->members, id);
+}
+
+uint32_t idset_count(idset_t *s) {
+	assert(s);
+
+	return s->members.no_set;
+}
+
+/* descend the implicit tree, pos is the largest index with
+ * less than n + 1 members in [1, pos] */
+uint32_t idset_nth(idset_t *s, uint32_t n) {
+	uint32_t pos = 0, step;
+	assert(s && n < idset_count(s));
+
+	for (step = s->top; step; step >>= 1) {
+		if (pos + step <= s->size && s->tree[pos + step] <= n) {
+			pos += step;
+			n -= s->tree[pos];
+		}
+	}
+
+	assert(pos < s->size && bitmap_getbit(&s->members, pos));
+
+	return pos; /* tree index pos + 1 is id pos */
+}
+
+void idset_free(idset_t *s) {
+	assert(s);
+
+	bitmap_free(&s->members);
+	free(s->tree);
+}
@@ -0,0 +1,50 @@
+/* idset.h - set of macroblock ids with rank and select
+ *
+ * Copyright (C) 2019  Rik Snel <rik@snel.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef INCLUDE_SCUBED3_IDSET_H
+#define INCLUDE_SCUBED3_IDSET_H 1
+
+#include <stdint.h>
+#include "bitmap.h"
+
+/* a subset of [0, size), the membership is in a bitmap, a Fenwick
+ * tree over the bitmap counts the members, so that adding, removing
+ * and finding the n-th member (in order of id) are all O(log size) */
+typedef struct idset_s {
+	bitmap_t members;
+	uint32_t *tree; /* tree[i] counts members in (i - lowbit(i), i] */
+	uint32_t size;
+	uint32_t top; /* largest power of two <= size */
+} idset_t;
+
+/* the set is empty after init */
+void idset_init(idset_t*, uint32_t);
+
+void idset_add(idset_t*, uint32_t);
+
+void idset_remove(idset_t*, uint32_t);
+
+int idset_contains(idset_t*, uint32_t);
+
+uint32_t idset_count(idset_t*);
+
+/* returns the n-th smallest member, n < count */
+uint32_t idset_nth(idset_t*, uint32_t);
+
+void idset_free(idset_t*);
+
+#endif /* INCLUDE_SCUBED3_IDSET_H */
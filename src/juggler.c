@@ -21,64 +21,341 @@
 #include <limits.h>
 #include <errno.h>
 #include <string.h>
+#include <stdlib.h>
+#include <math.h>
 #include "verbose.h"
 #include "util.h"
 #include "blockio.h"
 #include "binio.h"
 #include "juggler.h"
 
+#define WHEEL_MIN 64
+#define SLOT(j, s) ((s)&((j)->wheel_size - 1))
+
+static void push(blockio_info_t ***arr, uint32_t *no, uint32_t *size,
+		blockio_info_t *b) {
+	if (*no == *size) {
+		*size = *size?*size<<1:64;
+		*arr = erealloc(*arr, *size, sizeof(blockio_info_t*));
+	}
+	(*arr)[(*no)++] = b;
+}
+
+static void mark(juggler_t *j, uint32_t i, int used) {
+	uint32_t l;
+
+	assert(!(j->used[i>>6]&(1ULL<<(i&63))) == !!used);
+	j->used[i>>6] ^= 1ULL<<(i&63);
+	for (l = 1; l < j->no_levels; l++) j->count[l][i>>(6*l)] += used?1:-1;
+}
+
+static inline uint64_t bits(juggler_t *j, uint32_t k, int used) {
+	return used?j->used[k]:~j->used[k];
+}
+
+static inline uint32_t amount(juggler_t *j, uint32_t l, uint32_t g,
+		int used) {
+	return used?j->count[l][g]:(1U<<(6*l)) - j->count[l][g];
+}
+
+/* position of the k-th set bit in w, counting from 0 */
+static uint32_t select_bit(uint64_t w, uint32_t k) {
+	uint32_t pos = 0, s, n;
+
+	for (s = 32; s; s >>= 1)
+		if (k >= (n = __builtin_popcountll(w&((1ULL<<s) - 1)))) {
+			k -= n;
+			w >>= s;
+			pos += s;
+		}
+
+	return pos;
+}
+
+/* the k-th (counting from 0) used (or free) slot at or after pos, the
+ * counts are followed up and down, returns wheel_size if there is none */
+static uint32_t select_slot(juggler_t *j, uint32_t pos, uint32_t k,
+		int used) {
+	uint64_t w = bits(j, pos>>6, used)&(~0ULL<<(pos&63));
+	uint32_t l = 1, g = (pos>>6) + 1, n;
+
+	if (k < (n = __builtin_popcountll(w)))
+		return (pos&~63) + select_bit(w, k);
+	k -= n;
+
+	while (1) {
+		if (g >= j->no_groups[l]) return j->wheel_size;
+		if (!(g&63) && l + 1 < j->no_levels) {
+			g >>= 6;
+			l++;
+			continue;
+		}
+		if (k < (n = amount(j, l, g, used))) break;
+		k -= n;
+		g++;
+	}
+
+	while (--l) {
+		g <<= 6;
+		while (k >= (n = amount(j, l, g, used))) {
+			k -= n;
+			g++;
+		}
+	}
+
+	return (g<<6) + select_bit(bits(j, g, used), k);
+}
+
+/* number of used slots before pos */
+static uint32_t rank(juggler_t *j, uint32_t pos) {
+	uint32_t l, g, i, ret = 0;
+
+	if (pos < j->wheel_size) ret = __builtin_popcountll(
+			j->used[pos>>6]&((1ULL<<(pos&63)) - 1));
+
+	for (l = 1; l < j->no_levels; l++) {
+		g = pos>>(6*l);
+		for (i = l + 1 < j->no_levels?g&~63:0; i < g; i++)
+			ret += j->count[l][i];
+	}
+
+	return ret;
+}
+
+/* number of used slots in the len slots from pos */
+static uint32_t count_used(juggler_t *j, uint32_t pos, uint32_t len) {
+	if (pos + len <= j->wheel_size) return rank(j, pos + len) - rank(j, pos);
+
+	return rank(j, j->wheel_size) - rank(j, pos) +
+		rank(j, pos + len - j->wheel_size);
+}
+
+/* returns the distance from slot pos to the k-th used (or free) slot,
+ * only len slots are searched, returns len if there is none */
+static uint32_t select_ring(juggler_t *j, uint32_t pos, uint32_t len,
+		uint32_t k, int used) {
+	uint32_t i = select_slot(j, pos, k, used), d, n;
+
+	if (i < j->wheel_size) d = i - pos;
+	else {
+		n = count_used(j, pos, j->wheel_size - pos);
+		if (!used) n = j->wheel_size - pos - n;
+		if ((i = select_slot(j, 0, k - n, used)) == j->wheel_size)
+			return len;
+		d = j->wheel_size - pos + i;
+	}
+
+	return d < len?d:len;
+}
+
+static void wheel_set(juggler_t *j, blockio_info_t *b) {
+	uint32_t i = SLOT(j, b->next_seqno);
+
+	assert(!j->wheel[i] && b->next_seqno - j->seqno <= j->wheel_size);
+	j->wheel[i] = b;
+	mark(j, i, 1);
+}
+
+static void wheel_clear(juggler_t *j, uint32_t i) {
+	j->wheel[i] = NULL;
+	mark(j, i, 0);
+}
+
+static void wheel_free(juggler_t *j) {
+	uint32_t l;
+
+	free(j->wheel);
+	free(j->used);
+	for (l = 1; l < j->no_levels; l++) free(j->count[l]);
+}
+
+/* an empty wheel, all slots are free */
+static void wheel_reset(juggler_t *j) {
+	uint32_t l;
+
+	memset(j->wheel, 0, j->wheel_size*sizeof(blockio_info_t*));
+	memset(j->used, 0, (j->wheel_size>>6)*sizeof(uint64_t));
+	for (l = 1; l < j->no_levels; l++)
+		memset(j->count[l], 0, j->no_groups[l]*sizeof(uint32_t));
+}
+
+/* the top level has at most 64 groups */
+static void wheel_alloc(juggler_t *j, uint32_t size) {
+	uint32_t l = 1;
+
+	wheel_free(j);
+
+	j->wheel = ecalloc(size, sizeof(blockio_info_t*));
+	j->used = ecalloc(size>>6, sizeof(uint64_t));
+	j->wheel_size = size;
+	j->no_groups[0] = size;
+
+	do {
+		assert(l < JUGGLER_LEVELS);
+		j->no_groups[l] = (j->no_groups[l - 1] + 63)>>6;
+		j->count[l] = ecalloc(j->no_groups[l], sizeof(uint32_t));
+	} while (j->no_groups[l++] > 64);
+	j->no_levels = l;
+}
+
+/* the number of free slots that are skipped before the block
+ * reappears, if it reappears in each free slot with probability 1/a,
+ * (geometric distribution, sampled by inversion with 53 random bits) */
+static double skip(juggler_t *j, uint32_t a) {
+	uint64_t x;
+
+	if (a == 1) return 0;
+
+	x = ((uint64_t)(random_uint32(j->r)>>11)<<32)|random_uint32(j->r);
+
+	return floor(log((x + 1.)/(1ULL<<53))/log1p(-1./a));
+}
+
+/* adds b to the digest of the schedule, or removes it */
+static void digest_toggle(juggler_t *j, blockio_info_t *b) {
+	char buf[2*sizeof(uint64_t)];
+	unsigned char *hash;
+	int i;
+
+	if (!j->digest_hd) return;
+
+	binio_write_uint64_be(buf, b->seqno);
+	binio_write_uint64_be(buf + sizeof(uint64_t), b->next_seqno);
+	gcry_md_reset(j->digest_hd);
+	gcry_md_write(j->digest_hd, buf, sizeof(buf));
+	hash = gcry_md_read(j->digest_hd, 0);
+	for (i = 0; i < sizeof(j->digest); i++) j->digest[i] ^= hash[i];
+}
+
+/* blocks from the list of later blocks that are in reach of the wheel */
+static void migrate(juggler_t *j) {
+	blockio_info_t *b;
+
+	while ((b = j->later) && b->next_seqno - j->seqno <= j->wheel_size) {
+		j->later = b->next;
+		b->next = NULL;
+		wheel_set(j, b);
+	}
+}
+
+static int cmp_next_seqno(const void *a, const void *b) {
+	const blockio_info_t *A = *(blockio_info_t**)a,
+	      *B = *(blockio_info_t**)b;
+
+	return (A->next_seqno > B->next_seqno) - (A->next_seqno < B->next_seqno);
+}
+
+/* sorts the pending blocks into the schedule, the wheel is rebuilt
+ * when blocks were added or the seqno was changed from outside,
+ * it is kept at least four times larger than the number of blocks,
+ * so that almost no block needs to wait in the list of later blocks */
+static void settle(juggler_t *j) {
+	uint64_t size = WHEEL_MIN;
+	blockio_info_t *b, **tail = &j->later;
+	uint32_t i;
+
+	if (!j->dirty && j->wheel_size &&
+			4*(uint64_t)juggler_count(j) <= j->wheel_size) return;
+
+	while (size < 4*(uint64_t)juggler_count(j)) size <<= 1;
+
+	for (i = 0; i < j->wheel_size; i++) if (j->wheel[i])
+		push(&j->pending, &j->no_pending, &j->pending_size,
+				j->wheel[i]);
+
+	while ((b = j->later)) {
+		j->later = b->next;
+		b->next = NULL;
+		push(&j->pending, &j->no_pending, &j->pending_size, b);
+	}
+
+	qsort(j->pending, j->no_pending, sizeof(blockio_info_t*),
+			cmp_next_seqno);
+
+	if (size > j->wheel_size) wheel_alloc(j, size);
+	wheel_reset(j);
+
+	for (i = 0; i < j->no_pending; i++) {
+		b = j->pending[i];
+		assert(b->next_seqno > j->seqno);
+		assert(!i || j->pending[i - 1]->next_seqno < b->next_seqno);
+		if (b->next_seqno - j->seqno <= j->wheel_size) wheel_set(j, b);
+		else {
+			*tail = b;
+			tail = &b->next;
+		}
+	}
+
+	j->no_scheduled = j->no_pending;
+	j->no_pending = 0;
+	j->dirty = 0;
+}
+
+/* the first scheduled block after b (or after the current
+ * seqno if b is NULL), in order of next_seqno */
+static blockio_info_t *scheduled_after(juggler_t *j, blockio_info_t *b) {
+	uint64_t d = (b?b->next_seqno:j->seqno) - j->seqno;
+	uint32_t n;
+
+	if (d > j->wheel_size) return b->next;
+
+	if (d < j->wheel_size) {
+		n = j->wheel_size - d;
+		d += select_ring(j, SLOT(j, j->seqno + d + 1), n, 0, 1) + 1;
+		if (d <= j->wheel_size) return j->wheel[SLOT(j, j->seqno + d)];
+	}
+
+	return j->later;
+}
+
 void juggler_init(juggler_t *j, random_t *r) {
 	assert(j && r);
 
-	j->unscheduled = j->scheduled = NULL;
-	j->no_scheduled = j->no_unscheduled = 0;
+	memset(j, 0, sizeof(*j));
 	j->r = r;
-	j->seqno = 0;
 }
 
 uint32_t juggler_count(juggler_t *j) {
-	return j->no_scheduled + j->no_unscheduled;
+	return j->no_scheduled + j->no_pending + j->no_unscheduled;
 }
 
 void juggler_notify_seqno(juggler_t *j, uint64_t seqno) {
-	if (seqno > j->seqno) j->seqno = seqno;
+	if (seqno > j->seqno) {
+		j->seqno = seqno;
+		j->dirty = 1;
+	}
 }
 
 void juggler_add_macroblock(juggler_t *j, blockio_info_t *b) {
 	assert(j && b);
 	assert(!b->next);
 	if (b->seqno == 0 && b->next_seqno == 0) { // new block
-		assert(!b->next_seqno);
-		j->no_unscheduled++;
-		b->next = j->unscheduled;
-		j->unscheduled = b;
+		push(&j->unscheduled, &j->no_unscheduled,
+				&j->unscheduled_size, b);
 	} else  if (b->seqno < b->next_seqno) { // block that is in use
-		blockio_info_t **iterate = &j->scheduled;
-		assert(b->next_seqno > b->seqno);
-		while (*iterate && (*iterate)->next_seqno < b->next_seqno)
-			iterate = &((*iterate)->next);
-		assert(!(*iterate) || (*iterate)->next_seqno > b->next_seqno);
-		b->next = *iterate;
-		*iterate = b;
-		j->no_scheduled++;
+		push(&j->pending, &j->no_pending, &j->pending_size, b);
+		j->dirty = 1;
+		digest_toggle(j, b);
 		juggler_notify_seqno(j, b->seqno);
 	} else assert(0); // nonsensical block
 }
 
 blockio_info_t *juggler_get_obsoleted(juggler_t *j) {
 	assert(j);
-	blockio_info_t *ret = j->scheduled;
 
-	if (ret && ret->next_seqno == j->seqno + 1) return ret;
-	else return NULL;
+	settle(j);
+
+	return j->wheel_size?j->wheel[SLOT(j, j->seqno + 1)]:NULL;
 }
 
 int juggler_discard_possible(juggler_t *j, blockio_info_t *next) {
+	settle(j);
+
 	/* if a block is scheduled to be written, either another block
 	 * must be scheduled to be written after that or an unscheduled
 	 * block must be available to fill the hole */
-	if (next && (j->no_unscheduled == 0 && (!next->next ||
-			next->next->next_seqno != next->next_seqno + 1)))
+	if (next && (j->no_unscheduled == 0 &&
+				!j->wheel[SLOT(j, next->next_seqno + 1)]))
 		return 0;
 
 	/* of no block is scheduled to be written, then we must discard
@@ -92,15 +369,16 @@ int juggler_discard_possible(juggler_t *j, blockio_info_t *next) {
 char *juggler_hash_scheduled_seqnos(juggler_t *j, char *hash_res) {
 	gcry_md_hd_t hd;
 	char buf[sizeof(uint64_t)];
+	blockio_info_t *bi = NULL;
 
-	blockio_info_t *bi = j->scheduled;
+	settle(j);
 
 	gcry_call(md_open, &hd, GCRY_MD_SHA256, 0);
 
-	if (bi) do {
+	while ((bi = scheduled_after(j, bi))) {
 		binio_write_uint64_be(buf, bi->seqno);
 		gcry_md_write(hd, buf, sizeof(uint64_t));
-	} while ((bi = bi->next));
+	}
 
 	memcpy(hash_res, gcry_md_read(hd, 0), 32);
 	gcry_md_close(hd);
@@ -108,8 +386,27 @@ char *juggler_hash_scheduled_seqnos(juggler_t *j, char *hash_res) {
 	return hash_res;
 }
 
+void juggler_digest_init(juggler_t *j, const void *key, size_t len) {
+	assert(!j->digest_hd && !juggler_count(j));
+
+	gcry_call(md_open, &j->digest_hd, GCRY_MD_SHA256,
+			GCRY_MD_FLAG_HMAC|GCRY_MD_FLAG_SECURE);
+	gcry_call(md_setkey, j->digest_hd, key, len);
+}
+
+char *juggler_digest_scheduled(juggler_t *j, char *hash_res) {
+	assert(j->digest_hd);
+
+	memcpy(hash_res, j->digest, sizeof(j->digest));
+
+	return hash_res;
+}
+
 blockio_info_t *juggler_get_devblock(juggler_t *j, int discard) {
 	blockio_info_t *next = juggler_get_obsoleted(j), **iterate;
+	uint32_t index, n, candidates;
+	uint64_t d;
+	double g;
 
 	/* if the user wants to discard the next block, let's
 	 * see if that is possible, return NULL if not */
@@ -117,18 +414,16 @@ blockio_info_t *juggler_get_devblock(juggler_t *j, int discard) {
 
 	if (next) {
 		//VERBOSE("already scheduled block must be output");
-		j->scheduled = next->next;
+		wheel_clear(j, SLOT(j, next->next_seqno));
 		j->no_scheduled--;
+		digest_toggle(j, next);
 	} else {
 		//VERBOSE("no scheduled block to output, select from unscheduled blocks");
-		assert(j->unscheduled && j->no_unscheduled != 0);
-		uint32_t index = random_custom(j->r, j->no_unscheduled);
+		assert(j->no_unscheduled != 0);
+		index = random_custom(j->r, j->no_unscheduled);
 		//VERBOSE("requested index is %u", index);
-		iterate = &j->unscheduled;
-		while (index--) iterate = &((*iterate)->next);
-		next = *iterate;
-		*iterate =  next->next;
-		j->no_unscheduled--;
+		next = j->unscheduled[index];
+		j->unscheduled[index] = j->unscheduled[--j->no_unscheduled];
 
 		if (discard) {
 			assert(j->no_unscheduled > 0);
@@ -142,6 +437,7 @@ blockio_info_t *juggler_get_devblock(juggler_t *j, int discard) {
 	}
 
 	j->seqno++;
+	migrate(j);
 
 	/* decide when we will see the chosen block again */
 	/* it is now at time 0, so the first time at which
@@ -151,75 +447,124 @@ blockio_info_t *juggler_get_devblock(juggler_t *j, int discard) {
 	// is also available to be selected, we are only interested in
 	// when our selected block is reselected
 	uint32_t available_blocks = j->no_unscheduled + 1; // unscheduled blocks + selected block
-	iterate = &j->scheduled;
+	iterate = &j->later;
 	next->seqno = next->next_seqno = j->seqno;
 
 	if (discard) {
 		assert(j->no_unscheduled > 0 ||
-				(j->scheduled &&
-				 j->scheduled->next_seqno == next->seqno + 1));
+				j->wheel[SLOT(j, next->seqno + 1)]);
 		next->next = NULL;
 
 		/* we don't reschedule this block, since it will be discarded
 		 * the block MUST be written to disk (to indicate that it
 		 * has been discarded), the fact that this block is discarded
 		 * will be visible because seqno and next_seqno are equal */
-	} else do {
-		next->next_seqno++;
-		if ((*iterate) && next->next_seqno == (*iterate)->next_seqno) {
-			/* our block will certainly not appear here
-			 * because another block is scheduled to appear */
+		return next;
+	}
+
+	/* in each free slot the block reappears with probability
+	 * 1/available_blocks, and each used slot that is passed increases
+	 * available_blocks; the slots are not visited one by one, a
+	 * reappearance is proposed with the current (highest) probability
+	 * by skipping a geometrically distributed number of free slots,
+	 * and accepted with the ratio of the real probability at that
+	 * slot and the proposed one; next_seqno is the last slot that
+	 * is passed */
+	while ((d = next->next_seqno - j->seqno) < j->wheel_size) {
+		n = j->wheel_size - d;
+		if ((g = skip(j, available_blocks)) < n)
+			n = select_ring(j, SLOT(j, next->next_seqno + 1), n,
+					g, 0);
+		if (n == j->wheel_size - d) {
+			/* no proposal in the wheel */
+			available_blocks += count_used(j,
+					SLOT(j, next->next_seqno + 1), n);
+			next->next_seqno += n;
+			d += n;
+			break;
+		}
+
+		/* n slots are skipped, g of them are free */
+		next->next_seqno += n + 1;
+		candidates = available_blocks + n - (uint32_t)g;
+		if (candidates == available_blocks || random_custom(j->r,
+					candidates) < available_blocks) break;
+		available_blocks = candidates;
+	}
+
+	/* past the wheel, there are only a few blocks in the list */
+	if (d == j->wheel_size) while (1) {
+		if (*iterate &&
+				(*iterate)->next_seqno == next->next_seqno + 1) {
+			next->next_seqno++;
 			iterate = &((*iterate)->next);
 			available_blocks++;
-		} else {
-			if (!random_custom(j->r, available_blocks)) {
-				next->next = *iterate;
-				*iterate = next;
-				j->no_scheduled++;
-				break;
-			}
+			continue;
 		}
-	} while (1);
-
-	return next;
-}
+		g = skip(j, available_blocks);
+		if (!*iterate || g < (*iterate)->next_seqno -
+				next->next_seqno - 1) {
+			next->next_seqno += (uint64_t)g + 1;
+			break;
+		}
+		next->next_seqno = (*iterate)->next_seqno;
+		iterate = &((*iterate)->next);
+		available_blocks++;
+	}
 
-static void show_list(const char *name, blockio_info_t *list,
-		uint32_t (*getnum)(blockio_info_t*, void*), void *priv) {
-	blockio_info_t *b = list;
-	int i = 0;
-	VERBOSE("%s", name);
-	while (b) {
-		VERBOSE("%d [%u %5lu]", i++, getnum(b, priv), b->next_seqno);
-		b = b->next;
+	if (next->next_seqno - j->seqno <= j->wheel_size) wheel_set(j, next);
+	else {
+		next->next = *iterate;
+		*iterate = next;
 	}
+	j->no_scheduled++;
+	digest_toggle(j, next);
+
+	return next;
 }
 
 void juggler_verbose(juggler_t *j, uint32_t (*getnum)(blockio_info_t*, void*), void *priv) {
+	blockio_info_t *b = NULL;
+	uint32_t i = 0;
+
+	settle(j);
+
 	VERBOSE("--juggler--");
 	VERBOSE("no_scheduled=%u, no_unscheduled=%u, seqno=%lu",
 			j->no_scheduled, j->no_unscheduled, j->seqno);
-	show_list("scheduled", j->scheduled, getnum, priv);
-	show_list("unscheduled", j->unscheduled, getnum, priv);
+	VERBOSE("scheduled");
+	while ((b = scheduled_after(j, b)))
+		VERBOSE("%d [%u %5lu]", i++, getnum(b, priv), b->next_seqno);
+	VERBOSE("unscheduled");
+	for (i = 0; i < j->no_unscheduled; i++)
+		VERBOSE("%d [%u %5lu]", i, getnum(j->unscheduled[i], priv),
+				j->unscheduled[i]->next_seqno);
 }
 
-static void empty_list(blockio_info_t *head, void *(*append)(dllarr_t*, void*), dllarr_t *list) {
-	blockio_info_t *next;
+void juggler_free_and_empty_into(juggler_t *j, void *(*append)(dllarr_t*, void*), dllarr_t *list) {
+	blockio_info_t *b = NULL, *next;
+	uint32_t i;
+
+	settle(j);
 
-	while (head) {
-		next = head->next;
-		head->next = NULL;
-		if (append) append(list, head);
-		head = next;
+	for (b = scheduled_after(j, NULL); b; b = next) {
+		next = scheduled_after(j, b);
+		b->next = NULL;
+		if (append) append(list, b);
 	}
-}
 
-void juggler_free_and_empty_into(juggler_t *j, void *(*append)(dllarr_t*, void*), dllarr_t *list) {
-	empty_list(j->scheduled, append, list);
-	empty_list(j->unscheduled, append, list);
+	for (i = 0; i < j->no_unscheduled; i++)
+		if (append) append(list, j->unscheduled[i]);
+
+	free(j->unscheduled);
+	free(j->pending);
+	wheel_free(j);
+
+	if (j->digest_hd) gcry_md_close(j->digest_hd);
+	j->digest_hd = NULL;
+	memset(j->digest, 0, sizeof(j->digest));
 }
 
 void juggler_free(juggler_t *j) {
 	juggler_free_and_empty_into(j, NULL, NULL);
 }
-
@@ -24,14 +24,43 @@
 #include "gcry.h"
 #include "dllarr.h"
 
+#define JUGGLER_LEVELS 6
+
 /* the juggler keeps only information
  * that can be inferred by looking at the
  * contents of the disk, so that the juggler
  * can be easily be restarted without loss of
  * state (for example: between runs of scubed3 */
 typedef struct juggler_s {
-	blockio_info_t *scheduled, *unscheduled;
-	uint32_t no_scheduled, no_unscheduled;
+	/* unscheduled blocks, in no particular order, so that
+	 * a random one can be taken out in constant time */
+	blockio_info_t **unscheduled;
+	uint32_t no_unscheduled, unscheduled_size;
+
+	/* timing wheel with the scheduled blocks, the block that
+	 * reappears at next_seqno is in wheel[next_seqno%wheel_size]
+	 * if next_seqno - seqno <= wheel_size, blocks that reappear
+	 * later are in the list 'later' sorted by next_seqno */
+	blockio_info_t **wheel, *later;
+	uint32_t wheel_size, no_scheduled;
+
+	/* bitmap of the used slots in the wheel, and for level 1 and up
+	 * the number of used slots in each group of 64^level slots */
+	uint64_t *used;
+	uint32_t *count[JUGGLER_LEVELS], no_groups[JUGGLER_LEVELS], no_levels;
+
+	/* scheduled blocks that are added, they are sorted into
+	 * the wheel the next time the schedule is needed */
+	blockio_info_t **pending;
+	uint32_t no_pending, pending_size;
+	int dirty;
+
+	/* keyed digest of the schedule, the xor of a keyed hash of
+	 * seqno and next_seqno of every scheduled block, maintained
+	 * if a key is set with juggler_digest_init */
+	gcry_md_hd_t digest_hd;
+	char digest[32];
+
 	uint64_t seqno;
 	random_t *r;
 } juggler_t;
@@ -52,6 +81,10 @@ void juggler_verbose(juggler_t*, uint32_t (*getnum)(blockio_info_t*, void*), voi
 
 char *juggler_hash_scheduled_seqnos(juggler_t*, char*);
 
+void juggler_digest_init(juggler_t*, const void*, size_t);
+
+char *juggler_digest_scheduled(juggler_t*, char*);
+
 void juggler_free_and_empty_into(juggler_t*, void *(*append)(dllarr_t*, void*), dllarr_t*);
 
 void juggler_free(juggler_t*);
@@ -0,0 +1,351 @@
+/* libscubed3.c - use scubed3 partitions without FUSE
+ *
+ * Copyright (C) 2019  Rik Snel <rik@snel.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+#include "config.h"
+#include "libscubed3.h"
+#include "libscubed3_int.h"
+#include "scubed3.h"
+#include "blockio.h"
+#include "cipher.h"
+#include "hashtbl.h"
+#include "plmgr.h"
+#include "verbose.h"
+#include "util.h"
+#include "ecch.h"
+#include "gcry.h"
+
+struct libscubed3_base_s {
+	blockio_t b;
+	plmgr_thread_priv_t plmgr;
+	hashtbl_t ids;
+};
+
+struct libscubed3_part_s {
+	libscubed3_base_t *base;
+	uint64_t size;
+	cipher_t c;
+	blockio_dev_t d;
+	scubed3_t l;
+	struct {
+		hashtbl_elt_t head;
+		char id[32];
+	} unique_id;
+	int has_id;
+
+	/* held for reading by pread, pwrite, flush and trim, resize
+	 * reallocates what they use, so it must have it alone */
+	pthread_rwlock_t io;
+};
+
+static pthread_once_t global_once = PTHREAD_ONCE_INIT;
+
+static void global_init(void) {
+	static char name[] = "libscubed3";
+
+	/* the daemon has set its own name */
+	if (!exec_name) verbose_init(name);
+	ecch_global_init();
+	gcry_global_init();
+}
+
+static uint64_t part_size(blockio_dev_t *dev) {
+	if (dev->no_macroblocks <= dev->reserved_macroblocks) return 0;
+
+	return ((uint64_t)(dev->no_macroblocks - dev->reserved_macroblocks)<<
+			dev->b->mesoblk_log)*dev->b->mmpm;
+}
+
+void libscubed3_part_setup(blockio_t *b, cipher_t *c, const char *spec,
+		const void *key, size_t key_len, char *id) {
+	char buf[1<<b->mesoblk_log];
+
+	memset(buf, 0, 1<<b->mesoblk_log);
+
+	cipher_init(c, spec, 1<<(b->mesoblk_log - 4), key, key_len);
+
+	// encrypt zeroed buffer and hash the result
+	// the output of the hash is used to ID ciphermode + key
+	cipher_enc(c, buf, buf, 0, 0, 0);
+	gcry_md_hash_buffer(GCRY_MD_SHA256, id, buf, sizeof(buf));
+}
+
+uint64_t libscubed3_part_start(blockio_dev_t *dev, scubed3_t *l, int add) {
+	/* if we used 'create' we should not have found any blocks */
+	if (add && dev->no_macroblocks) {
+		ecch_throw(ECCH_DEFAULT, "unable to create device: "
+				"it already exists, use `open' instead");
+	}
+
+	/* if we used 'open' we expect to find at least one block */
+	if (!add & !dev->no_macroblocks)
+		ecch_throw(ECCH_DEFAULT, "no blocks found: passphrase wrong?");
+
+	scubed3_init(l, dev);
+
+	assert(!dev->bi);
+	if (part_size(dev) > 0) blockio_dev_select_next_macroblock(dev);
+
+	return part_size(dev);
+}
+
+uint64_t libscubed3_part_resize(blockio_dev_t *dev, scubed3_t *l,
+		uint32_t size, uint32_t reserved) {
+	if (reserved > size) ecch_throw(ECCH_DEFAULT,
+			"values for new_size=%u and reserved=%u make no sense",
+			size, reserved);
+
+	if (size < dev->no_macroblocks) ecch_throw(ECCH_DEFAULT,
+			"shrinking device is not yet supported");
+
+	if (size > dev->b->total_macroblocks) ecch_throw(ECCH_DEFAULT,
+			"not enough blocks available, base device "
+			"has only %d blocks", dev->b->total_macroblocks);
+
+	size -= dev->no_macroblocks;
+
+	if (size == 0) ecch_throw(ECCH_DEFAULT, "nothing to do");
+
+	VERBOSE("need to allocate %d additional blocks", size);
+	if (blockio_dev_allocate_macroblocks(dev, size))
+		ecch_throw(ECCH_DEFAULT, "not enough unclaimed "
+				"blocks available for resize");
+
+	dev->reserved_macroblocks = reserved;
+
+	scubed3_reinit(l);
+
+	if (!dev->bi) blockio_dev_select_next_macroblock(dev);
+
+	dev->updated = 1;
+
+	return part_size(dev);
+}
+
+void libscubed3_opts_default(libscubed3_opts_t *o) {
+	*o = (libscubed3_opts_t){
+		.engine = NULL,
+		.queue_depth = 32,
+		.macroblock_log = 22,
+		.mesoblock_log = 14,
+		.cache_size = 256,
+		.readahead = 64,
+		.threads = 4,
+		.pin = 0,
+		.hdrcache_size = 4096
+	};
+}
+
+libscubed3_base_t *libscubed3_base_open(const char *path,
+		const libscubed3_opts_t *o) {
+	libscubed3_base_t *base = ecalloc(1, sizeof(*base));
+	libscubed3_opts_t def;
+
+	pthread_once(&global_once, global_init);
+
+	if (!o) {
+		libscubed3_opts_default(&def);
+		o = &def;
+	}
+
+	blockio_init_file(&base->b, path, o->engine?o->engine:"pread",
+			o->queue_depth, o->macroblock_log, o->mesoblock_log);
+	base->b.cache_size = o->cache_size;
+	base->b.readahead = o->readahead;
+	blockio_hdrcache_init(&base->b, ((size_t)o->hdrcache_size)<<10);
+	workpool_init(&base->b.pool, o->threads, o->pin);
+
+	/* nobody listens, but full macroblocks are announced here;
+	 * the zeroed mutex and condition are statically initialized */
+	base->plmgr.b = &base->b;
+	base->b.plmgr = &base->plmgr;
+
+	hashtbl_init_default(&base->ids, 32, 4, 1, 1, NULL);
+
+	return base;
+}
+
+void libscubed3_base_close(libscubed3_base_t *base) {
+	hashtbl_free(&base->ids);
+	workpool_free(&base->b.pool);
+	blockio_free(&base->b);
+	free(base);
+}
+
+uint32_t libscubed3_base_macroblocks(libscubed3_base_t *base) {
+	return base->b.total_macroblocks;
+}
+
+blockio_t *libscubed3_base_blockio(libscubed3_base_t *base) {
+	return &base->b;
+}
+
+int libscubed3_open(libscubed3_base_t *base, const char *name,
+		const char *spec, const void *key, size_t key_len, int flags,
+		libscubed3_part_t **pp) {
+	libscubed3_part_t *p = ecalloc(1, sizeof(*p));
+	volatile int err = 0;
+	char copy[key_len];
+
+	p->base = base;
+	pthd_rwlock_init(&p->io);
+
+	/* cipher_init wipes the key, the caller keeps it */
+	memcpy(copy, key, key_len);
+
+	ecch_try {
+		libscubed3_part_setup(&base->b, &p->c, spec, copy, key_len,
+				p->unique_id.id);
+		p->unique_id.head.key = p->unique_id.id;
+		if (!hashtbl_add_element(&base->ids, &p->unique_id)) {
+			err = -EBUSY;
+			ecch_throw(ECCH_DEFAULT, "cipher(mode)/key "
+					"combination already in use");
+		}
+		hashtbl_unlock_element_byptr(&p->unique_id);
+		p->has_id = 1;
+
+		p->d.name = estrdup(name);
+		blockio_dev_init(&p->d, &base->b, &p->c, name);
+		err = (flags&LIBSCUBED3_CREATE)?-EEXIST:-ENOENT;
+		p->size = libscubed3_part_start(&p->d, &p->l,
+				flags&LIBSCUBED3_CREATE);
+		err = 0;
+	}
+	ecch_catch_all {
+		WARNING("unable to %s partition \"%s\": %s",
+				(flags&LIBSCUBED3_CREATE)?"create":"open",
+				name, ecch_context.ecch.msg);
+		if (!err) err = -EINVAL;
+	}
+	ecch_endtry;
+
+	if (err) {
+		libscubed3_close(p);
+		return err;
+	}
+
+	*pp = p;
+
+	return 0;
+}
+
+int libscubed3_resize(libscubed3_part_t *p, uint32_t size,
+		uint32_t reserved) {
+	volatile int err = 0;
+
+	if (pthread_rwlock_trywrlock(&p->io)) {
+		WARNING("unable to resize partition \"%s\": it is in use",
+				p->d.name);
+		return -EBUSY;
+	}
+
+	ecch_try {
+		p->size = libscubed3_part_resize(&p->d, &p->l,
+				size, reserved);
+	}
+	ecch_catch_all {
+		WARNING("unable to resize partition \"%s\": %s",
+				p->d.name, ecch_context.ecch.msg);
+		err = -EINVAL;
+	}
+	ecch_endtry;
+
+	pthd_rwlock_unlock(&p->io);
+
+	return err;
+}
+
+void libscubed3_close(libscubed3_part_t *p) {
+	if (p->l.dev) scubed3_free(&p->l);
+	if (p->d.b) blockio_dev_free(&p->d);
+	else free(p->d.name);
+	cipher_free(&p->c);
+	if (p->has_id) {
+		hashtbl_delete_element_byptr(&p->base->ids, &p->unique_id);
+		wipememory(p->unique_id.id, 32);
+	}
+	pthd_rwlock_destroy(&p->io);
+	free(p);
+}
+
+uint64_t libscubed3_size(libscubed3_part_t *p) {
+	return p->size;
+}
+
+ssize_t libscubed3_pread(libscubed3_part_t *p, void *buf, size_t size,
+		uint64_t offset) {
+	pthd_rwlock_rdlock(&p->io);
+	if (offset >= p->size) size = 0;
+	else if (size > p->size - offset) size = p->size - offset;
+	if (size) do_req(&p->l, SCUBED3_READ, offset, size, buf);
+	pthd_rwlock_unlock(&p->io);
+
+	return size;
+}
+
+ssize_t libscubed3_pwrite(libscubed3_part_t *p, const void *buf,
+		size_t size, uint64_t offset) {
+	ssize_t ret = size;
+
+	if (!size) return 0;
+
+	pthd_rwlock_rdlock(&p->io);
+	if (offset >= p->size) ret = -ENOSPC;
+	else {
+		if (size > p->size - offset) ret = size = p->size - offset;
+		/* do_req only reads buf for a write */
+		do_req(&p->l, SCUBED3_WRITE, offset, size, (char*)buf);
+	}
+	pthd_rwlock_unlock(&p->io);
+
+	return ret;
+}
+
+void libscubed3_flush(libscubed3_part_t *p) {
+	pthd_rwlock_rdlock(&p->io);
+	if (p->size) scubed3_flush(&p->l);
+	pthd_rwlock_unlock(&p->io);
+}
+
+int libscubed3_trim(libscubed3_part_t *p, uint64_t offset, uint64_t size) {
+	int ret = 0;
+
+	pthd_rwlock_rdlock(&p->io);
+	if (offset > p->size || size > p->size - offset) ret = -EINVAL;
+	else if (size) scubed3_trim(&p->l, offset, size);
+	pthd_rwlock_unlock(&p->io);
+
+	return ret;
+}
+
+void libscubed3_stats(libscubed3_part_t *p, libscubed3_stats_t *s) {
+	s->size = p->size;
+	s->no_macroblocks = p->d.no_macroblocks;
+	s->reserved_macroblocks = p->d.reserved_macroblocks;
+	s->writes = p->d.writes;
+	s->write_stalls = p->d.write_stalls;
+	s->cache_hits = p->d.cache.hits;
+	s->cache_misses = p->d.cache.misses;
+	s->readahead_issued = p->l.ra.issued;
+	s->readahead_hits = p->d.cache.prefetch_hits;
+	s->readahead_wasted = p->d.cache.prefetch_wasted;
+}
@@ -0,0 +1,98 @@
+/* libscubed3.h - use scubed3 partitions without FUSE
+ *
+ * Copyright (C) 2019  Rik Snel <rik@snel.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef INCLUDE_SCUBED3_LIBSCUBED3_H
+#define INCLUDE_SCUBED3_LIBSCUBED3_H 1
+
+#include <stdint.h>
+#include <sys/types.h>
+
+typedef struct libscubed3_base_s libscubed3_base_t;
+
+typedef struct libscubed3_part_s libscubed3_part_t;
+
+/* the defaults are those of the daemon */
+typedef struct libscubed3_opts_s {
+	const char *engine; /* I/O engine, NULL is "pread" */
+	uint32_t queue_depth;
+	uint8_t macroblock_log;
+	uint8_t mesoblock_log;
+	uint32_t cache_size; /* mesoblocks per partition */
+	uint32_t readahead; /* mesoblocks */
+	uint32_t threads; /* workers, 0 is inline */
+	int pin;
+	uint32_t hdrcache_size; /* KiB */
+} libscubed3_opts_t;
+
+typedef struct libscubed3_stats_s {
+	uint64_t size;
+	uint32_t no_macroblocks;
+	uint32_t reserved_macroblocks;
+	uint32_t writes;
+	uint32_t write_stalls;
+	uint64_t cache_hits, cache_misses;
+	uint64_t readahead_issued, readahead_hits, readahead_wasted;
+} libscubed3_stats_t;
+
+#define LIBSCUBED3_CREATE 1
+
+void libscubed3_opts_default(libscubed3_opts_t*);
+
+/* errors in the base file are fatal, like in the daemon; a base
+ * mem:BLOCKS is kept in memory and the engine "sparse" reads the
+ * holes of a sparse file as random data, both for benchmarks */
+libscubed3_base_t *libscubed3_base_open(const char*, const libscubed3_opts_t*);
+
+/* the partitions of the base must be closed first */
+void libscubed3_base_close(libscubed3_base_t*);
+
+uint32_t libscubed3_base_macroblocks(libscubed3_base_t*);
+
+/* the functions below return -errno on failure, the reason
+ * is reported with WARNING */
+
+/* base, name, cipher spec, key, key length, flags, result;
+ * the key is copied and the copy is wiped after use */
+int libscubed3_open(libscubed3_base_t*, const char*, const char*,
+		const void*, size_t, int, libscubed3_part_t**);
+
+/* a new partition has no blocks, it must be resized before use;
+ * fails with EBUSY if a pread, pwrite, flush or trim of the
+ * partition runs at the same time */
+int libscubed3_resize(libscubed3_part_t*, uint32_t, uint32_t);
+
+/* the current macroblock is written */
+void libscubed3_close(libscubed3_part_t*);
+
+uint64_t libscubed3_size(libscubed3_part_t*);
+
+/* like pread(2) and pwrite(2), the size of the partition
+ * is the end of file, writes past it fail with ENOSPC */
+ssize_t libscubed3_pread(libscubed3_part_t*, void*, size_t, uint64_t);
+
+ssize_t libscubed3_pwrite(libscubed3_part_t*, const void*, size_t, uint64_t);
+
+void libscubed3_flush(libscubed3_part_t*);
+
+/* only the mesoblocks that lie completely in the range are dropped,
+ * they read as zeroes, but they may come back if the partition is
+ * opened again before the macroblocks that hold them are reused */
+int libscubed3_trim(libscubed3_part_t*, uint64_t, uint64_t);
+
+void libscubed3_stats(libscubed3_part_t*, libscubed3_stats_t*);
+
+#endif /* INCLUDE_SCUBED3_LIBSCUBED3_H */
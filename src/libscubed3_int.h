@@ -0,0 +1,47 @@
+/* libscubed3_int.h - the parts of libscubed3 for the daemon
+ *
+ * Copyright (C) 2019  Rik Snel <rik@snel.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef INCLUDE_SCUBED3_LIBSCUBED3_INT_H
+#define INCLUDE_SCUBED3_LIBSCUBED3_INT_H 1
+
+#include <stdint.h>
+#include "libscubed3.h"
+
+/* unlike the functions in libscubed3.h, these throw ecch exceptions */
+
+struct blockio_s;
+struct blockio_dev_s;
+struct cipher_s;
+struct scubed3_s;
+
+struct blockio_s *libscubed3_base_blockio(libscubed3_base_t*);
+
+/* prepare the cipher and compute the 32 byte id of cipher(mode)+key,
+ * the key is wiped */
+void libscubed3_part_setup(struct blockio_s*, struct cipher_s*,
+		const char*, const void*, size_t, char*);
+
+/* the blocks of the device are found, check them and start,
+ * returns the size */
+uint64_t libscubed3_part_start(struct blockio_dev_s*, struct scubed3_s*,
+		int);
+
+/* new size and reserved in macroblocks, returns the size */
+uint64_t libscubed3_part_resize(struct blockio_dev_s*, struct scubed3_s*,
+		uint32_t, uint32_t);
+
+#endif /* INCLUDE_SCUBED3_LIBSCUBED3_INT_H */
@@ -0,0 +1,145 @@
+/* main.c - the scubed3 daemon
+ *
+ * Copyright (C) 2019  Rik Snel <rik@snel.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <fuse3/fuse_opt.h>
+#include "config.h"
+#include "verbose.h"
+#include "libscubed3_int.h"
+#include "fuse_io.h"
+#include "fuse_ll.h"
+#include "nbd.h"
+
+#define SCUBED3_OPT_KEY(a,b,c) { a, offsetof(struct options, b), c }
+
+int main(int argc, char **argv) {
+	struct options {
+		char *base;
+		char *engine;
+		uint32_t mesoblock_log;
+		uint32_t macroblock_log;
+		uint32_t cache_size;
+		uint32_t readahead;
+		uint32_t queue_depth;
+		uint32_t threads;
+		int pin;
+		uint32_t hdrcache_size;
+		int lowlevel;
+		char *nbd_path;
+		uint32_t nbd_port;
+	} options = {
+		.base = NULL,
+		.engine = NULL,
+		.mesoblock_log = 14,
+		.macroblock_log = 22,
+		.cache_size = 256,
+		.readahead = 64,
+		.queue_depth = 32,
+		.threads = 4,
+		.pin = 0,
+		.hdrcache_size = 4096,
+		.lowlevel = 0,
+		.nbd_path = NULL,
+		.nbd_port = 0
+	};
+	struct fuse_opt scubed3_opts[] = {
+		SCUBED3_OPT_KEY("-b %s", base, 0),
+		SCUBED3_OPT_KEY("-e %s", engine, 0),
+		SCUBED3_OPT_KEY("-m %u", mesoblock_log, 0),
+		SCUBED3_OPT_KEY("-M %u", macroblock_log, 0),
+		SCUBED3_OPT_KEY("-c %u", cache_size, 0),
+		SCUBED3_OPT_KEY("-R %u", readahead, 0),
+		SCUBED3_OPT_KEY("-Q %u", queue_depth, 0),
+		SCUBED3_OPT_KEY("-t %u", threads, 0),
+		SCUBED3_OPT_KEY("-p", pin, 1),
+		SCUBED3_OPT_KEY("-H %u", hdrcache_size, 0),
+		SCUBED3_OPT_KEY("-l", lowlevel, 1),
+		SCUBED3_OPT_KEY("-N %s", nbd_path, 0),
+		SCUBED3_OPT_KEY("-P %u", nbd_port, 0),
+		FUSE_OPT_END
+	};
+	int ret;
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	libscubed3_opts_t o;
+	libscubed3_base_t *base;
+	nbd_thread_priv_t nbd = { };
+
+	verbose_init(argv[0]);
+
+	VERBOSE("version %s Copyright (C) 2019, Rik Snel <rik@snel.it>",
+			PACKAGE_VERSION);
+
+	if (fuse_opt_parse(&args, &options, scubed3_opts, NULL) == -1)
+		FATAL("error parsing options");
+
+	if (!options.base) FATAL("argument -b FILE is required");
+
+	/* a mesoblock is at least BLOCKIO_ALIGN, for the direct engine,
+	 * and some are on the stack, a macroblock holds at least one
+	 * mesoblock besides the index */
+	if (options.mesoblock_log < 12 || options.mesoblock_log > 16)
+		FATAL("argument -m LOG must be between 12 and 16");
+	if (options.macroblock_log <= options.mesoblock_log ||
+			options.macroblock_log > 30)
+		FATAL("argument -M LOG must be larger than -m LOG and "
+				"at most 30");
+
+	if (options.nbd_port > 65535) FATAL("argument -P PORT is too large");
+	nbd.path = options.nbd_path;
+	nbd.port = options.nbd_port;
+
+	/* lock me into memory; don't leak info to swap, a memory
+	 * base is only locked where it is used */
+	if (mlockall(MCL_CURRENT|MCL_FUTURE|(strncmp(options.base,
+				BLOCKIO_MEM_PREFIX,
+				strlen(BLOCKIO_MEM_PREFIX))?0:MCL_ONFAULT))<0)
+		WARNING("failed locking process in RAM: %s",
+				strerror(errno));
+
+	o = (libscubed3_opts_t){
+		.engine = options.engine,
+		.queue_depth = options.queue_depth,
+		.macroblock_log = options.macroblock_log,
+		.mesoblock_log = options.mesoblock_log,
+		.cache_size = options.cache_size,
+		.readahead = options.readahead,
+		.threads = options.threads,
+		.pin = options.pin,
+		.hdrcache_size = options.hdrcache_size
+	};
+	base = libscubed3_base_open(options.base, &o);
+
+	if (options.lowlevel)
+		ret = fuse_ll_start(args.argc, args.argv,
+				libscubed3_base_blockio(base), &nbd);
+	else ret = fuse_io_start(args.argc, args.argv,
+			libscubed3_base_blockio(base), &nbd);
+
+	libscubed3_base_close(base);
+
+	free(options.base);
+	free(options.engine);
+	free(options.nbd_path);
+	fuse_opt_free_args(&args);
+
+	exit(ret);
+}
+
@@ -0,0 +1,768 @@
+/* nbd.c - export partitions with the NBD protocol
+ *
+ * Copyright (C) 2019  Rik Snel <rik@snel.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <assert.h>
+#include "verbose.h"
+#include "util.h"
+#include "pthd.h"
+#include "binio.h"
+#include "hashtbl.h"
+#include "scubed3.h"
+#include "fuse_io.h"
+#include "nbd.h"
+
+/* the fixed newstyle handshake of the NBD protocol, see
+ * https://github.com/NetworkBlockDevice/nbd/blob/master/doc/proto.md */
+#define NBD_MAGIC			0x4e42444d41474943ULL
+#define NBD_IHAVEOPT			0x49484156454f5054ULL
+#define NBD_REP_MAGIC			0x0003e889045565a9ULL
+#define NBD_REQUEST_MAGIC		0x25609513
+#define NBD_SIMPLE_REPLY_MAGIC		0x67446698
+#define NBD_STRUCTURED_REPLY_MAGIC	0x668e33ef
+
+/* handshake flags */
+#define NBD_FLAG_FIXED_NEWSTYLE		(1<<0)
+#define NBD_FLAG_NO_ZEROES		(1<<1)
+
+/* transmission flags */
+#define NBD_FLAG_HAS_FLAGS		(1<<0)
+#define NBD_FLAG_READ_ONLY		(1<<1)
+#define NBD_FLAG_SEND_FLUSH		(1<<2)
+#define NBD_FLAG_SEND_TRIM		(1<<5)
+
+#define NBD_OPT_EXPORT_NAME		1
+#define NBD_OPT_ABORT			2
+#define NBD_OPT_LIST			3
+#define NBD_OPT_INFO			6
+#define NBD_OPT_GO			7
+#define NBD_OPT_STRUCTURED_REPLY	8
+
+#define NBD_REP_ACK			1
+#define NBD_REP_SERVER			2
+#define NBD_REP_INFO			3
+#define NBD_REP_ERR_UNSUP		(1U<<31|1)
+#define NBD_REP_ERR_POLICY		(1U<<31|2)
+#define NBD_REP_ERR_INVALID		(1U<<31|3)
+#define NBD_REP_ERR_UNKNOWN		(1U<<31|6)
+
+#define NBD_INFO_EXPORT			0
+#define NBD_INFO_BLOCK_SIZE		3
+
+#define NBD_CMD_READ			0
+#define NBD_CMD_WRITE			1
+#define NBD_CMD_DISC			2
+#define NBD_CMD_FLUSH			3
+#define NBD_CMD_TRIM			4
+
+#define NBD_REPLY_FLAG_DONE		(1<<0)
+#define NBD_REPLY_TYPE_NONE		0
+#define NBD_REPLY_TYPE_OFFSET_DATA	1
+#define NBD_REPLY_TYPE_ERROR		(1<<15|1)
+
+/* the longest option we accept during the handshake */
+#define NBD_MAX_OPTION 4096
+
+typedef struct nbd_req_s {
+	uint16_t flags, type;
+	uint64_t handle, offset;
+	uint32_t length;
+	char *buf;
+	struct nbd_req_s *next;
+} nbd_req_t;
+
+typedef struct nbd_conn_s {
+	nbd_thread_priv_t *priv;
+	int s;
+	pthread_t thread;
+	int done;
+
+	fuse_io_entry_t *entry;
+	int structured;
+
+	/* replies of the workers are sent one at a time */
+	pthread_mutex_t send_mutex;
+
+	/* requests that wait for a worker */
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	nbd_req_t *head, **tail;
+	int stop;
+
+	/* requests that are queued or handled, and their buffers,
+	 * the connection thread waits on room if there are too many */
+	uint32_t in_flight;
+	size_t buffered;
+	pthread_cond_t room;
+	pthread_t workers[NBD_WORKERS];
+
+	struct nbd_conn_s *next;
+} nbd_conn_t;
+
+static int recv_all(int s, void *buf, size_t len) {
+	ssize_t n;
+
+	while (len) {
+		n = recv(s, buf, len, 0);
+		if (n == 0) return -1; /* the client went away */
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			ERROR("recv: %s", strerror(errno));
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* iov is modified */
+static int send_iov(int s, struct iovec *iov, int cnt) {
+	struct msghdr msg = {
+		.msg_iov = iov,
+		.msg_iovlen = cnt
+	};
+	ssize_t n;
+
+	while (msg.msg_iovlen) {
+		if ((n = sendmsg(s, &msg, MSG_NOSIGNAL)) < 0) {
+			if (errno == EINTR) continue;
+			ERROR("send: %s", strerror(errno));
+			return -1;
+		}
+
+		while (msg.msg_iovlen && n >= msg.msg_iov->iov_len) {
+			n -= msg.msg_iov->iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+
+		if (n) {
+			msg.msg_iov->iov_base += n;
+			msg.msg_iov->iov_len -= n;
+		}
+	}
+
+	return 0;
+}
+
+static int send_buf(int s, const void *buf, size_t len) {
+	struct iovec iov = {
+		.iov_base = (void*)buf,
+		.iov_len = len
+	};
+
+	return send_iov(s, &iov, 1);
+}
+
+static int opt_reply(nbd_conn_t *c, uint32_t option, uint32_t type,
+		const void *data, uint32_t len) {
+	char hdr[20];
+	struct iovec iov[2] = {
+		{ .iov_base = hdr, .iov_len = sizeof(hdr) },
+		{ .iov_base = (void*)data, .iov_len = len }
+	};
+
+	binio_write_uint64_be(hdr, NBD_REP_MAGIC);
+	binio_write_uint32_be(hdr + 8, option);
+	binio_write_uint32_be(hdr + 12, type);
+	binio_write_uint32_be(hdr + 16, len);
+
+	return send_iov(c->s, iov, 2);
+}
+
+static int opt_error(nbd_conn_t *c, uint32_t option, uint32_t type,
+		const char *msg) {
+	return opt_reply(c, option, type, msg, strlen(msg));
+}
+
+/* a partition that can't be written is exported readonly */
+static int open_export(nbd_conn_t *c, const char *name) {
+	int ret = fuse_io_entry_open(c->priv->h, name, O_RDWR, &c->entry);
+
+	if (ret == -EACCES) ret = fuse_io_entry_open(c->priv->h, name,
+			O_RDONLY, &c->entry);
+
+	return ret;
+}
+
+static uint16_t transmission_flags(nbd_conn_t *c) {
+	return NBD_FLAG_HAS_FLAGS|NBD_FLAG_SEND_FLUSH|NBD_FLAG_SEND_TRIM|
+		(c->entry->readonly?NBD_FLAG_READ_ONLY:0);
+}
+
+typedef struct names_s {
+	char **names;
+	uint32_t no_names;
+} names_t;
+
+static int add_name(names_t *n, fuse_io_entry_t *entry) {
+	n->names = erealloc(n->names, n->no_names + 1, sizeof(char*));
+	n->names[n->no_names++] = estrdup(entry->head.key);
+	return 0;
+}
+
+static int opt_list(nbd_conn_t *c) {
+	names_t n = { NULL, 0 };
+	uint32_t i, len;
+	int ret = 0;
+
+	/* the names are collected first, so that no partition stays
+	 * locked while we wait for the client */
+	hashtbl_ts_traverse(c->priv->h,
+			(int (*)(void*, hashtbl_elt_t*))add_name, &n);
+
+	for (i = 0; i < n.no_names; i++) {
+		char data[4 + strlen(n.names[i])];
+		len = strlen(n.names[i]);
+		binio_write_uint32_be(data, len);
+		memcpy(data + 4, n.names[i], len);
+		if (!ret) ret = opt_reply(c, NBD_OPT_LIST, NBD_REP_SERVER,
+				data, sizeof(data));
+		free(n.names[i]);
+	}
+	free(n.names);
+
+	if (ret) return ret;
+
+	return opt_reply(c, NBD_OPT_LIST, NBD_REP_ACK, NULL, 0);
+}
+
+/* returns 1 if the transmission phase starts, 0 if the handshake
+ * continues and -1 if the connection must be closed */
+static int opt_info_go(nbd_conn_t *c, uint32_t option, char *data,
+		uint32_t len) {
+	char info_export[12], info_block_size[14];
+	uint32_t name_len;
+	int ret;
+
+	if (len < 6 || (name_len = binio_read_uint32_be(data)) > len - 6 ||
+			len != 6 + name_len +
+			2*binio_read_uint16_be(data + 4 + name_len))
+		return opt_error(c, option, NBD_REP_ERR_INVALID,
+				"malformed request");
+
+	/* the information requests don't matter, we send what we have */
+	memmove(data, data + 4, name_len);
+	data[name_len] = '\0';
+
+	if ((ret = open_export(c, data))) return opt_error(c, option,
+			ret == -ENOENT?NBD_REP_ERR_UNKNOWN:NBD_REP_ERR_POLICY,
+			ret == -ENOENT?"partition not found":
+			"partition is in use");
+
+	binio_write_uint16_be(info_export, NBD_INFO_EXPORT);
+	binio_write_uint64_be(info_export + 2, c->entry->size);
+	binio_write_uint16_be(info_export + 10, transmission_flags(c));
+
+	binio_write_uint16_be(info_block_size, NBD_INFO_BLOCK_SIZE);
+	binio_write_uint32_be(info_block_size + 2, 1);
+	binio_write_uint32_be(info_block_size + 6,
+			1<<c->entry->d.b->mesoblk_log);
+	binio_write_uint32_be(info_block_size + 10, NBD_MAX_REQUEST);
+
+	if (opt_reply(c, option, NBD_REP_INFO, info_export,
+				sizeof(info_export)) ||
+			opt_reply(c, option, NBD_REP_INFO, info_block_size,
+				sizeof(info_block_size)) ||
+			opt_reply(c, option, NBD_REP_ACK, NULL, 0)) {
+		fuse_io_entry_release(c->priv->h, c->entry);
+		return -1;
+	}
+
+	if (option == NBD_OPT_GO) return 1;
+
+	fuse_io_entry_release(c->priv->h, c->entry);
+
+	return 0;
+}
+
+/* the old way to select an export, there is no way to report
+ * an error, other than closing the connection */
+static int opt_export_name(nbd_conn_t *c, char *name, int no_zeroes) {
+	char reply[10 + 124] = { };
+
+	if (open_export(c, name)) return -1;
+
+	binio_write_uint64_be(reply, c->entry->size);
+	binio_write_uint16_be(reply + 8, transmission_flags(c));
+
+	if (send_buf(c->s, reply, no_zeroes?10:sizeof(reply))) {
+		fuse_io_entry_release(c->priv->h, c->entry);
+		return -1;
+	}
+
+	return 1;
+}
+
+/* returns 0 if the export in c->entry is opened */
+static int negotiate(nbd_conn_t *c) {
+	char hdr[18], opt[16], *data;
+	uint32_t option, len;
+	int no_zeroes, ret;
+
+	binio_write_uint64_be(hdr, NBD_MAGIC);
+	binio_write_uint64_be(hdr + 8, NBD_IHAVEOPT);
+	binio_write_uint16_be(hdr + 16,
+			NBD_FLAG_FIXED_NEWSTYLE|NBD_FLAG_NO_ZEROES);
+	if (send_buf(c->s, hdr, sizeof(hdr)) || recv_all(c->s, hdr, 4))
+		return -1;
+	no_zeroes = binio_read_uint32_be(hdr)&NBD_FLAG_NO_ZEROES;
+
+	do {
+		if (recv_all(c->s, opt, sizeof(opt))) return -1;
+		option = binio_read_uint32_be(opt + 8);
+		len = binio_read_uint32_be(opt + 12);
+		if (binio_read_uint64_be(opt) != NBD_IHAVEOPT ||
+				len > NBD_MAX_OPTION) {
+			ERROR("nbd: bad option from client");
+			return -1;
+		}
+
+		data = ecalloc(1, len + 1);
+		if (recv_all(c->s, data, len)) {
+			free(data);
+			return -1;
+		}
+
+		switch (option) {
+			case NBD_OPT_EXPORT_NAME:
+				ret = opt_export_name(c, data, no_zeroes);
+				break;
+			case NBD_OPT_ABORT:
+				opt_reply(c, option, NBD_REP_ACK, NULL, 0);
+				ret = -1;
+				break;
+			case NBD_OPT_LIST:
+				ret = opt_list(c);
+				break;
+			case NBD_OPT_STRUCTURED_REPLY:
+				if (len) ret = opt_error(c, option,
+						NBD_REP_ERR_INVALID,
+						"unexpected data");
+				else {
+					c->structured = 1;
+					ret = opt_reply(c, option,
+							NBD_REP_ACK, NULL, 0);
+				}
+				break;
+			case NBD_OPT_INFO:
+			case NBD_OPT_GO:
+				ret = opt_info_go(c, option, data, len);
+				break;
+			default:
+				ret = opt_error(c, option, NBD_REP_ERR_UNSUP,
+						"option not supported");
+		}
+
+		free(data);
+	} while (!ret);
+
+	return ret == 1?0:-1;
+}
+
+static void reply(nbd_conn_t *c, nbd_req_t *r, uint32_t err) {
+	char hdr[28];
+	struct iovec iov[2] = {
+		{ .iov_base = hdr },
+		{ .iov_base = r->buf }
+	};
+
+	if (c->structured && r->type == NBD_CMD_READ) {
+		binio_write_uint32_be(hdr, NBD_STRUCTURED_REPLY_MAGIC);
+		binio_write_uint16_be(hdr + 4, NBD_REPLY_FLAG_DONE);
+		binio_write_uint64_be(hdr + 8, r->handle);
+		if (err) {
+			binio_write_uint16_be(hdr + 6, NBD_REPLY_TYPE_ERROR);
+			binio_write_uint32_be(hdr + 16, 6);
+			binio_write_uint32_be(hdr + 20, err);
+			binio_write_uint16_be(hdr + 24, 0);
+			iov[0].iov_len = 26;
+		} else if (!r->length) {
+			binio_write_uint16_be(hdr + 6, NBD_REPLY_TYPE_NONE);
+			binio_write_uint32_be(hdr + 16, 0);
+			iov[0].iov_len = 20;
+		} else {
+			binio_write_uint16_be(hdr + 6,
+					NBD_REPLY_TYPE_OFFSET_DATA);
+			binio_write_uint32_be(hdr + 16, 8 + r->length);
+			binio_write_uint64_be(hdr + 20, r->offset);
+			iov[0].iov_len = 28;
+			iov[1].iov_len = r->length;
+		}
+	} else {
+		binio_write_uint32_be(hdr, NBD_SIMPLE_REPLY_MAGIC);
+		binio_write_uint32_be(hdr + 4, err);
+		binio_write_uint64_be(hdr + 8, r->handle);
+		iov[0].iov_len = 16;
+		if (!err && r->type == NBD_CMD_READ) iov[1].iov_len = r->length;
+	}
+
+	/* if sending fails, the client is gone, and the connection
+	 * thread finds out when it receives the next request */
+	pthd_mutex_lock(&c->send_mutex);
+	send_iov(c->s, iov, 2);
+	pthd_mutex_unlock(&c->send_mutex);
+}
+
+static void handle(nbd_conn_t *c, nbd_req_t *r) {
+	scubed3_t *l = &c->entry->l;
+	uint32_t err = 0;
+
+	/* also without data, the commands we didn't advertise fail */
+	if (r->type != NBD_CMD_READ && r->type != NBD_CMD_WRITE &&
+			r->type != NBD_CMD_FLUSH && r->type != NBD_CMD_TRIM)
+		err = EINVAL;
+	else if (r->offset + r->length < r->offset ||
+			r->offset + r->length > c->entry->size)
+		err = r->type == NBD_CMD_WRITE?ENOSPC:EINVAL;
+	else if (c->entry->readonly && (r->type == NBD_CMD_WRITE ||
+				r->type == NBD_CMD_TRIM)) err = EPERM;
+	else if (r->length || r->type == NBD_CMD_FLUSH) switch (r->type) {
+		case NBD_CMD_READ:
+			do_req(l, SCUBED3_READ, r->offset, r->length, r->buf);
+			break;
+		case NBD_CMD_WRITE:
+			do_req(l, SCUBED3_WRITE, r->offset, r->length, r->buf);
+			break;
+		case NBD_CMD_FLUSH:
+			scubed3_flush(l);
+			break;
+		case NBD_CMD_TRIM:
+			scubed3_trim(l, r->offset, r->length);
+	}
+
+	reply(c, r, err);
+}
+
+static nbd_req_t *dequeue(nbd_conn_t *c) {
+	nbd_req_t *r;
+
+	pthd_mutex_lock(&c->mutex);
+	while (!c->head && !c->stop) pthd_cond_wait(&c->cond, &c->mutex);
+	if ((r = c->head) && !(c->head = r->next)) c->tail = &c->head;
+	pthd_mutex_unlock(&c->mutex);
+
+	return r;
+}
+
+/* the workers take the requests in order, so reads run in parallel,
+ * the writes are serialised by the partition anyway */
+static void *worker(void *arg) {
+	nbd_conn_t *c = arg;
+	nbd_req_t *r;
+
+	while ((r = dequeue(c))) {
+		handle(c, r);
+
+		pthd_mutex_lock(&c->mutex);
+		c->in_flight--;
+		if (r->buf) c->buffered -= r->length;
+		pthd_cond_signal(&c->room);
+		pthd_mutex_unlock(&c->mutex);
+
+		if (r->buf) {
+			wipememory(r->buf, r->length);
+			free(r->buf);
+		}
+		free(r);
+	}
+
+	return NULL;
+}
+
+/* wait until the workers have room for a request with a buffer
+ * of size bytes, without the limit a client can make us allocate
+ * NBD_MAX_REQUEST for every request it sends */
+static void reserve(nbd_conn_t *c, uint32_t size) {
+	pthd_mutex_lock(&c->mutex);
+	while (c->in_flight == NBD_MAX_IN_FLIGHT || (c->in_flight &&
+				c->buffered + size > NBD_MAX_BUFFERED))
+		pthd_cond_wait(&c->room, &c->mutex);
+	c->in_flight++;
+	c->buffered += size;
+	pthd_mutex_unlock(&c->mutex);
+}
+
+static void transmission(nbd_conn_t *c) {
+	char hdr[28];
+	nbd_req_t *r;
+	int i, no_workers, err;
+
+	/* fewer workers will do, without any we hang up */
+	c->tail = &c->head;
+	for (no_workers = 0; no_workers < NBD_WORKERS; no_workers++)
+		if ((err = pthread_create(&c->workers[no_workers], NULL,
+						worker, c))) {
+			ERROR("nbd: unable to create worker thread: %s",
+					strerror(err));
+			break;
+		}
+
+	while (no_workers && !recv_all(c->s, hdr, sizeof(hdr))) {
+		if (binio_read_uint32_be(hdr) != NBD_REQUEST_MAGIC) {
+			ERROR("nbd: bad request magic");
+			break;
+		}
+
+		r = ecalloc(1, sizeof(*r));
+		r->flags = binio_read_uint16_be(hdr + 4);
+		r->type = binio_read_uint16_be(hdr + 6);
+		r->handle = binio_read_uint64_be(hdr + 8);
+		r->offset = binio_read_uint64_be(hdr + 16);
+		r->length = binio_read_uint32_be(hdr + 24);
+
+		if (r->type == NBD_CMD_DISC) {
+			free(r);
+			break;
+		}
+
+		if (r->type == NBD_CMD_READ || r->type == NBD_CMD_WRITE) {
+			if (r->length > NBD_MAX_REQUEST) {
+				ERROR("nbd: request of %u bytes is too large",
+						r->length);
+				free(r);
+				break;
+			}
+			reserve(c, r->length);
+			r->buf = ecalloc(1, r->length);
+		} else reserve(c, 0);
+
+		if (r->type == NBD_CMD_WRITE &&
+				recv_all(c->s, r->buf, r->length)) {
+			free(r->buf);
+			free(r);
+			break;
+		}
+
+		pthd_mutex_lock(&c->mutex);
+		*c->tail = r;
+		c->tail = &r->next;
+		pthd_cond_signal(&c->cond);
+		pthd_mutex_unlock(&c->mutex);
+	}
+
+	/* the requests that are received are handled before we stop */
+	pthd_mutex_lock(&c->mutex);
+	c->stop = 1;
+	pthd_cond_broadcast(&c->cond);
+	pthd_mutex_unlock(&c->mutex);
+
+	for (i = 0; i < no_workers; i++) pthread_join(c->workers[i], NULL);
+}
+
+static void *conn_thread(void *arg) {
+	nbd_conn_t *c = arg;
+
+	if (!negotiate(c)) {
+		VERBOSE("nbd: exporting \"%s\"%s", c->entry->head.key,
+				c->structured?" with structured replies":"");
+		transmission(c);
+		VERBOSE("nbd: \"%s\" disconnected", c->entry->head.key);
+		fuse_io_entry_release(c->priv->h, c->entry);
+	}
+
+	__atomic_store_n(&c->done, 1, __ATOMIC_RELEASE);
+
+	return NULL;
+}
+
+static void conn_free(nbd_conn_t *c) {
+	pthread_join(c->thread, NULL);
+	close(c->s);
+	pthd_cond_destroy(&c->room);
+	pthd_cond_destroy(&c->cond);
+	pthd_mutex_destroy(&c->mutex);
+	pthd_mutex_destroy(&c->send_mutex);
+	free(c);
+}
+
+/* free the connections that have ended */
+static void reap(nbd_thread_priv_t *priv) {
+	nbd_conn_t **cp = &priv->conns, *c;
+
+	pthd_mutex_lock(&priv->conns_mutex);
+	while ((c = *cp)) {
+		if (__atomic_load_n(&c->done, __ATOMIC_ACQUIRE)) {
+			*cp = c->next;
+			conn_free(c);
+		} else cp = &c->next;
+	}
+	pthd_mutex_unlock(&priv->conns_mutex);
+}
+
+static void accept_conn(nbd_thread_priv_t *priv, int s, int tcp) {
+	nbd_conn_t *c;
+	int s2, one = 1, err;
+
+	if ((s2 = accept(s, NULL, NULL)) == -1) {
+		ERROR("nbd: accept: %s", strerror(errno));
+		return;
+	}
+
+	if (tcp && setsockopt(s2, IPPROTO_TCP, TCP_NODELAY, &one,
+				sizeof(one)) == -1)
+		WARNING("nbd: unable to set TCP_NODELAY: %s", strerror(errno));
+
+	reap(priv);
+
+	c = ecalloc(1, sizeof(*c));
+	c->priv = priv;
+	c->s = s2;
+	pthd_mutex_init(&c->send_mutex);
+	pthd_mutex_init(&c->mutex);
+	pthd_cond_init(&c->cond);
+	pthd_cond_init(&c->room);
+
+	pthd_mutex_lock(&priv->conns_mutex);
+	if ((err = pthread_create(&c->thread, NULL, conn_thread, c))) {
+		pthd_mutex_unlock(&priv->conns_mutex);
+		ERROR("nbd: unable to create connection thread: %s",
+				strerror(err));
+		close(s2);
+		pthd_cond_destroy(&c->room);
+		pthd_cond_destroy(&c->cond);
+		pthd_mutex_destroy(&c->mutex);
+		pthd_mutex_destroy(&c->send_mutex);
+		free(c);
+		return;
+	}
+	c->next = priv->conns;
+	priv->conns = c;
+	pthd_mutex_unlock(&priv->conns_mutex);
+}
+
+static int listen_unix(const char *path) {
+	struct sockaddr_un local = {
+		.sun_family = AF_UNIX
+	};
+	int s;
+
+	if (strlen(path) >= sizeof(local.sun_path))
+		FATAL("nbd socket path %s is too long", path);
+	strcpy(local.sun_path, path);
+
+	if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		FATAL("socket: %s", strerror(errno));
+
+	unlink(path);
+	if (bind(s, (struct sockaddr*)&local, sizeof(local)) == -1)
+		FATAL("bind()ing to %s: %s", path, strerror(errno));
+
+	if (chmod(path, S_IRUSR|S_IWUSR) == -1)
+		FATAL("chmod: %s", strerror(errno));
+
+	if (listen(s, 8) == -1) FATAL("listen: %s", strerror(errno));
+
+	VERBOSE("listening for NBD connections on %s", path);
+
+	return s;
+}
+
+/* only on localhost, the data is not encrypted on the wire */
+static int listen_tcp(uint16_t port) {
+	struct sockaddr_in local = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+	};
+	int s, one = 1;
+
+	if ((s = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+		FATAL("socket: %s", strerror(errno));
+
+	if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1)
+		FATAL("setsockopt: %s", strerror(errno));
+
+	if (bind(s, (struct sockaddr*)&local, sizeof(local)) == -1)
+		FATAL("bind()ing to port %u: %s", port, strerror(errno));
+
+	if (listen(s, 8) == -1) FATAL("listen: %s", strerror(errno));
+
+	VERBOSE("listening for NBD connections on 127.0.0.1:%u", port);
+
+	return s;
+}
+
+void nbd_thread_cancel_join_cleanup(pthread_t thread,
+		nbd_thread_priv_t *priv) {
+	nbd_conn_t *c;
+	int i;
+
+	pthread_cancel(thread);
+	pthread_join(thread, NULL);
+
+	/* the connections end when their sockets are shut down */
+	for (c = priv->conns; c; c = c->next) shutdown(c->s, SHUT_RDWR);
+	while ((c = priv->conns)) {
+		priv->conns = c->next;
+		conn_free(c);
+	}
+
+	for (i = 0; i < 2; i++) if (priv->s[i] != -1) close(priv->s[i]);
+	if (priv->path) unlink(priv->path);
+
+	pthd_mutex_destroy(&priv->conns_mutex);
+}
+
+void *nbd_thread(void *arg) {
+	nbd_thread_priv_t *priv = arg;
+	struct pollfd fds[2];
+	int i, n = 0;
+
+	assert(priv->h && (priv->path || priv->port));
+
+	priv->s[0] = priv->s[1] = -1;
+	pthd_mutex_init(&priv->conns_mutex);
+
+	if (priv->path) priv->s[n++] = listen_unix(priv->path);
+	if (priv->port) priv->s[n++] = listen_tcp(priv->port);
+
+	for (i = 0; i < n; i++) {
+		fds[i].fd = priv->s[i];
+		fds[i].events = POLLIN;
+	}
+
+	while (1) {
+		if (poll(fds, n, -1) == -1) {
+			if (errno == EINTR) continue;
+			FATAL("poll: %s", strerror(errno));
+		}
+
+		/* we are only cancelled while we wait in poll */
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		for (i = 0; i < n; i++) if (fds[i].revents&POLLIN)
+			accept_conn(priv, fds[i].fd,
+					priv->port && i == n - 1);
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+	}
+
+	pthread_exit(NULL);
+}
@@ -0,0 +1,53 @@
+/* nbd.h - export partitions with the NBD protocol
+ *
+ * Copyright (C) 2019  Rik Snel <rik@snel.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef INCLUDE_SCUBED3_NBD_H
+#define INCLUDE_SCUBED3_NBD_H 1
+
+#include <stdint.h>
+#include <pthread.h>
+#include "hashtbl.h"
+
+/* requests of a connection that are handled at the same time */
+#define NBD_WORKERS 8
+
+/* the largest request we accept */
+#define NBD_MAX_REQUEST (32<<20)
+
+/* a connection stops reading requests while this many are in flight
+ * or while their buffers hold this many bytes */
+#define NBD_MAX_IN_FLIGHT (2*NBD_WORKERS)
+#define NBD_MAX_BUFFERED (64<<20)
+
+struct nbd_conn_s;
+
+typedef struct nbd_thread_priv_s {
+	/* must be set before the thread starts */
+	hashtbl_t *h;
+	char *path; /* unix domain socket, or NULL */
+	uint16_t port; /* TCP port on localhost, or 0 */
+
+	int s[2]; /* listening sockets */
+	pthread_mutex_t conns_mutex;
+	struct nbd_conn_s *conns;
+} nbd_thread_priv_t;
+
+void *nbd_thread(void*);
+
+void nbd_thread_cancel_join_cleanup(pthread_t, nbd_thread_priv_t*);
+
+#endif /* INCLUDE_SCUBED3_NBD_H */
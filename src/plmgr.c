@@ -22,7 +22,6 @@
 #include "verbose.h"
 #include "util.h"
 #include "pthd.h"
-#include "fuse_io.h"
 #include "blockio.h"
 #include "ecch.h"
 #include "plmgr.h"
@@ -3,22 +3,74 @@
 #include<string.h>
 #include<assert.h>
 #include<errno.h>
+#include<sys/random.h>
 #include"verbose.h"
 #include"random.h"
+#include"binio.h"
 
 
+static void rekey(random_t *r, const void *key) {
+	char ctr[16] = { };
+
+	gcry_call(cipher_setkey, r->hd, key, 32);
+	gcry_call(cipher_setctr, r->hd, ctr, sizeof(ctr));
+	r->generated = 0;
+}
+
+/* the keystream is the encryption of zeroes, a deterministic
+ * generator takes its next key from its own keystream */
+static void refill(random_t *r) {
+	unsigned char key[32] = { };
+	ssize_t ret;
+
+	if (r->generated >= RANDOM_RESEED) {
+		if (r->deterministic) gcry_call(cipher_encrypt, r->hd,
+				key, sizeof(key), NULL, 0);
+		else if ((ret = getrandom(key, sizeof(key), 0)) != sizeof(key))
+			FATAL("getrandom: %s", ret < 0?strerror(errno):
+					"short read");
+		rekey(r, key);
+		memset(key, 0, sizeof(key));
+	}
+
+	memset(r->buf, 0, RANDOM_BUFFER);
+	gcry_call(cipher_encrypt, r->hd, r->buf, RANDOM_BUFFER, NULL, 0);
+	r->generated += RANDOM_BUFFER;
+	r->pos = 0;
+}
+
+static void init(random_t *r, int deterministic) {
+	gcry_call(cipher_open, &r->hd, GCRY_CIPHER_AES256,
+			GCRY_CIPHER_MODE_CTR, GCRY_CIPHER_SECURE);
+	r->deterministic = deterministic;
+	r->generated = RANDOM_RESEED;
+}
+
 void random_init(random_t *r) {
-	if (!(r->fp = fopen("/dev/urandom", "r")))
-		FATAL("opening /dev/urandom: %s", strerror(errno));
+	init(r, 0);
+	refill(r);
+}
+
+void random_init_seed(random_t *r, uint64_t seed) {
+	unsigned char key[32];
+	char buf[sizeof(uint64_t)];
+
+	init(r, 1);
+	binio_write_uint64_be(buf, seed);
+	gcry_md_hash_buffer(GCRY_MD_SHA256, key, buf, sizeof(buf));
+	rekey(r, key);
+	refill(r);
 }
 
 uint32_t random_uint32(random_t *r) {
 	uint32_t ret;
 
-	if (fread(&ret, sizeof(ret), 1, r->fp) != 1)
-                FATAL("reading from /dev/urandom: %s", strerror(errno));
+	if (r->pos + sizeof(ret) > RANDOM_BUFFER) refill(r);
+
+	memcpy(&ret, r->buf + r->pos, sizeof(ret));
+	r->pos += sizeof(ret);
 
-        return ret;
+	return ret;
 }
 
 // the idea of this function is as follows,
@@ -61,7 +113,6 @@ uint32_t random_custom(random_t *r, uint32_t count) {
 }
 
 void random_free(random_t *r) {
-	// we can't handle errors in cleanup functions
-	if (r->fp && fclose(r->fp) == EOF)
-		WARNING("closing /dev/urandom: %s", strerror(errno));
+	memset(r->buf, 0, RANDOM_BUFFER);
+	gcry_cipher_close(r->hd);
 }
@@ -1,4 +1,4 @@
-/* random.h - rng based on /dev/urandom (not cryptographically secure!)
+/* random.h - rng based on AES256 in counter mode, seeded by getrandom
  *
  * Copyright (C) 2009  Rik Snel <rik@snel.it>
  *
@@ -18,15 +18,28 @@
 #ifndef INCLUDE_SCUBED3_RANDOM_H
 #define INCLUDE_SCUBED3_RANDOM_H 1
 
-#include <stdio.h>
 #include <stdint.h>
+#include "gcry.h"
+
+/* keystream is generated this many bytes at a time */
+#define RANDOM_BUFFER 4096
+
+/* the key is replaced after this many bytes of keystream */
+#define RANDOM_RESEED (1<<20)
 
 typedef struct random_s {
-	FILE *fp;
+	gcry_cipher_hd_t hd;
+	unsigned char buf[RANDOM_BUFFER];
+	uint32_t pos; // bytes of buf that are used
+	uint32_t generated; // bytes generated with the current key
+	int deterministic;
 } random_t;
 
 void random_init(random_t*);
 
+/* the same seed gives the same numbers, for benchmarks and simulations */
+void random_init_seed(random_t*, uint64_t);
+
 uint32_t random_uint32(random_t*);
 
 uint32_t random_custom(random_t*, uint32_t);
@@ -0,0 +1,209 @@
+/* readahead.c - asynchronous readahead into the mesoblock cache
+ *
+ * Copyright (C) 2019  Rik Snel <rik@snel.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <assert.h>
+#include "verbose.h"
+#include "util.h"
+#include "pthd.h"
+#include "blockio.h"
+#include "readahead.h"
+
+static int req_cmp(const void *a, const void *b) {
+	const readahead_req_t *x = a, *y = b;
+
+	if (x->id != y->id) return (x->id < y->id)?-1:1;
+	if (x->no != y->no) return (x->no < y->no)?-1:1;
+	return 0;
+}
+
+/* read count mesoblocks in consecutive slots with one call,
+ * decrypt them and put them in the cache */
+static void read_run(readahead_t *ra, char *buf, readahead_req_t *r,
+		uint32_t count) {
+	blockio_t *b = ra->dev->b;
+	cipher_req_t reqs[count];
+	uint32_t i;
+
+	blockio_dev_wait_written(ra->dev, r->id);
+	b->read(ra->io, buf, (((off_t)r->id)<<b->macroblock_log) +
+			((r->no + 1)<<b->mesoblk_log), count<<b->mesoblk_log);
+
+	for (i = 0; i < count; i++) {
+		reqs[i].out = buf + (i<<b->mesoblk_log);
+		reqs[i].in = reqs[i].out;
+		reqs[i].iv0 = r->seqno;
+		reqs[i].iv1 = r->no + i + 1;
+		reqs[i].iv2 = r->id;
+	}
+	cipher_dec_batch(&ra->c, reqs, count);
+
+	for (i = 0; i < count; i++)
+		cache_put(&ra->dev->cache, buf + (i<<b->mesoblk_log),
+				r->id, r->no + i, r->seqno, 1);
+
+	wipememory(buf, count<<b->mesoblk_log);
+}
+
+static void *readahead_thread(void *arg) {
+	readahead_t *ra = arg;
+	blockio_t *b = ra->dev->b;
+	uint32_t len, i, count, issued = 0;
+	readahead_req_t *r;
+	char *buf = ecalloc_aligned(BLOCKIO_ALIGN, b->mmpm<<b->mesoblk_log);
+
+	pthd_mutex_lock(&ra->mutex);
+	while (1) {
+		ra->issued += issued;
+		issued = 0;
+
+		while (!ra->stop && !ra->queue_len)
+			pthd_cond_wait(&ra->cond, &ra->mutex);
+
+		if (ra->stop) break;
+
+		len = ra->queue_len;
+		memcpy(ra->work, ra->queue, len*sizeof(readahead_req_t));
+		ra->queue_len = 0;
+		pthd_mutex_unlock(&ra->mutex);
+
+		/* group the requests by macroblock, so that mesoblocks in
+		 * consecutive slots are read with one call */
+		qsort(ra->work, len, sizeof(readahead_req_t), req_cmp);
+
+		for (i = 0; i < len; i += count) {
+			r = &ra->work[i];
+			count = 1;
+
+			/* maybe a reader got there first */
+			if (cache_contains(&ra->dev->cache,
+						r->id, r->no, r->seqno))
+				continue;
+
+			while (i + count < len && r[count].id == r->id &&
+					r[count].no == r->no + count &&
+					r[count].seqno == r->seqno) count++;
+
+			read_run(ra, buf, r, count);
+			issued += count;
+		}
+
+		pthd_mutex_lock(&ra->mutex);
+	}
+	pthd_mutex_unlock(&ra->mutex);
+
+	free(buf);
+
+	return NULL;
+}
+
+void readahead_init(readahead_t *ra, blockio_dev_t *dev,
+		uint32_t max_window) {
+	int err;
+	assert(ra && dev && dev->b && dev->b->open);
+
+	if (!max_window) return;
+
+	/* prefetched mesoblocks must survive in the
+	 * cache until the reader gets there */
+	if (max_window > dev->cache.no_entries/2) {
+		max_window = dev->cache.no_entries/2;
+		if (max_window < READAHEAD_MIN_WINDOW) {
+			WARNING("mesoblock cache too small for readahead, "
+					"readahead disabled on \"%s\"",
+					dev->name);
+			return;
+		}
+		VERBOSE("readahead window limited to %u mesoblocks by the "
+				"size of the mesoblock cache", max_window);
+	}
+
+	ra->io = dev->b->open(dev->b->open_priv);
+	cipher_dup(&ra->c, dev->c);
+
+	ra->max_window = max_window;
+	ra->window = ra->next = ra->ahead = 0;
+	ra->wasted = ra->issued = 0;
+	ra->stop = 0;
+	ra->queue_len = 0;
+	ra->queue = ecalloc(2*max_window, sizeof(readahead_req_t));
+	ra->work = ecalloc(2*max_window, sizeof(readahead_req_t));
+	pthd_mutex_init(&ra->mutex);
+	pthd_cond_init(&ra->cond);
+	pthd_mutex_init(&ra->stream_mutex);
+
+	ra->dev = dev;
+
+	if ((err = pthread_create(&ra->thread, NULL, readahead_thread, ra)))
+		FATAL("unable to create readahead thread: %s",
+				strerror(err));
+}
+
+/* called with stream_mutex held */
+void readahead_queue(readahead_t *ra, uint32_t id, uint32_t no,
+		uint64_t seqno) {
+	assert(ra && ra->dev);
+
+	pthd_mutex_lock(&ra->mutex);
+	/* if the thread can't keep up, we just forget about it */
+	if (ra->queue_len < 2*ra->max_window) {
+		ra->queue[ra->queue_len].id = id;
+		ra->queue[ra->queue_len].no = no;
+		ra->queue[ra->queue_len].seqno = seqno;
+		ra->queue_len++;
+	}
+	pthd_mutex_unlock(&ra->mutex);
+}
+
+void readahead_kick(readahead_t *ra) {
+	assert(ra && ra->dev);
+
+	pthd_mutex_lock(&ra->mutex);
+	if (ra->queue_len) pthd_cond_signal(&ra->cond);
+	pthd_mutex_unlock(&ra->mutex);
+}
+
+void readahead_free(readahead_t *ra) {
+	assert(ra);
+
+	if (!ra->dev) return;
+
+	pthd_mutex_lock(&ra->mutex);
+	ra->stop = 1;
+	pthd_cond_signal(&ra->cond);
+	pthd_mutex_unlock(&ra->mutex);
+
+	pthread_join(ra->thread, NULL);
+
+	VERBOSE("readahead on \"%s\": %lu mesoblocks read, %lu used, "
+			"%lu wasted", ra->dev->name, ra->issued,
+			ra->dev->cache.prefetch_hits,
+			ra->dev->cache.prefetch_wasted);
+
+	ra->dev->b->close(ra->io);
+	cipher_free(&ra->c);
+	free(ra->queue);
+	free(ra->work);
+	pthd_cond_destroy(&ra->cond);
+	pthd_mutex_destroy(&ra->mutex);
+	pthd_mutex_destroy(&ra->stream_mutex);
+	ra->dev = NULL;
+}
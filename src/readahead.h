@@ -0,0 +1,70 @@
+/* readahead.h - asynchronous readahead into the mesoblock cache
+ *
+ * Copyright (C) 2019  Rik Snel <rik@snel.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef INCLUDE_SCUBED3_READAHEAD_H
+#define INCLUDE_SCUBED3_READAHEAD_H 1
+
+#include <stdint.h>
+#include <pthread.h>
+#include "cipher.h"
+
+/* smallest window, in mesoblocks */
+#define READAHEAD_MIN_WINDOW	4
+
+typedef struct readahead_req_s {
+	uint64_t seqno;
+	uint32_t id, no;
+} readahead_req_t;
+
+typedef struct readahead_s {
+	struct blockio_dev_s *dev;
+
+	/* the thread has its own cipher context and its own handle
+	 * on the base device, so it never waits for the reader */
+	cipher_t c;
+	void *io;
+	pthread_t thread;
+
+	/* protects the queue and stop */
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int stop;
+	uint32_t queue_len;
+	readahead_req_t *queue, *work;
+
+	/* state of the stream detector, protected by stream_mutex,
+	 * the readers of the partition run concurrently */
+	pthread_mutex_t stream_mutex;
+	uint32_t max_window, window;
+	uint32_t next; /* expected next mesoblock of a sequential stream */
+	uint32_t ahead; /* readahead has been queued up to here */
+	uint64_t wasted; /* prefetch_wasted of the cache at the last check */
+
+	/* stats */
+	uint64_t issued; /* mesoblocks read by the thread */
+} readahead_t;
+
+/* a max_window of 0 disables readahead */
+void readahead_init(readahead_t*, struct blockio_dev_s*, uint32_t);
+
+void readahead_queue(readahead_t*, uint32_t, uint32_t, uint64_t);
+
+void readahead_kick(readahead_t*);
+
+void readahead_free(readahead_t*);
+
+#endif /* INCLUDE_SCUBED3_READAHEAD_H */
@@ -31,7 +31,6 @@
 #include <sys/mman.h>
 #include <sys/user.h>
 #undef NDEBUG /* we need sanity checking */
-#include <fuse3/fuse_opt.h>
 
 #include <assert.h>
 #include "config.h"
@@ -43,7 +42,6 @@
 #include "util.h"
 #include "cipher.h"
 #include "hashtbl.h"
-#include "fuse_io.h"
 #include "plmgr.h"
 
 #define ID	(index>>l->mesobits)
@@ -54,6 +52,8 @@ void obsolete_mesoblk(scubed3_t *l, blockio_info_t *bi, uint32_t no) {
 	assert(bi->no_nonobsolete);
 	bi->no_nonobsolete--;
 
+	cache_invalidate(&l->dev->cache, id(bi), no);
+
 	/* if the whole block is obsolete, remove it from the active list */
 	if (!bi->no_nonobsolete) {
 		//WARNING("move from active list is not implemented");
@@ -73,8 +73,10 @@ static inline void update_block_indices(scubed3_t *l, uint32_t offset,
 
 static void add_blockref(scubed3_t *l, uint32_t offset) {
 	l->dev->bi->indices[l->dev->bi->no_indices] = offset;
+	blockio_dev_seq_write_begin(l->dev);
 	update_block_indices(l, offset, id(l->dev->bi),
 			l->dev->bi->no_indices);
+	blockio_dev_seq_write_end(l->dev);
 	l->dev->bi->no_indices++;
 }
 
@@ -90,21 +92,31 @@ void copy_old_block_to_current(scubed3_t *l) {
 			blockio_dev_get_macroblock_status(
 				l->dev->tail_macroblock) == USED) {
 		blockio_info_t *bi = l->dev->tail_macroblock;
+		uint32_t nos[bi->no_indices], offs[bi->no_indices], count = 0;
 
+		/* find the mesoblocks that are still in use */
 		for (k = 0; k < bi->no_indices; k++) {
 			if (bi->indices[k] >= l->no_block_indices) continue;
 
 			index = l->block_indices[bi->indices[k]];
 			if (index != 0xFFFFFFFF &&
 					&l->dev->b->blockio_infos[ID] == bi) {
-				blockio_dev_read_mesoblk(l->dev, mesoblk(l,
-						l->dev->bi->no_indices),
-						id(bi), k);
+				offs[count] = bi->indices[k];
+				nos[count++] = k;
+			}
+		}
 
-				add_blockref(l, bi->indices[k]);
+		if (!count) return;
 
-				obsolete_mesoblk(l, bi, k);
-			}
+		/* read them all at once in the next free slots */
+		blockio_dev_read_mesoblk_list(l->dev,
+				mesoblk(l, l->dev->bi->no_indices),
+				id(bi), nos, count);
+
+		for (k = 0; k < count; k++) {
+			add_blockref(l, offs[k]);
+
+			obsolete_mesoblk(l, bi, nos[k]);
 		}
 	}
 }
@@ -188,6 +200,7 @@ void initialize_output(scubed3_t *l) {
 }
 
 void scubed3_cycle(scubed3_t *l) {
+	pthd_mutex_lock(&l->mutex);
 	/* output ONE block, run GC if possible and useful */
 	if (l->output_initialized) { /* output is initialized */
 		//pre_emptive_gc(l);
@@ -202,22 +215,81 @@ void scubed3_cycle(scubed3_t *l) {
 		blockio_dev_select_next_macroblock(l->dev);
 		l->output_initialized = 0;
 	}
+	pthd_mutex_unlock(&l->mutex);
 }
 
-void *replay(blockio_info_t *bi, scubed3_t *l) {
-	uint32_t k, index;
+/* replays the blocks in order of seqno, but only the offsets
+ * in [start, end), so that the offset range can be divided over the
+ * workers; a block that loses its last mesoblock can be touched by
+ * more than one worker, so no_nonobsolete is decremented atomically
+ * and the block is marked empty afterwards */
+typedef struct replay_task_s {
+	scubed3_t *l;
+	blockio_info_t **bis;
+	uint32_t no_bis;
+	uint32_t start, end;
+} replay_task_t;
+
+static void replay(void *arg, uint32_t worker) {
+	replay_task_t *t = arg;
+	scubed3_t *l = t->l;
+	blockio_info_t *bi;
+	uint32_t i, k, index;
 
-	VERBOSE("replay at seqno=%ld (%d indices)", bi->seqno, bi->no_indices);
-	for (k = 0; k < bi->no_indices; k++) {
-		//VERBOSE("k=%u, bi->indices[k]=%u", k, bi->indices[k]);
-		if (bi->indices[k] >= l->no_block_indices) continue;
-		index = l->block_indices[bi->indices[k]];
-		assert(id(bi) != ID);
-		obsolete_mesoblk_byidx(l, index);
-		update_block_indices(l, bi->indices[k], id(bi), k);
+	for (i = 0; i < t->no_bis; i++) {
+		bi = t->bis[i];
+		for (k = 0; k < bi->no_indices; k++) {
+			if (bi->indices[k] < t->start ||
+					bi->indices[k] >= t->end) continue;
+			index = l->block_indices[bi->indices[k]];
+			assert(id(bi) != ID);
+			if (index != 0xFFFFFFFF) {
+				assert(l->dev->b->blockio_infos[ID].
+						no_nonobsolete);
+				__atomic_sub_fetch(&l->dev->b->blockio_infos[ID].
+						no_nonobsolete, 1,
+						__ATOMIC_RELAXED);
+			}
+			update_block_indices(l, bi->indices[k], id(bi), k);
+		}
+	}
+}
+
+static void replay_all(scubed3_t *l) {
+	blockio_dev_t *dev = l->dev;
+	workpool_t *pool = &dev->b->pool;
+	uint32_t no_bis = dllarr_count(&dev->replay), i;
+	uint32_t no_tasks = pool->no_threads?pool->no_threads:1, per_task;
+	blockio_info_t **bis = ecalloc(no_bis, sizeof(blockio_info_t*));
+	blockio_info_t *bi;
+	workpool_task_t tasks[no_tasks];
+	replay_task_t replays[no_tasks];
+
+	for (i = 0, bi = dllarr_first(&dev->replay); bi;
+			bi = dllarr_next(&dev->replay, bi)) bis[i++] = bi;
+
+	per_task = (l->no_block_indices + no_tasks - 1)/no_tasks;
+
+	for (i = 0; i < no_tasks; i++) {
+		replays[i].l = l;
+		replays[i].bis = bis;
+		replays[i].no_bis = no_bis;
+		replays[i].start = i*per_task;
+		replays[i].end = (i + 1)*per_task;
+		if (replays[i].end > l->no_block_indices)
+			replays[i].end = l->no_block_indices;
+		tasks[i].fn = replay;
+		tasks[i].arg = &replays[i];
 	}
 
-	return NULL;
+	/* the cache is still empty, nothing to invalidate */
+	workpool_submit(pool, tasks, no_tasks);
+	for (i = 0; i < no_tasks; i++) workpool_wait(pool, &tasks[i]);
+
+	for (i = 0; i < no_bis; i++)
+		if (!bis[i]->no_nonobsolete) bis[i]->no_indices = 0;
+
+	free(bis);
 }
 
 #if 0
@@ -237,7 +309,9 @@ void debug_stuff(scubed3_t *l) {
 void scubed3_free(scubed3_t *l) {
 	//VERBOSE("freeing scubed3 partition");
 	//if (l->output_initialized) pre_emptive_gc(l);
+	readahead_free(&l->ra);
 	free(l->block_indices);
+	pthd_mutex_destroy(&l->mutex);
 }
 
 void scubed3_reinit(scubed3_t *l) {
@@ -275,6 +349,8 @@ void scubed3_init(scubed3_t *l, blockio_dev_t *dev) {
 
 	l->dev = dev;
 
+	pthd_mutex_init(&l->mutex);
+
 	l->mesobits = (dev->b->macroblock_log - dev->b->mesoblk_log);
 	l->mesomask = 0xFFFFFFFF>>(32 - l->mesobits);
 
@@ -288,11 +364,13 @@ void scubed3_init(scubed3_t *l, blockio_dev_t *dev) {
 	for (i = 0; i < l->no_block_indices; i++)
 		l->block_indices[i] = 0xFFFFFFFF;
 
+	readahead_init(&l->ra, dev, dev->b->readahead);
+
 	if (!dev->no_macroblocks) return;
 
 	VERBOSE("%d block(s) to replay", dllarr_count(&dev->replay));
 
-	dllarr_iterate(&dev->replay, (dllarr_iterator_t)replay, l);
+	replay_all(l);
 
 	blockio_info_t *bi;
 
@@ -302,35 +380,43 @@ void scubed3_init(scubed3_t *l, blockio_dev_t *dev) {
 	}
 	
 	char hash[32];
-	juggler_hash_scheduled_seqnos(&dev->j, hash);
+	blockio_dev_seqnos_hash(dev, hash);
 	if (memcmp(hash, dev->seqnos_hash, 32)) 
 		WARNING("hash seqno's is wrong, "
 				"at least one block seems to be missing");
 }
 
-void blockio_dev_fake_mesoblk_part(blockio_dev_t *dev, void *addr,
-		uint32_t id, uint32_t no, uint32_t offset, uint32_t size) {
+void blockio_dev_fake_mesoblk_part(blockio_dev_t *dev, blockio_reader_t *r,
+		void *addr, uint32_t id, uint32_t no, uint64_t seqno,
+		uint32_t offset, uint32_t size) {
 	memset(addr, 0, size);
 }
 
 /* cow stand for 'copy on write' */
 void do_cow(scubed3_t *l, uint32_t index, uint32_t muoff,
 		uint32_t size, void *addr) {
-	void (*readorfake)(blockio_dev_t*, void*, uint32_t, uint32_t,
-			uint32_t, uint32_t) = blockio_dev_fake_mesoblk_part;
-
-	if (index != 0xFFFFFFFF) readorfake = blockio_dev_read_mesoblk_part;
+	void (*readorfake)(blockio_dev_t*, blockio_reader_t*, void*,
+			uint32_t, uint32_t, uint64_t, uint32_t, uint32_t) =
+		blockio_dev_fake_mesoblk_part;
+	uint64_t seqno = 0;
+
+	if (index != 0xFFFFFFFF) {
+		readorfake = blockio_dev_read_mesoblk_part;
+		seqno = l->dev->b->blockio_infos[ID].seqno;
+	}
 
 	/* read the parts of the  mesoblock we don't modify from disk
 	 * otherwise, set it to zero */
-	if (muoff) readorfake(l->dev, addr, ID, NO, 0, muoff);
+	if (muoff) readorfake(l->dev, NULL, addr, ID, NO, seqno, 0, muoff);
 	if (1<<l->dev->b->mesoblk_log > size + muoff)
-		readorfake(l->dev, addr + muoff + size, ID, NO, muoff + size,
+		readorfake(l->dev, NULL, addr + muoff + size, ID, NO, seqno,
+				muoff + size,
 				(1<<l->dev->b->mesoblk_log) - size - muoff);
 }
 
-int do_write(scubed3_t *l, uint32_t mesoff, uint32_t muoff, uint32_t size,
-		char *in) {
+/* called with the mutex held, fill puts the data in place */
+static void do_write(scubed3_t *l, uint32_t mesoff, uint32_t muoff,
+		uint32_t size, scubed3_fill_t fill, void *arg) {
 	uint32_t index = l->block_indices[mesoff];
 	assert(muoff + size <= 1<<l->dev->b->mesoblk_log);
 	void *addr;
@@ -372,7 +458,7 @@ int do_write(scubed3_t *l, uint32_t mesoff, uint32_t muoff, uint32_t size,
 	}
 
 	addr = mesoblk(l, (ID == id(l->dev->bi))?NO:l->dev->bi->no_indices);
-	memcpy(addr + muoff, in, size);
+	fill(addr + muoff, size, arg);
 
 	/* if not, the mesoblock is in RAM */
 	if (ID != id(l->dev->bi)) { /* we are on disk */
@@ -386,121 +472,400 @@ int do_write(scubed3_t *l, uint32_t mesoff, uint32_t muoff, uint32_t size,
 		/* add new reference */
 		add_blockref(l, mesoff);
 	}
+}
 
-	return 0;
+/* where a reader finds a mesoblock */
+typedef enum where_e {
+	UNWRITTEN,
+	IN_RAM, /* in the current macroblock, only stable under the mutex */
+	ON_DISK
+} where_t;
+
+/* look up a mesoblock without the mutex, the seqcount of the device
+ * makes sure that the index, the current block and the seqno are
+ * seen as the writer left them */
+static where_t locate(scubed3_t *l, uint32_t mesoff, uint32_t *indexp,
+		uint64_t *seqno) {
+	blockio_info_t *bi;
+	uint32_t seq, index;
+	where_t where;
+
+	do {
+		seq = blockio_dev_seq_read_begin(l->dev);
+		index = __atomic_load_n(&l->block_indices[mesoff],
+				__ATOMIC_RELAXED);
+		bi = __atomic_load_n(&l->dev->bi, __ATOMIC_RELAXED);
+		if (index == 0xFFFFFFFF) where = UNWRITTEN;
+		else if (bi && ID == id(bi)) where = IN_RAM;
+		else {
+			where = ON_DISK;
+			*seqno = __atomic_load_n(
+					&l->dev->b->blockio_infos[ID].seqno,
+					__ATOMIC_RELAXED);
+		}
+	} while (blockio_dev_seq_read_retry(l->dev, seq));
+
+	*indexp = index;
+
+	return where;
 }
 
-int do_read(scubed3_t *l, uint32_t mesoff, uint32_t muoff, uint32_t size,
-		char *out) {
-	uint32_t index = l->block_indices[mesoff];
-	/* three possibilities:
-	 * 1. the block is currently in RAM
-	 * 2. the block was never written, we return zeroes
-	 * 3. the block is on disk */
+/* a macroblock gets a new seqno when it is selected to be overwritten,
+ * if the seqno is unchanged after reading, we read the right data */
+static int still_there(scubed3_t *l, uint32_t index, uint64_t seqno) {
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&l->dev->b->blockio_infos[ID].seqno,
+			__ATOMIC_RELAXED) == seqno;
+}
 
+static void do_read_locked(scubed3_t *l, blockio_reader_t *r,
+		uint32_t mesoff, uint32_t muoff, uint32_t size, char *out) {
+	uint32_t index;
+
+	pthd_mutex_lock(&l->mutex);
+	index = l->block_indices[mesoff];
 	if (ID == id(l->dev->bi)) /* in RAM */
 		memcpy(out, mesoblk(l, NO) + muoff, size);
 	else if (index == 0xFFFFFFFF) /* never written */
 		memset(out, 0, size);
 	else /* we are on disk */
-		blockio_dev_read_mesoblk_part(l->dev,
-				out, ID, NO, muoff, size);
+		blockio_dev_read_mesoblk_part(l->dev, r, out, ID, NO,
+				l->dev->b->blockio_infos[ID].seqno,
+				muoff, size);
+	pthd_mutex_unlock(&l->mutex);
+}
+
+/* called without the mutex, concurrently with other readers
+ * and the writer */
+int do_read(scubed3_t *l, blockio_reader_t *r, uint32_t mesoff,
+		uint32_t muoff, uint32_t size, char *out) {
+	uint32_t index;
+	uint64_t seqno;
+	/* three possibilities:
+	 * 1. the block is currently in RAM
+	 * 2. the block was never written, we return zeroes
+	 * 3. the block is on disk, if it was selected to be
+	 *    overwritten while we read, we look again */
+
+	do switch (locate(l, mesoff, &index, &seqno)) {
+		case UNWRITTEN:
+			memset(out, 0, size);
+			return 0;
+		case IN_RAM:
+			do_read_locked(l, r, mesoff, muoff, size, out);
+			return 0;
+		case ON_DISK:
+			blockio_dev_read_mesoblk_part(l->dev, r,
+					out, ID, NO, seqno, muoff, size);
+	} while (!still_there(l, index, seqno));
+
 	return 0;
 }
 
-int do_req(scubed3_t *l, scubed3_io_t cmd, uint64_t r_offset, size_t size,
-		char *buf) {
-	assert(cmd == SCUBED3_READ || cmd == SCUBED3_WRITE);
-	uint32_t meso = r_offset>>l->dev->b->mesoblk_log;
-	uint32_t inmeso = r_offset%(1<<l->dev->b->mesoblk_log);
-	uint32_t ooff = 0, reqsz;
-	int (*action)(scubed3_t*, uint32_t, uint32_t, uint32_t, char*) =
-		(cmd == SCUBED3_WRITE)?do_write:do_read;
+/* the number of mesoblocks, starting at mesoff, that are stored in
+ * consecutive slots of the same macroblock on disk and are not in the
+ * cache; 0 means that the first mesoblock is not read from disk */
+static uint32_t disk_run(scubed3_t *l, uint32_t mesoff, uint32_t max,
+		uint32_t *indexp, uint64_t *seqno) {
+	uint32_t index, count = 0;
 
-	//VERBOSE("do_req: %s offset=%ld size=%ld on \"%s\"",
-	//		(cmd == SCUBED3_WRITE)?"write":"read",
-	//		r_offset, size, l->dev->name);
+	if (locate(l, mesoff, &index, seqno) != ON_DISK) return 0;
+
+	/* the indices after the first are read without the seqcount,
+	 * if they change to a new incarnation of the macroblock, its
+	 * seqno changes and the caller will notice */
+	while (count < max && NO + count < l->dev->b->mmpm &&
+			__atomic_load_n(&l->block_indices[mesoff + count],
+				__ATOMIC_RELAXED) == index + count &&
+			!cache_contains(&l->dev->cache, ID, NO + count, *seqno))
+		count++;
+
+	*indexp = index;
+
+	return count;
+}
+
+/* read whole mesoblocks, runs of mesoblocks that are adjacent on disk
+ * are read with one call and decrypted directly into the output buffer,
+ * returns the number of mesoblocks read */
+static uint32_t do_read_whole(scubed3_t *l, blockio_reader_t *r,
+		uint32_t mesoff, uint32_t max, char *out) {
+	uint32_t index, count;
+	uint64_t seqno;
+
+	do {
+		count = disk_run(l, mesoff, max, &index, &seqno);
+
+		if (count < 2) {
+			do_read(l, r, mesoff, 0,
+					1<<l->dev->b->mesoblk_log, out);
+			return 1;
+		}
+
+		blockio_dev_read_mesoblks(l->dev, r, out, ID, NO, seqno,
+				count);
+	} while (!still_there(l, index, seqno));
 
-	if ((r_offset + size - 1)>>l->dev->b->mesoblk_log >=
-			l->no_block_indices) {
-		WARNING("%s access past end of device \"%s\"", 
-				(cmd == SCUBED3_WRITE)?"write":"read",
-				l->dev->name);
-		return 1;
+	return count;
+}
+
+/* called after a read of mesoblocks meso up to end, if the read
+ * continues a sequential stream, make sure that the next window of
+ * mesoblocks is (being) read into the cache in the background */
+static void detect_stream(scubed3_t *l, uint32_t meso, uint32_t end) {
+	readahead_t *ra = &l->ra;
+	uint32_t index, target;
+	uint64_t wasted, seqno;
+
+	if (meso != ra->next) { /* random access, stop readahead */
+		ra->window = 0;
+		ra->next = ra->ahead = end;
+		return;
 	}
 
+	ra->next = end;
+	if (ra->ahead < end) ra->ahead = end;
+
+	/* enough is on its way */
+	if (ra->window && ra->ahead - end > ra->window/2) return;
+
+	/* if prefetched mesoblocks were evicted before they were
+	 * used, we are too far ahead */
+	wasted = l->dev->cache.prefetch_wasted;
+	if (!ra->window) ra->window = 2*(end - meso);
+	else if (wasted != ra->wasted) ra->window /= 2;
+	else ra->window *= 2;
+	ra->wasted = wasted;
+
+	if (ra->window < READAHEAD_MIN_WINDOW)
+		ra->window = READAHEAD_MIN_WINDOW;
+	if (ra->window > ra->max_window) ra->window = ra->max_window;
+
+	target = end + ra->window;
+	if (target > l->no_block_indices) target = l->no_block_indices;
+
+	/* if a block is selected to be overwritten after we looked, the
+	 * thread puts garbage in the cache under the old seqno, nobody
+	 * will use it: do_read checks the seqno after reading */
+	for (; ra->ahead < target; ra->ahead++) {
+		if (locate(l, ra->ahead, &index, &seqno) != ON_DISK) continue;
+		if (cache_contains(&l->dev->cache, ID, NO, seqno)) continue;
+		readahead_queue(ra, ID, NO, seqno);
+	}
+
+	readahead_kick(ra);
+}
+
+static void do_readahead(scubed3_t *l, uint32_t meso, uint32_t end) {
+	if (!l->ra.dev) return;
+
+	pthd_mutex_lock(&l->ra.stream_mutex);
+	detect_stream(l, meso, end);
+	pthd_mutex_unlock(&l->ra.stream_mutex);
+}
+
+static int do_range(scubed3_t *l, blockio_reader_t *r,
+		uint32_t meso, uint32_t inmeso, size_t size, char *buf) {
+	uint32_t ooff = 0, reqsz;
+
 	if (inmeso) {
 		if (inmeso + size <= 1<<l->dev->b->mesoblk_log) reqsz = size;
 		else reqsz = (1<<l->dev->b->mesoblk_log) - inmeso;
 
-		if (action(l, meso, inmeso, reqsz, buf + ooff)) return 0;
+		if (do_read(l, r, meso, inmeso, reqsz, buf + ooff)) return 0;
 		meso++;
 		size -= reqsz;
 		ooff += reqsz;
 	}
 
 	while (size >= 1<<l->dev->b->mesoblk_log) {
-		if (action(l, meso, 0, 1<<l->dev->b->mesoblk_log, buf + ooff))
-			return 0;
-		meso++;
-		size -= 1<<l->dev->b->mesoblk_log;
-		ooff += 1<<l->dev->b->mesoblk_log;
+		uint32_t count = do_read_whole(l, r, meso,
+				size>>l->dev->b->mesoblk_log, buf + ooff);
+		meso += count;
+		size -= count<<l->dev->b->mesoblk_log;
+		ooff += count<<l->dev->b->mesoblk_log;
 	}
 
-	if (size > 0 && action(l, meso, 0, size, buf + ooff)) return 0;
+	if (size > 0 && do_read(l, r, meso, 0, size, buf + ooff)) return 0;
 
 	return 1;
 }
 
-#define SCUBED3_OPT_KEY(a,b,c) { a, offsetof(struct options, b), c }
-
-int main(int argc, char **argv) {
-	struct options {
-		char *base;
-		uint8_t mesoblock_log;
-		uint8_t macroblock_log;
-	} options = {
-		.base = NULL,
-		.mesoblock_log = 14,
-		.macroblock_log = 22
-	};
-	struct fuse_opt scubed3_opts[] = {
-		SCUBED3_OPT_KEY("-b %s", base, 0),
-		SCUBED3_OPT_KEY("-m %d", mesoblock_log, 0),
-		SCUBED3_OPT_KEY("-M %d", macroblock_log, 0),
-		FUSE_OPT_END
-	};
-	int ret;
-	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
-	blockio_t b = { };
+static int past_end(scubed3_t *l, scubed3_io_t cmd, uint64_t r_offset,
+		size_t size) {
+	if ((r_offset + size - 1)>>l->dev->b->mesoblk_log <
+			l->no_block_indices) return 0;
+
+	WARNING("%s access past end of device \"%s\"",
+			(cmd == SCUBED3_WRITE)?"write":"read", l->dev->name);
+
+	return 1;
+}
+
+/* writes are serialised by the mutex, fill is called for consecutive
+ * pieces of the data, with the address in the macroblock where the
+ * piece goes, so the data can be put there without intermediate copy */
+int scubed3_write(scubed3_t *l, uint64_t r_offset, size_t size,
+		scubed3_fill_t fill, void *arg) {
+	uint32_t meso = r_offset>>l->dev->b->mesoblk_log;
+	uint32_t inmeso = r_offset%(1<<l->dev->b->mesoblk_log);
+	uint32_t reqsz;
+
+	if (past_end(l, SCUBED3_WRITE, r_offset, size)) return 1;
+
+	pthd_mutex_lock(&l->mutex);
+	while (size > 0) {
+		reqsz = (1<<l->dev->b->mesoblk_log) - inmeso;
+		if (reqsz > size) reqsz = size;
+		do_write(l, meso++, inmeso, reqsz, fill, arg);
+		inmeso = 0;
+		size -= reqsz;
+	}
+	pthd_mutex_unlock(&l->mutex);
+
+	return 1;
+}
+
+/* write the current macroblock, with whatever it holds, and wait
+ * until everything written is on stable storage, the next write
+ * goes to a new block */
+void scubed3_flush(scubed3_t *l) {
+	uint32_t id;
+
+	pthd_mutex_lock(&l->mutex);
+	if (l->dev->updated) {
+		id = blockio_get_macroblock_index(l->dev->bi);
+		blockio_dev_write_current_macroblock(l->dev);
+		blockio_dev_select_next_macroblock(l->dev);
+		l->output_initialized = 0;
+		blockio_dev_wait_written(l->dev, id);
+	}
+	blockio_dev_sync(l->dev);
+	pthd_mutex_unlock(&l->mutex);
+}
 
-	verbose_init(argv[0]);
+/* forget the mesoblocks that lie completely in the range, they read
+ * as zeroes and are not collected anymore; the ones in the current
+ * macroblock stay, they are in its index already, and the index of a
+ * macroblock on disk still has the ones it held, so they come back
+ * if the partition is opened again before the macroblock is reused */
+void scubed3_trim(scubed3_t *l, uint64_t r_offset, size_t size) {
+	uint32_t meso = (r_offset + (1<<l->dev->b->mesoblk_log) - 1)>>
+		l->dev->b->mesoblk_log;
+	uint32_t end = (r_offset + size)>>l->dev->b->mesoblk_log;
+	uint32_t index;
 
-	VERBOSE("version %s Copyright (C) 2019, Rik Snel <rik@snel.it>",
-			PACKAGE_VERSION);
+	if (past_end(l, SCUBED3_WRITE, r_offset, size)) return;
 
-	if (fuse_opt_parse(&args, &options, scubed3_opts, NULL) == -1)
-		FATAL("error parsing options");
+	pthd_mutex_lock(&l->mutex);
+	for (; meso < end; meso++) {
+		index = l->block_indices[meso];
+		if (index == 0xFFFFFFFF || ID == id(l->dev->bi)) continue;
 
-	if (!options.base) FATAL("argument -b FILE is required");
+		obsolete_mesoblk_byidx(l, index);
 
-	/* lock me into memory; don't leak info to swap */
-	if (mlockall(MCL_CURRENT|MCL_FUTURE)<0)
-		WARNING("failed locking process in RAM: %s",
-				strerror(errno));
+		blockio_dev_seq_write_begin(l->dev);
+		l->block_indices[meso] = 0xFFFFFFFF;
+		blockio_dev_seq_write_end(l->dev);
+	}
+	pthd_mutex_unlock(&l->mutex);
+}
 
-	gcry_global_init();
+/* a read that falls within one mesoblock, which is in RAM or in the
+ * cache, is done by calling fn on the data where it is, with the lock
+ * that keeps it there held; returns 0 if the caller must use do_req */
+typedef struct inplace_s {
+	scubed3_t *l;
+	uint32_t index;
+	uint64_t seqno;
+	scubed3_use_t fn;
+	void *arg;
+} inplace_t;
+
+static int inplace_use(const void *data, uint32_t len, void *arg) {
+	inplace_t *p = arg;
+
+	/* the cache may hold stale data under the old seqno
+	 * if the macroblock was selected after we looked */
+	if (!still_there(p->l, p->index, p->seqno)) return 0;
+	p->fn(data, len, p->arg);
+	return 1;
+}
 
-	blockio_init_file(&b, options.base,
-			options.macroblock_log, options.mesoblock_log);
+int scubed3_read_inplace(scubed3_t *l, uint64_t r_offset, size_t size,
+		scubed3_use_t fn, void *arg) {
+	uint32_t mesoff = r_offset>>l->dev->b->mesoblk_log;
+	uint32_t muoff = r_offset%(1<<l->dev->b->mesoblk_log);
+	uint32_t index;
+	uint64_t seqno;
+	int ret = 0;
+	inplace_t p;
+
+	if (!size || muoff + size > 1<<l->dev->b->mesoblk_log ||
+			mesoff >= l->no_block_indices) return 0;
+
+	switch (locate(l, mesoff, &index, &seqno)) {
+		case UNWRITTEN:
+			return 0;
+		case IN_RAM:
+			pthd_mutex_lock(&l->mutex);
+			index = l->block_indices[mesoff];
+			if (ID == id(l->dev->bi)) {
+				fn(mesoblk(l, NO) + muoff, size, arg);
+				ret = 1;
+			}
+			pthd_mutex_unlock(&l->mutex);
+			break;
+		case ON_DISK:
+			p = (inplace_t){ l, index, seqno, fn, arg };
+			ret = cache_use(&l->dev->cache, ID, NO, seqno,
+					muoff, size, inplace_use, &p);
+	}
 
-	ret = fuse_io_start(args.argc, args.argv, &b);
+	if (ret) do_readahead(l, mesoff,
+			(r_offset + size)>>l->dev->b->mesoblk_log);
+
+	return ret;
+}
 
-	blockio_free(&b);
+typedef struct copy_s {
+	const char *buf;
+	size_t done;
+} copy_t;
 
-	free(options.base);
-	fuse_opt_free_args(&args);
+static void copy_fill(void *dst, uint32_t len, void *arg) {
+	copy_t *c = arg;
 
-	exit(ret);
+	memcpy(dst, c->buf + c->done, len);
+	c->done += len;
 }
 
+/* reads take a reader context of the device and run in parallel
+ * with each other and with the writer */
+int do_req(scubed3_t *l, scubed3_io_t cmd, uint64_t r_offset, size_t size,
+		char *buf) {
+	assert(cmd == SCUBED3_READ || cmd == SCUBED3_WRITE);
+	uint32_t meso = r_offset>>l->dev->b->mesoblk_log;
+	uint32_t inmeso = r_offset%(1<<l->dev->b->mesoblk_log);
+	uint32_t end = (r_offset + size)>>l->dev->b->mesoblk_log;
+	blockio_reader_t *r;
+	copy_t copy = { buf, 0 };
+	int ret;
+
+	//VERBOSE("do_req: %s offset=%ld size=%ld on \"%s\"",
+	//		(cmd == SCUBED3_WRITE)?"write":"read",
+	//		r_offset, size, l->dev->name);
+
+	if (cmd == SCUBED3_WRITE)
+		return scubed3_write(l, r_offset, size, copy_fill, &copy);
+
+	if (past_end(l, cmd, r_offset, size)) return 1;
+
+	r = blockio_dev_get_reader(l->dev);
+	ret = do_range(l, r, meso, inmeso, size, buf);
+	blockio_dev_put_reader(l->dev, r);
+
+	if (ret) do_readahead(l, meso, end);
+
+	return ret;
+}
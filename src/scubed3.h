@@ -19,6 +19,8 @@
 #define INCLUDE_SCUBED3_H 1
 
 #include <stdint.h>
+#include <pthread.h>
+#include "readahead.h"
 
 typedef enum scubed3_io_e {
 	SCUBED3_READ,
@@ -29,6 +31,10 @@ typedef struct scubed3_s {
 	/* must be set from init */
 	struct blockio_dev_s *dev;
 
+	/* serialises the writers of the partition, readers only take it
+	 * to read from the current macroblock */
+	pthread_mutex_t mutex;
+
 	int output_initialized;
 
 	/* some constants for accessor functions */
@@ -44,10 +50,27 @@ typedef struct scubed3_s {
 	uint32_t *block_indices;
 
 	int cycle_goal; /* false = gc, true = make UNUSED */
+
+	/* sequential stream detection and prefetching */
+	readahead_t ra;
 } scubed3_t;
 
 int do_req(scubed3_t*, scubed3_io_t, uint64_t, size_t, char*);
 
+/* puts len bytes of the data to be written at dst */
+typedef void (*scubed3_fill_t)(void *dst, uint32_t len, void *arg);
+
+int scubed3_write(scubed3_t*, uint64_t, size_t, scubed3_fill_t, void*);
+
+/* gets len bytes of the data that is read at data */
+typedef void (*scubed3_use_t)(const void *data, size_t len, void *arg);
+
+int scubed3_read_inplace(scubed3_t*, uint64_t, size_t, scubed3_use_t, void*);
+
+void scubed3_flush(scubed3_t*);
+
+void scubed3_trim(scubed3_t*, uint64_t, size_t);
+
 struct blockio_dev_s;
 
 void scubed3_init(scubed3_t*, struct blockio_dev_s*);
@@ -214,7 +214,7 @@ typedef struct ctl_priv_s {
 typedef struct ctl_command_s {
 	hashtbl_elt_t head;
 	int (*command)(ctl_priv_t*, char**);
-	int argc;
+	int argc; /* if negative: one or more arguments */
 	char *usage;
 } ctl_command_t;
 
@@ -259,12 +259,14 @@ int do_local_command(ctl_priv_t *priv,
 	}
 
 	if (*argv[0] == '\0' && argc > 0) argc--;
-	if (argc != cmnd->argc ) {
+	if ((cmnd->argc >= 0 && argc != cmnd->argc) ||
+			(cmnd->argc < 0 && !argc)) {
 		printf("usage: %s%s\n", cmnd->head.key, cmnd->usage);
 		free(args);
 		return 0;
 	}
 
+	argv[argc] = NULL;
 	ret = (*cmnd->command)(priv, argv);
 	free(args);
 	return ret;
@@ -292,17 +294,16 @@ int my_getpass(char **lineptr, size_t *n, FILE *stream) {
 	return 0;
 }
 
-static int ctl_open_create_common(ctl_priv_t *priv, char *argv[], int create) {
+/* ask the passphrase for partition name and derive the key, the key
+ * is written in base16 to hash_text; returns 1 if the user did
+ * not verify the passphrase correctly */
+static int ctl_derive_key(char *hash_text, const char *name, int create) {
 	uint8_t hash[32];
 	char *pw = NULL, *pw2 = NULL;
 	size_t pw_len, pw2_len;
-	int i, ret;
+	int i;
 	int algo, subalgo;
 
-	if (do_server_command(priv->s, 1, "check-available %s", argv[0]))
-		return -1;
-	if (result.status == -1) return 0;
-
 	if (!strcmp(DEFAULT_KDF_FUNCTION, "PBKDF2"))
 		algo = GCRY_KDF_PBKDF2;
 	else {
@@ -314,7 +315,8 @@ static int ctl_open_create_common(ctl_priv_t *priv, char *argv[], int create) {
 	subalgo = gcry_md_map_name(DEFAULT_KDF_HASH);
 	assert(subalgo);
 
-	printf("Enter passphrase: ");
+	if (name) printf("Enter passphrase for %s: ", name);
+	else printf("Enter passphrase: ");
 	if (my_getpass(&pw, &pw_len, stdin) == -1) {
 		ERROR("unable to get password");
 		return -1;
@@ -334,7 +336,7 @@ static int ctl_open_create_common(ctl_priv_t *priv, char *argv[], int create) {
 			free(pw2);
 			printf("passphrases do not match\n");
 			exit_status = EXIT_FAILURE;
-			return 0;
+			return 1;
 		}
 
 		wipememory(pw2, pw2_len);
@@ -363,7 +365,7 @@ static int ctl_open_create_common(ctl_priv_t *priv, char *argv[], int create) {
 	wipememory(pw, pw_len);
 	free(pw);
 
-	char hash_text[64], *ptr = hash_text;
+	char *ptr = hash_text;
 
 	for (i = 0; i < gcry_md_get_algo_dlen(subalgo); i++)
 		ptr += snprintf(ptr, 3, "%02x", hash[i]);
@@ -372,10 +374,24 @@ static int ctl_open_create_common(ctl_priv_t *priv, char *argv[], int create) {
 	wipememory(hash, (int)sizeof(hash));
 	//gcry_md_close(hd);
 
+	return 0;
+}
+
+static int ctl_open_create_common(ctl_priv_t *priv, char *argv[], int create) {
+	char hash_text[65];
+	int ret;
+
+	if (do_server_command(priv->s, 1, "check-available %s", argv[0]))
+		return -1;
+	if (result.status == -1) return 0;
+
+	if ((ret = ctl_derive_key(hash_text, NULL, create)))
+		return ret == 1?0:ret;
+
 	// WARNING: sizeof(hash_text) must be cast to int... see below
 	ret = do_server_command(priv->s, 1, "%s-internal %s %s %.*s",
 			create?"create":"open", argv[0],
-			DEFAULT_CIPHER_STRING, (int)sizeof(hash_text),
+			DEFAULT_CIPHER_STRING, (int)sizeof(hash_text) - 1,
 			hash_text);
 
 	// HERE BE DRAGONS! if sizeof(hash_text) is NOT cast to int, then
@@ -386,6 +402,49 @@ static int ctl_open_create_common(ctl_priv_t *priv, char *argv[], int create) {
 	return ret;
 }
 
+/* ask all passphrases first, so that scubed3 needs
+ * to scan the base device only once */
+static int ctl_open_many(ctl_priv_t *priv, char *argv[]) {
+	char *command = NULL, *tmp;
+	char hash_text[65];
+	int i, ret = 0;
+
+	for (i = 0; argv[i]; i++) {
+		if (do_server_command(priv->s, 1, "check-available %s",
+					argv[i])) return -1;
+		if (result.status == -1) return 0;
+	}
+
+	for (i = 0; argv[i]; i++) {
+		if ((ret = ctl_derive_key(hash_text, argv[i], 0))) break;
+
+		if (asprintf(&tmp, "%s %s %s %s", command?command:"",
+					argv[i], DEFAULT_CIPHER_STRING,
+					hash_text) == -1) {
+			ERROR("asprintf: %s", strerror(errno));
+			ret = -1;
+			break;
+		}
+
+		wipememory(hash_text, (int)sizeof(hash_text));
+		if (command) {
+			wipememory(command, (int)strlen(command));
+			free(command);
+		}
+		command = tmp;
+	}
+
+	if (!ret) ret = do_server_command(priv->s, 1,
+			"open-many-internal%s", command);
+
+	if (command) {
+		wipememory(command, (int)strlen(command));
+		free(command);
+	}
+
+	return ret;
+}
+
 static int ctl_open(ctl_priv_t *priv, char *argv[]) {
 	return ctl_open_create_common(priv, argv, 0);
 }
@@ -394,6 +453,7 @@ static int ctl_help(ctl_priv_t *priv, char *argv[]) {
 	printf("Internal commands:\n\n");
 	printf("create NAME\n");
 	printf("open NAME\n");
+	printf("open-many NAME...\n");
 	printf("close NAME\n");
 	printf("mount NAME MOUNTPOINT\n");
 	printf("umount NAME\n");
@@ -656,6 +716,11 @@ static ctl_command_t ctl_commands[] = {
 		.command = ctl_open,
 		.argc = 1,
 		.usage = " NAME"
+	}, {
+		.head.key = "open-many",
+		.command = ctl_open_many,
+		.argc = -1,
+		.usage = " NAME..."
 	}, {
 		.head.key = "resize",
 		.command = ctl_resize,
@@ -829,7 +894,7 @@ int main(int argc, char **argv) {
 
 	if (do_server_command(priv.s, 0, "static-info")) FATAL("unable to "
 			"request mountpoint");
-	if (result.argc != 3 || result.status == -1)
+	if (result.argc < 3 || result.status == -1)
 		FATAL("unexpected reply from server");
 
 	priv.mountpoint = strdup(result.argv[0]);
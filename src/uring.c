@@ -0,0 +1,274 @@
+/* uring.c - io_uring I/O engine for blockio
+ *
+ * Copyright (C) 2019  Rik Snel <rik@snel.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <assert.h>
+#include "verbose.h"
+#include "util.h"
+#include "ecch.h"
+#include "pthd.h"
+#include "uring.h"
+
+/* we talk to the kernel directly, the rings are shared memory:
+ * we produce at the tail of the submission queue and consume at
+ * the head of the completion queue */
+
+typedef struct uring_priv_s {
+	int fd; /* the base device */
+	int ring_fd;
+	uint32_t entries;
+
+	/* a ring can only be used by one thread at a time */
+	pthread_mutex_t mutex;
+
+	void *sq_ptr, *cq_ptr;
+	size_t sq_size, cq_size;
+	uint32_t *sq_head, *sq_tail, *sq_mask, *sq_array;
+	uint32_t *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+} uring_priv_t;
+
+static int setup(uint32_t entries, struct io_uring_params *p) {
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int enter(int ring_fd, uint32_t to_submit, uint32_t min_complete) {
+	return syscall(__NR_io_uring_enter, ring_fd, to_submit,
+			min_complete, IORING_ENTER_GETEVENTS, NULL, 0);
+}
+
+static int register_probe(int ring_fd, struct io_uring_probe *probe,
+		uint32_t no_ops) {
+	return syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE,
+			probe, no_ops);
+}
+
+/* IORING_OP_READ and IORING_OP_WRITE are newer than io_uring itself,
+ * they came with the probe (5.6), if it fails they are missing too */
+int uring_available(void) {
+	struct io_uring_params p = { };
+	size_t size = sizeof(struct io_uring_probe) +
+		256*sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe;
+	int ring_fd, ok = 0;
+
+	if ((ring_fd = setup(1, &p)) < 0) {
+		VERBOSE("io_uring not available: %s", strerror(errno));
+		return 0;
+	}
+
+	probe = ecalloc(1, size);
+	if (register_probe(ring_fd, probe, 256) < 0)
+		VERBOSE("io_uring can't be probed: %s", strerror(errno));
+	else if (probe->last_op < IORING_OP_WRITE ||
+			!(probe->ops[IORING_OP_READ].flags&
+				IO_URING_OP_SUPPORTED) ||
+			!(probe->ops[IORING_OP_WRITE].flags&
+				IO_URING_OP_SUPPORTED))
+		VERBOSE("io_uring doesn't support IORING_OP_READ/WRITE");
+	else ok = 1;
+
+	free(probe);
+	close(ring_fd);
+
+	return ok;
+}
+
+void *uring_open(const blockio_file_t *f) {
+	struct io_uring_params p = { };
+	uring_priv_t *u = ecalloc(1, sizeof(uring_priv_t));
+	assert(f && f->queue_depth);
+
+	if ((u->fd = open(f->path, O_RDWR)) < 0) {
+		free(u);
+		ecch_throw(ECCH_DEFAULT, "opening %s: %s",
+				f->path, strerror(errno));
+	}
+
+	if ((u->ring_fd = setup(f->queue_depth, &p)) < 0)
+		FATAL("unable to setup io_uring: %s", strerror(errno));
+
+	/* the kernel may round up */
+	u->entries = p.sq_entries;
+
+	u->sq_size = p.sq_off.array + p.sq_entries*sizeof(uint32_t);
+	u->cq_size = p.cq_off.cqes +
+		p.cq_entries*sizeof(struct io_uring_cqe);
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_size > u->sq_size) u->sq_size = u->cq_size;
+		u->cq_size = u->sq_size;
+	}
+
+	u->sq_ptr = mmap(NULL, u->sq_size, PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_POPULATE, u->ring_fd, IORING_OFF_SQ_RING);
+	if (u->sq_ptr == MAP_FAILED)
+		FATAL("unable to map io_uring sq ring: %s", strerror(errno));
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) u->cq_ptr = u->sq_ptr;
+	else {
+		u->cq_ptr = mmap(NULL, u->cq_size, PROT_READ|PROT_WRITE,
+				MAP_SHARED|MAP_POPULATE, u->ring_fd,
+				IORING_OFF_CQ_RING);
+		if (u->cq_ptr == MAP_FAILED)
+			FATAL("unable to map io_uring cq ring: %s",
+					strerror(errno));
+	}
+
+	u->sqes = mmap(NULL, p.sq_entries*sizeof(struct io_uring_sqe),
+			PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+			u->ring_fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED)
+		FATAL("unable to map io_uring sqes: %s", strerror(errno));
+
+	u->sq_head = u->sq_ptr + p.sq_off.head;
+	u->sq_tail = u->sq_ptr + p.sq_off.tail;
+	u->sq_mask = u->sq_ptr + p.sq_off.ring_mask;
+	u->sq_array = u->sq_ptr + p.sq_off.array;
+	u->cq_head = u->cq_ptr + p.cq_off.head;
+	u->cq_tail = u->cq_ptr + p.cq_off.tail;
+	u->cq_mask = u->cq_ptr + p.cq_off.ring_mask;
+	u->cqes = u->cq_ptr + p.cq_off.cqes;
+
+	pthd_mutex_init(&u->mutex);
+
+	return u;
+}
+
+static void prep(uring_priv_t *u, int opcode, blockio_req_t *r,
+		uint32_t done, uint32_t i) {
+	uint32_t tail = *u->sq_tail, index = tail&*u->sq_mask;
+	struct io_uring_sqe *sqe = &u->sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = u->fd;
+	sqe->addr = (uintptr_t)r->buf + done;
+	sqe->len = r->size - done;
+	sqe->off = r->offset + done;
+	sqe->user_data = i;
+
+	u->sq_array[index] = index;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* keep up to entries requests in flight until all are done, short
+ * transfers are resubmitted for the remainder */
+static void batch(uring_priv_t *u, blockio_req_t *reqs, uint32_t n,
+		int opcode, const char *rwing) {
+	uint32_t done[n], retry[n], no_retry = 0, next = 0, inflight = 0;
+	uint32_t left = n, head, i;
+	struct io_uring_cqe *cqe;
+	int ret;
+	assert(u && reqs);
+
+	memset(done, 0, sizeof(done));
+
+	pthd_mutex_lock(&u->mutex);
+
+	while (left) {
+		while (inflight < u->entries && (no_retry || next < n)) {
+			i = no_retry?retry[--no_retry]:next++;
+			prep(u, opcode, &reqs[i], done[i], i);
+			inflight++;
+		}
+
+		/* submit what the kernel hasn't consumed yet and wait */
+		while ((ret = enter(u->ring_fd, *u->sq_tail -
+				__atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE),
+				1)) < 0) {
+			if (errno == EINTR || errno == EAGAIN) continue;
+			FATAL("io_uring_enter: %s", strerror(errno));
+		}
+
+		head = *u->cq_head;
+		while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+			cqe = &u->cqes[head&*u->cq_mask];
+			i = cqe->user_data;
+			ret = cqe->res;
+			head++;
+			inflight--;
+
+			if (ret == -EINTR || ret == -EAGAIN) {
+				retry[no_retry++] = i;
+				continue;
+			}
+
+			if (ret < 0) FATAL("error %s %u bytes at byte %lu: %s",
+					rwing, reqs[i].size, reqs[i].offset,
+					strerror(-ret));
+
+			if (!ret) FATAL("error %s %u bytes at byte %lu: "
+					"unexpected end of file", rwing,
+					reqs[i].size, reqs[i].offset);
+
+			done[i] += ret;
+			if (done[i] < reqs[i].size) retry[no_retry++] = i;
+			else left--;
+		}
+		__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	pthd_mutex_unlock(&u->mutex);
+}
+
+void uring_read_batch(void *priv, blockio_req_t *reqs, uint32_t n) {
+	batch(priv, reqs, n, IORING_OP_READ, "reading");
+}
+
+void uring_write_batch(void *priv, blockio_req_t *reqs, uint32_t n) {
+	batch(priv, reqs, n, IORING_OP_WRITE, "writing");
+}
+
+void uring_read(void *priv, void *buf, uint64_t offset, uint32_t size) {
+	blockio_req_t req = { .buf = buf, .offset = offset, .size = size };
+
+	batch(priv, &req, 1, IORING_OP_READ, "reading");
+}
+
+void uring_write(void *priv, const void *buf, uint64_t offset,
+		uint32_t size) {
+	blockio_req_t req = { .buf = (void*)buf, .offset = offset,
+		.size = size };
+
+	batch(priv, &req, 1, IORING_OP_WRITE, "writing");
+}
+
+void uring_sync(void *priv) {
+	if (fdatasync(((uring_priv_t*)priv)->fd))
+		FATAL("error syncing: %s", strerror(errno));
+}
+
+void uring_close(void *priv) {
+	uring_priv_t *u = priv;
+
+	munmap(u->sqes, u->entries*sizeof(struct io_uring_sqe));
+	if (u->cq_ptr != u->sq_ptr) munmap(u->cq_ptr, u->cq_size);
+	munmap(u->sq_ptr, u->sq_size);
+	close(u->ring_fd);
+	close(u->fd);
+	pthd_mutex_destroy(&u->mutex);
+	free(u);
+}
@@ -0,0 +1,41 @@
+/* uring.h - io_uring I/O engine for blockio
+ *
+ * Copyright (C) 2019  Rik Snel <rik@snel.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef INCLUDE_SCUBED3_URING_H
+#define INCLUDE_SCUBED3_URING_H 1
+
+#include <stdint.h>
+#include "blockio.h"
+
+/* returns 0 if the kernel doesn't let us use io_uring */
+int uring_available(void);
+
+void *uring_open(const blockio_file_t*);
+
+void uring_read(void*, void*, uint64_t, uint32_t);
+
+void uring_write(void*, const void*, uint64_t, uint32_t);
+
+void uring_read_batch(void*, blockio_req_t*, uint32_t);
+
+void uring_write_batch(void*, blockio_req_t*, uint32_t);
+
+void uring_sync(void*);
+
+void uring_close(void*);
+
+#endif /* INCLUDE_SCUBED3_URING_H */
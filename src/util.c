@@ -39,6 +39,19 @@ void *ecalloc(size_t nmemb, size_t size) {
 	return res;
 }
 
+/* zeroed memory, aligned at a multiple of align */
+void *ecalloc_aligned(size_t align, size_t size) {
+	void *res;
+	int err;
+
+	if ((err = posix_memalign(&res, align, size)))
+		FATAL("allocating %lu bytes aligned at %lu: %s",
+				size, align, strerror(err));
+	memset(res, 0, size);
+
+	return res;
+}
+
 char *estrdup(const char *str) {
 	char *out;
 	assert(str);
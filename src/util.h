@@ -27,6 +27,8 @@ void *ecalloc(size_t, size_t);
 
 void *erealloc(void*, size_t, size_t);
 
+void *ecalloc_aligned(size_t, size_t);
+
 char *estrdup(const char*);
 
 #if 0
@@ -0,0 +1,193 @@
+/* workpool.c - pool of worker threads with work stealing
+ *
+ * Copyright (C) 2019  Rik Snel <rik@snel.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <assert.h>
+#include "verbose.h"
+#include "util.h"
+#include "pthd.h"
+#include "workpool.h"
+
+static workpool_task_t *take(workpool_queue_t *q, int steal) {
+	workpool_task_t *t;
+
+	pthd_mutex_lock(&q->mutex);
+	t = steal?q->head.prev:q->head.next;
+	if (t == &q->head) t = NULL;
+	else {
+		t->prev->next = t->next;
+		t->next->prev = t->prev;
+	}
+	pthd_mutex_unlock(&q->mutex);
+
+	return t;
+}
+
+static void *workpool_thread(void *arg) {
+	workpool_queue_t *q = arg;
+	workpool_t *p = q->pool;
+	uint32_t self = q - p->queues, i;
+	workpool_task_t *t;
+
+	pthd_mutex_lock(&p->mutex);
+	while (1) {
+		while (!p->stop && !p->queued)
+			pthd_cond_wait(&p->work_cond, &p->mutex);
+
+		if (p->stop) break;
+
+		/* reserve a task, it is in one of the queues */
+		p->queued--;
+		pthd_mutex_unlock(&p->mutex);
+
+		/* own queue first, then steal from the others */
+		t = take(q, 0);
+		for (i = 1; !t; i++)
+			t = take(&p->queues[(self + i)%p->no_threads], 1);
+
+		t->fn(t->arg, self);
+
+		pthd_mutex_lock(&p->mutex);
+		if (i > 1) p->stolen++;
+		p->executed++;
+		t->done = 1;
+		pthd_cond_broadcast(&p->done_cond);
+	}
+	pthd_mutex_unlock(&p->mutex);
+
+	return NULL;
+}
+
+void workpool_init(workpool_t *p, uint32_t no_threads, int pin) {
+	long no_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	cpu_set_t set;
+	uint32_t i;
+	int err;
+	assert(p);
+
+	memset(p, 0, sizeof(*p));
+
+	if (!no_threads) return;
+
+	pthd_mutex_init(&p->mutex);
+	pthd_cond_init(&p->work_cond);
+	pthd_cond_init(&p->done_cond);
+
+	p->queues = ecalloc(no_threads, sizeof(workpool_queue_t));
+	p->threads = ecalloc(no_threads, sizeof(pthread_t));
+
+	for (i = 0; i < no_threads; i++) {
+		p->queues[i].pool = p;
+		pthd_mutex_init(&p->queues[i].mutex);
+		p->queues[i].head.next = p->queues[i].head.prev =
+			&p->queues[i].head;
+	}
+
+	p->no_threads = no_threads;
+
+	for (i = 0; i < no_threads; i++) {
+		if ((err = pthread_create(&p->threads[i], NULL,
+						workpool_thread, &p->queues[i])))
+			FATAL("unable to create worker thread: %s",
+					strerror(err));
+
+		if (!pin || no_cpus < 1) continue;
+
+		CPU_ZERO(&set);
+		CPU_SET(i%no_cpus, &set);
+		if ((err = pthread_setaffinity_np(p->threads[i],
+						sizeof(set), &set)))
+			WARNING("unable to pin worker %u to cpu %lu: %s",
+					i, i%no_cpus, strerror(err));
+	}
+
+	VERBOSE("started %u worker threads%s", no_threads,
+			pin?", pinned to cpus":"");
+}
+
+/* the tasks are spread over the queues of the workers, without
+ * threads the tasks are run immediately (as worker 0) */
+void workpool_submit(workpool_t *p, workpool_task_t *tasks, uint32_t n) {
+	workpool_queue_t *q;
+	uint32_t i;
+	assert(p && (tasks || !n));
+
+	if (!p->no_threads) {
+		for (i = 0; i < n; i++) {
+			tasks[i].fn(tasks[i].arg, 0);
+			tasks[i].done = 1;
+		}
+		return;
+	}
+
+	pthd_mutex_lock(&p->mutex);
+	for (i = 0; i < n; i++) {
+		tasks[i].done = 0;
+		q = &p->queues[p->next++%p->no_threads];
+		pthd_mutex_lock(&q->mutex);
+		tasks[i].next = &q->head;
+		tasks[i].prev = q->head.prev;
+		q->head.prev->next = &tasks[i];
+		q->head.prev = &tasks[i];
+		pthd_mutex_unlock(&q->mutex);
+	}
+	p->queued += n;
+	pthd_cond_broadcast(&p->work_cond);
+	pthd_mutex_unlock(&p->mutex);
+}
+
+void workpool_wait(workpool_t *p, workpool_task_t *t) {
+	assert(p && t);
+
+	if (!p->no_threads) return;
+
+	pthd_mutex_lock(&p->mutex);
+	while (!t->done) pthd_cond_wait(&p->done_cond, &p->mutex);
+	pthd_mutex_unlock(&p->mutex);
+}
+
+void workpool_free(workpool_t *p) {
+	uint32_t i;
+	assert(p);
+
+	if (!p->no_threads) return;
+
+	pthd_mutex_lock(&p->mutex);
+	assert(!p->queued);
+	p->stop = 1;
+	pthd_cond_broadcast(&p->work_cond);
+	pthd_mutex_unlock(&p->mutex);
+
+	for (i = 0; i < p->no_threads; i++)
+		pthread_join(p->threads[i], NULL);
+
+	VERBOSE("worker threads: %lu tasks executed, %lu stolen",
+			p->executed, p->stolen);
+
+	for (i = 0; i < p->no_threads; i++)
+		pthd_mutex_destroy(&p->queues[i].mutex);
+
+	pthd_cond_destroy(&p->done_cond);
+	pthd_cond_destroy(&p->work_cond);
+	pthd_mutex_destroy(&p->mutex);
+	free(p->queues);
+	free(p->threads);
+}
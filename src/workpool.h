@@ -0,0 +1,68 @@
+/* workpool.h - pool of worker threads with work stealing
+ *
+ * Copyright (C) 2019  Rik Snel <rik@snel.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef INCLUDE_SCUBED3_WORKPOOL_H
+#define INCLUDE_SCUBED3_WORKPOOL_H 1
+
+#include <stdint.h>
+#include <pthread.h>
+
+/* the function of a task gets the index of the worker that runs it,
+ * so that it can use per worker state (like a copy of a cipher) */
+typedef struct workpool_task_s {
+	struct workpool_task_s *prev, *next;
+	void (*fn)(void*, uint32_t);
+	void *arg;
+	int done;
+} workpool_task_t;
+
+/* each worker has its own queue, the owner takes tasks from the
+ * head (oldest first), idle workers steal from the tail */
+typedef struct workpool_queue_s {
+	struct workpool_s *pool;
+	pthread_mutex_t mutex;
+	workpool_task_t head;
+} workpool_queue_t;
+
+/* a zeroed workpool_t is a valid pool without threads,
+ * tasks are then run by the submitting thread */
+typedef struct workpool_s {
+	uint32_t no_threads;
+	pthread_t *threads;
+	workpool_queue_t *queues;
+
+	/* protects queued, next and stop and
+	 * the done flag of all tasks */
+	pthread_mutex_t mutex;
+	pthread_cond_t work_cond, done_cond;
+	uint32_t queued;
+	uint32_t next; /* queue that gets the next task */
+	int stop;
+
+	/* stats */
+	uint64_t executed, stolen;
+} workpool_t;
+
+void workpool_init(workpool_t*, uint32_t, int);
+
+void workpool_submit(workpool_t*, workpool_task_t*, uint32_t);
+
+void workpool_wait(workpool_t*, workpool_task_t*);
+
+void workpool_free(workpool_t*);
+
+#endif /* INCLUDE_SCUBED3_WORKPOOL_H */
@@ -0,0 +1,200 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+
+#include "verbose.h"
+#include "gcry.h"
+#include "binio.h"
+#include "cipher.h"
+
+/* compares CBC_ESSIV(AES256) on mesoblocks with the per cipherblock
+ * ECB implementation that was used before, the output of cipher_enc
+ * and cipher_enc_batch must be identical, also checks cipher_dec_part */
+
+#define MESOBLK_LOG 14
+#define NO_BLOCKS ((1<<MESOBLK_LOG)>>4)
+#define COUNT 4096
+#define BATCH 255 /* mesoblocks per macroblock */
+
+typedef struct ref_s {
+	gcry_cipher_hd_t essiv, ecb;
+} ref_t;
+
+static void ref_init(ref_t *r, const void *key) {
+	char hash[32];
+
+	gcry_md_hash_buffer(GCRY_MD_SHA256, hash, key, 32);
+	gcry_call(cipher_open, &r->essiv, GCRY_CIPHER_AES256,
+			GCRY_CIPHER_MODE_ECB, 0);
+	gcry_call(cipher_setkey, r->essiv, hash, 32);
+	gcry_call(cipher_open, &r->ecb, GCRY_CIPHER_AES256,
+			GCRY_CIPHER_MODE_ECB, 0);
+	gcry_call(cipher_setkey, r->ecb, key, 32);
+}
+
+static void ref_iv(ref_t *r, char *iv, uint64_t iv0, uint32_t iv1,
+		uint32_t iv2) {
+	char tmp[16];
+
+	binio_write_uint64_be(tmp, iv0);
+	binio_write_uint32_be(tmp + 8, iv1);
+	binio_write_uint32_be(tmp + 12, iv2);
+	gcry_call(cipher_encrypt, r->essiv, iv, 16, tmp, 16);
+}
+
+static void ref_enc(ref_t *r, char *out, const char *in,
+		uint64_t iv0, uint32_t iv1, uint32_t iv2) {
+	char iv[16];
+	const char *prev = iv;
+	int i, j;
+
+	ref_iv(r, iv, iv0, iv1, iv2);
+	for (i = 0; i < NO_BLOCKS; i++) {
+		for (j = 0; j < 16; j++) out[j] = in[j]^prev[j];
+		gcry_call(cipher_encrypt, r->ecb, out, 16, NULL, 0);
+		prev = out;
+		out += 16;
+		in += 16;
+	}
+}
+
+static void ref_dec(ref_t *r, char *out, const char *in,
+		uint64_t iv0, uint32_t iv1, uint32_t iv2) {
+	char iv[16];
+	const char *prev = iv;
+	int i, j;
+
+	ref_iv(r, iv, iv0, iv1, iv2);
+	for (i = 0; i < NO_BLOCKS; i++) {
+		gcry_call(cipher_decrypt, r->ecb, out, 16, in, 16);
+		for (j = 0; j < 16; j++) out[j] ^= prev[j];
+		prev = in;
+		out += 16;
+		in += 16;
+	}
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static void report(const char *what, double start) {
+	VERBOSE("%-12s %8.1f MB/s", what,
+			((double)COUNT*(1<<MESOBLK_LOG))/(now() - start)/1e6);
+}
+
+int main(int argc, char *argv[]) {
+	char key[32], tmp[32];
+	char *in, *out, *ref;
+	cipher_t c;
+	cipher_req_t reqs[BATCH];
+	ref_t r;
+	double start;
+	int i, j, n;
+
+	verbose_init(argv[0]);
+
+	gcry_global_init();
+
+	gcry_randomize(key, sizeof(key), GCRY_STRONG_RANDOM);
+	ref_init(&r, key);
+	memcpy(tmp, key, sizeof(key));
+	cipher_init(&c, "CBC_ESSIV(AES256)", NO_BLOCKS, tmp, sizeof(tmp));
+
+	in = malloc(COUNT<<MESOBLK_LOG);
+	out = malloc(COUNT<<MESOBLK_LOG);
+	ref = malloc(COUNT<<MESOBLK_LOG);
+	assert(in && out && ref);
+	gcry_randomize(in, COUNT<<MESOBLK_LOG, GCRY_WEAK_RANDOM);
+
+#define MESO(a, i) ((a) + (((size_t)(i))<<MESOBLK_LOG))
+
+	start = now();
+	for (i = 0; i < COUNT; i++)
+		ref_enc(&r, MESO(ref, i), MESO(in, i), i, i%255 + 1, i>>8);
+	report("ref enc", start);
+
+	start = now();
+	for (i = 0; i < COUNT; i++)
+		cipher_enc(&c, MESO(out, i), MESO(in, i), i, i%255 + 1, i>>8);
+	report("cipher_enc", start);
+
+	if (memcmp(out, ref, COUNT<<MESOBLK_LOG))
+		FATAL("cipher_enc output differs from reference");
+
+	memset(out, 0, COUNT<<MESOBLK_LOG);
+	start = now();
+	for (i = 0; i < COUNT; i += n) {
+		n = COUNT - i < BATCH ? COUNT - i : BATCH;
+		for (j = 0; j < n; j++) {
+			reqs[j].out = MESO(out, i + j);
+			reqs[j].in = MESO(in, i + j);
+			reqs[j].iv0 = i + j;
+			reqs[j].iv1 = (i + j)%255 + 1;
+			reqs[j].iv2 = (i + j)>>8;
+		}
+		cipher_enc_batch(&c, reqs, n);
+	}
+	report("enc_batch", start);
+
+	if (memcmp(out, ref, COUNT<<MESOBLK_LOG))
+		FATAL("cipher_enc_batch output differs from reference");
+
+	start = now();
+	for (i = 0; i < COUNT; i++)
+		ref_dec(&r, MESO(ref, i), MESO(out, i), i, i%255 + 1, i>>8);
+	report("ref dec", start);
+
+	start = now();
+	for (i = 0; i < COUNT; i++)
+		cipher_dec(&c, MESO(in, i), MESO(out, i), i, i%255 + 1, i>>8);
+	report("cipher_dec", start);
+
+	if (memcmp(ref, in, COUNT<<MESOBLK_LOG))
+		FATAL("cipher_dec does not match reference");
+
+	/* in place */
+	start = now();
+	for (i = 0; i < COUNT; i += n) {
+		n = COUNT - i < BATCH ? COUNT - i : BATCH;
+		for (j = 0; j < n; j++) {
+			reqs[j].out = MESO(out, i + j);
+			reqs[j].in = reqs[j].out;
+			reqs[j].iv0 = i + j;
+			reqs[j].iv1 = (i + j)%255 + 1;
+			reqs[j].iv2 = (i + j)>>8;
+		}
+		cipher_dec_batch(&c, reqs, n);
+	}
+	report("dec_batch", start);
+
+	if (memcmp(out, in, COUNT<<MESOBLK_LOG))
+		FATAL("cipher_dec_batch does not match reference");
+
+	/* decrypt a range (the first and some later cipherblocks) */
+	for (i = 0; i < COUNT; i++) {
+		char part[32];
+		size_t off = i%2?0:16*(i%NO_BLOCKS/2*2);
+
+		cipher_enc(&c, ref, MESO(in, i), i, i%255 + 1, i>>8);
+		if (!cipher_dec_part(&c, part, ref, i, i%255 + 1, i>>8,
+					off, sizeof(part)))
+			FATAL("cipher_dec_part not supported");
+		if (memcmp(part, MESO(in, i) + off, sizeof(part)))
+			FATAL("cipher_dec_part does not match plaintext");
+	}
+
+	cipher_free(&c);
+	gcry_cipher_close(r.essiv);
+	gcry_cipher_close(r.ecb);
+	free(in);
+	free(out);
+	free(ref);
+
+	exit(0);
+}
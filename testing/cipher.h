@@ -0,0 +1 @@
+../src/cipher.h
\ No newline at end of file
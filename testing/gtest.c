@@ -0,0 +1,148 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+
+#include "src/verbose.h"
+#include "src/gcry.h"
+#include "src/random.h"
+#include "src/blockio.h"
+#include "src/juggler.h"
+
+/* compares the distribution of the reappearance of a selected block
+ * with the step by step loop that the juggler used before (a block
+ * reappears in each free slot with probability 1/available), with
+ * a chi-square test on the two samples */
+
+#define SAMPLES 200000
+#define MAX_DIST 65536
+#define MIN_BIN 20
+
+typedef struct scenario_s {
+	const char *name;
+	uint32_t no_unscheduled;
+	uint32_t no_scheduled;
+	uint64_t offsets[64]; // next_seqno - seqno of the scheduled blocks
+} scenario_t;
+
+static scenario_t scenarios[] = {
+	{ "one unscheduled", 1, 13,
+		{ 2, 3, 5, 8, 9, 10, 20, 33, 60, 64, 65, 70, 90 } },
+	{ "few unscheduled", 5, 10,
+		{ 2, 4, 6, 7, 8, 9, 50, 63, 64, 200 } },
+	{ "many unscheduled", 300, 12,
+		{ 2, 3, 100, 101, 102, 103, 500, 1200, 1300, 1301,
+			1302, 5000 } },
+};
+
+/* the old loop, offsets are sorted, the selected
+ * block is written at offset 1 */
+static uint64_t reference(random_t *r, scenario_t *s) {
+	uint32_t available = s->no_unscheduled, k = 0;
+	uint64_t t = 1;
+
+	while (1) {
+		t++;
+		if (k < s->no_scheduled && s->offsets[k] == t) {
+			k++;
+			available++;
+		} else if (!random_custom(r, available)) return t;
+	}
+}
+
+static uint64_t juggled(random_t *r, scenario_t *s, blockio_info_t *disk) {
+	const uint64_t seqno = 1000000;
+	blockio_info_t *next;
+	uint32_t i, n = s->no_scheduled + s->no_unscheduled;
+	juggler_t j;
+	uint64_t ret;
+
+	memset(disk, 0, n*sizeof(blockio_info_t));
+	juggler_init(&j, r);
+	for (i = 0; i < s->no_scheduled; i++) {
+		disk[i].seqno = seqno - i;
+		disk[i].next_seqno = seqno + s->offsets[i];
+		juggler_add_macroblock(&j, disk + i);
+	}
+	for (; i < n; i++) juggler_add_macroblock(&j, disk + i);
+
+	next = juggler_get_devblock(&j, 0);
+	assert(next->seqno == seqno + 1);
+	ret = next->next_seqno - seqno;
+	juggler_free(&j);
+
+	return ret;
+}
+
+/* upper bound of chi-square with k degrees of freedom at p = 0.001,
+ * (Wilson-Hilferty approximation) */
+static double critical(uint32_t k) {
+	double c = 2./(9*k);
+
+	return k*pow(1 - c + 3.09*sqrt(c), 3);
+}
+
+int main(int argc, char *argv[]) {
+	static uint32_t ref[MAX_DIST + 1], jug[MAX_DIST + 1],
+			b1[MAX_DIST + 2], b2[MAX_DIST + 2];
+	blockio_info_t disk[512];
+	uint32_t i, k, bins;
+	double chi2;
+	uint64_t t;
+	random_t r;
+	int fail = 0;
+
+	verbose_init(argv[0]);
+
+	gcry_global_init();
+
+	random_init_seed(&r, 1);
+
+	for (k = 0; k < sizeof(scenarios)/sizeof(scenarios[0]); k++) {
+		scenario_t *s = &scenarios[k];
+
+		memset(ref, 0, sizeof(ref));
+		memset(jug, 0, sizeof(jug));
+
+		for (i = 0; i < SAMPLES; i++) {
+			t = reference(&r, s);
+			ref[t < MAX_DIST?t:MAX_DIST]++;
+			t = juggled(&r, s, disk);
+			jug[t < MAX_DIST?t:MAX_DIST]++;
+		}
+
+		/* consecutive distances are merged until a bin is
+		 * large enough, a small remainder joins the last bin */
+		bins = 0;
+		b1[0] = b2[0] = 0;
+		for (i = 0; i <= MAX_DIST; i++) {
+			b1[bins] += ref[i];
+			b2[bins] += jug[i];
+			if (b1[bins] + b2[bins] >= MIN_BIN) {
+				bins++;
+				b1[bins] = b2[bins] = 0;
+			}
+		}
+		if (bins && b1[bins] + b2[bins]) {
+			b1[bins - 1] += b1[bins];
+			b2[bins - 1] += b2[bins];
+		}
+
+		chi2 = 0;
+		for (i = 0; i < bins; i++)
+			chi2 += ((double)b1[i] - b2[i])*
+				((double)b1[i] - b2[i])/(b1[i] + b2[i]);
+
+		VERBOSE("%-16s chi2=%8.1f, %4u bins, p=0.001 at %8.1f", s->name,
+				chi2, bins, critical(bins - 1));
+		if (chi2 > critical(bins - 1)) fail = 1;
+	}
+
+	random_free(&r);
+
+	if (fail) FATAL("distributions differ");
+
+	exit(0);
+}
@@ -0,0 +1,87 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <assert.h>
+
+#include "src/verbose.h"
+#include "src/gcry.h"
+#include "src/random.h"
+#include "src/blockio.h"
+#include "src/juggler.h"
+
+/* the juggler from test.c at the scale of a large device, reports the
+ * time to load the schedule (as on open) and to select a block, the
+ * time per selection should not depend on the number of blocks */
+
+#define MAX_DEVBLOCKS 131072
+#define STEPS 100000
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static void run(random_t *r, blockio_info_t *disk, uint32_t no_devblocks) {
+	juggler_t j;
+	double start, fresh, load;
+	uint32_t i;
+
+	for (i = 0; i < no_devblocks; i++) {
+		disk[i].next = NULL;
+		disk[i].seqno = disk[i].next_seqno = 0;
+	}
+
+	juggler_init(&j, r);
+	for (i = 0; i < no_devblocks; i++)
+		juggler_add_macroblock(&j, disk + i);
+
+	/* from a fresh device to a full schedule */
+	start = now();
+	for (i = 0; i < STEPS; i++) juggler_get_devblock(&j, 0);
+	fresh = now() - start;
+
+	/* reload, in reverse order of seqno, like on open */
+	juggler_free(&j);
+	start = now();
+	juggler_init(&j, r);
+	for (i = 0; i < no_devblocks; i++) {
+		disk[i].next = NULL;
+		juggler_add_macroblock(&j, disk + no_devblocks - i - 1);
+	}
+	juggler_get_obsoleted(&j);
+	load = now() - start;
+
+	start = now();
+	for (i = 0; i < STEPS; i++) juggler_get_devblock(&j, 0);
+
+	VERBOSE("%6u blocks: load %7.1fms, select %6.0fns (fresh %6.0fns)",
+			no_devblocks, load*1e3, (now() - start)/STEPS*1e9,
+			fresh/STEPS*1e9);
+
+	juggler_free(&j);
+}
+
+int main(int argc, char *argv[]) {
+	blockio_info_t *disk;
+	uint32_t n;
+	random_t r;
+
+	verbose_init(argv[0]);
+
+	gcry_global_init();
+
+	random_init_seed(&r, 1);
+
+	disk = calloc(MAX_DEVBLOCKS, sizeof(blockio_info_t));
+	assert(disk);
+
+	for (n = 1024; n <= MAX_DEVBLOCKS; n <<= 1) run(&r, disk, n);
+
+	free(disk);
+
+	random_free(&r);
+
+	exit(0);
+}
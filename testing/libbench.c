@@ -0,0 +1,256 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "src/libscubed3.h"
+
+/* the benchmarks of iobench, openbench and rwbench on libscubed3,
+ * without the daemon, FUSE and root
+ *
+ * usage: libbench io|open|rw BASE [BLOCKS] [ENGINE]
+ *
+ * io:   a partition of BLOCKS macroblocks is filled and read back
+ *       sequentially, in requests of 1MiB
+ * open: a partition of BLOCKS macroblocks is created and closed, then
+ *       the time needed to open it is measured for 0, 1, 2, 4 and 8
+ *       worker threads
+ * rw:   a partition of BLOCKS macroblocks is filled, then 1, 2, 4 and
+ *       8 threads read 16KiB at random offsets, first alone and then
+ *       next to one thread that writes at random offsets
+ *
+ * the base file must exist and have more than BLOCKS macroblocks,
+ * partitions on it are destroyed; a base mem:BLOCKS (not for open) or
+ * a sparse file with ENGINE sparse needs no disk space; if we may, the
+ * page cache is dropped before each measurement; build ../src first */
+
+#define RESERVED 8
+#define CHUNK (1<<20)
+#define RW_SIZE (16<<10)
+#define RUNTIME 5
+#define CIPHER "CBC_ESSIV(AES256)"
+
+static libscubed3_opts_t o;
+static const char *path;
+static char key[32];
+static uint32_t blocks;
+
+static void die(const char *msg) {
+	fprintf(stderr, "libbench: %s\n", msg);
+	exit(1);
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static void drop_caches(void) {
+	FILE *fp;
+
+	sync();
+	if (!(fp = fopen("/proc/sys/vm/drop_caches", "w"))) return;
+	fputs("3\n", fp);
+	fclose(fp);
+}
+
+static libscubed3_part_t *create(libscubed3_base_t *base) {
+	libscubed3_part_t *p;
+
+	if (blocks <= RESERVED || blocks > libscubed3_base_macroblocks(base))
+		die("BLOCKS out of range");
+
+	if (libscubed3_open(base, "bench", CIPHER, key, sizeof(key),
+				LIBSCUBED3_CREATE, &p) ||
+			libscubed3_resize(p, blocks, RESERVED))
+		die("unable to create partition");
+
+	return p;
+}
+
+static libscubed3_part_t *open_part(libscubed3_base_t *base) {
+	libscubed3_part_t *p;
+
+	if (libscubed3_open(base, "bench", CIPHER, key, sizeof(key), 0, &p))
+		die("unable to open partition");
+
+	return p;
+}
+
+/* sequential, the partition is written if buf is not NULL */
+static double pass(libscubed3_part_t *p, char *buf) {
+	static char tmp[CHUNK];
+	uint64_t offset, size = libscubed3_size(p);
+	uint32_t len;
+	double start = now();
+
+	for (offset = 0; offset < size; offset += len) {
+		len = size - offset < CHUNK?size - offset:CHUNK;
+		if (buf) {
+			if (libscubed3_pwrite(p, buf, len, offset) != len)
+				die("short write");
+		} else if (libscubed3_pread(p, tmp, len, offset) != len)
+			die("short read");
+	}
+	if (buf) libscubed3_flush(p);
+
+	return size/(now() - start)/(1<<20);
+}
+
+static void io(libscubed3_base_t *base) {
+	libscubed3_part_t *p = create(base);
+	char *buf = malloc(CHUNK);
+	double mib;
+
+	if (!buf) die("out of memory");
+	memset(buf, 0, CHUNK);
+
+	drop_caches();
+	mib = pass(p, buf);
+	printf("%s: write %luMiB, %.1f MiB/s\n", o.engine,
+			libscubed3_size(p)>>20, mib);
+	libscubed3_close(p);
+
+	/* reopened, so that nothing comes from the mesoblock cache */
+	drop_caches();
+	p = open_part(base);
+	mib = pass(p, NULL);
+	printf("%s: read %luMiB, %.1f MiB/s\n", o.engine,
+			libscubed3_size(p)>>20, mib);
+	libscubed3_close(p);
+
+	free(buf);
+}
+
+/* the base is opened again for each number of threads, so
+ * this doesn't work with mem:BLOCKS */
+static libscubed3_base_t *open_times(libscubed3_base_t *base) {
+	static const uint32_t threads[] = { 0, 1, 2, 4, 8 };
+	libscubed3_part_t *p;
+	uint32_t i;
+	double start;
+
+	libscubed3_close(create(base));
+
+	for (i = 0; i < sizeof(threads)/sizeof(threads[0]); i++) {
+		libscubed3_base_close(base);
+		o.threads = threads[i];
+		base = libscubed3_base_open(path, &o);
+		drop_caches();
+		start = now();
+		p = open_part(base);
+		printf("%u blocks, %u threads: %.3f s\n",
+				libscubed3_base_macroblocks(base), threads[i],
+				now() - start);
+		libscubed3_close(p);
+	}
+
+	return base;
+}
+
+typedef struct job_s {
+	libscubed3_part_t *p;
+	pthread_t thread;
+	int write;
+	unsigned int seed;
+	uint64_t requests;
+} job_t;
+
+static volatile int stop;
+
+static void *job(void *arg) {
+	job_t *j = arg;
+	uint64_t chunks = libscubed3_size(j->p)/RW_SIZE;
+	char buf[RW_SIZE];
+	uint64_t offset;
+
+	memset(buf, 0, sizeof(buf));
+
+	while (!stop) {
+		offset = (((uint64_t)rand_r(&j->seed)<<31)^
+				rand_r(&j->seed))%chunks*RW_SIZE;
+		if (j->write) libscubed3_pwrite(j->p, buf, RW_SIZE, offset);
+		else libscubed3_pread(j->p, buf, RW_SIZE, offset);
+		j->requests++;
+	}
+
+	return NULL;
+}
+
+/* runs the jobs for RUNTIME seconds, readers and maybe one writer */
+static void rw_run(libscubed3_part_t *p, uint32_t readers, int writer) {
+	job_t jobs[readers + 1];
+	uint64_t reads = 0;
+	uint32_t i, n = readers + (writer?1:0);
+
+	stop = 0;
+	for (i = 0; i < n; i++) {
+		jobs[i] = (job_t){ .p = p, .write = i == readers, .seed = i };
+		if (pthread_create(&jobs[i].thread, NULL, job, &jobs[i]))
+			die("unable to create thread");
+	}
+	sleep(RUNTIME);
+	stop = 1;
+	for (i = 0; i < n; i++) pthread_join(jobs[i].thread, NULL);
+
+	for (i = 0; i < readers; i++) reads += jobs[i].requests;
+	printf("%u readers%s: read %.1f MiB/s", readers,
+			writer?", 1 writer":"",
+			(double)reads*RW_SIZE/RUNTIME/(1<<20));
+	if (writer) printf(", write %.1f MiB/s",
+			(double)jobs[readers].requests*RW_SIZE/RUNTIME/(1<<20));
+	printf("\n");
+}
+
+static void rw(libscubed3_base_t *base) {
+	libscubed3_part_t *p = create(base);
+	uint32_t readers;
+	char *buf = malloc(CHUNK);
+	FILE *fp;
+
+	if (!buf) die("out of memory");
+	if (!(fp = fopen("/dev/urandom", "r")) ||
+			fread(buf, CHUNK, 1, fp) != 1)
+		die("unable to read /dev/urandom");
+	fclose(fp);
+	pass(p, buf);
+	free(buf);
+
+	for (readers = 1; readers <= 8; readers <<= 1) {
+		rw_run(p, readers, 0);
+		rw_run(p, readers, 1);
+	}
+
+	libscubed3_close(p);
+}
+
+int main(int argc, char **argv) {
+	libscubed3_base_t *base;
+	FILE *fp;
+
+	if (argc < 3) die("usage: libbench io|open|rw BASE [BLOCKS] [ENGINE]");
+	path = argv[2];
+	blocks = argc > 3?atoi(argv[3]):256;
+
+	if (!(fp = fopen("/dev/urandom", "r")) ||
+			fread(key, sizeof(key), 1, fp) != 1)
+		die("unable to read key from /dev/urandom");
+	fclose(fp);
+
+	libscubed3_opts_default(&o);
+	o.engine = argc > 4?argv[4]:"pread";
+	base = libscubed3_base_open(path, &o);
+
+	if (!strcmp(argv[1], "io")) io(base);
+	else if (!strcmp(argv[1], "open")) base = open_times(base);
+	else if (!strcmp(argv[1], "rw")) rw(base);
+	else die("unknown benchmark");
+
+	libscubed3_base_close(base);
+
+	return 0;
+}
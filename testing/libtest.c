@@ -0,0 +1,141 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "src/libscubed3.h"
+
+/* uses libscubed3 without the daemon: creates a partition on the
+ * base file, writes and reads random ranges of it and checks what it
+ * reads, then closes it, opens it again and checks that the data is
+ * still there, also after a trim
+ *
+ * usage: libtest BASE [BLOCKS] [REQUESTS] [ENGINE]
+ *
+ * the base file must exist and have more than BLOCKS macroblocks,
+ * partitions on it are destroyed; build ../src first */
+
+#define MAX_LEN (256<<10)
+#define CIPHER "CBC_ESSIV(AES256)"
+
+static libscubed3_base_t *base;
+static libscubed3_part_t *p;
+static uint64_t size;
+static char *ref, buf[MAX_LEN];
+static int bad;
+
+static void die(const char *msg) {
+	fprintf(stderr, "libtest: %s\n", msg);
+	exit(1);
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static void check(uint64_t offset, uint32_t length) {
+	if (libscubed3_pread(p, buf, length, offset) != length)
+		die("short read");
+	if (memcmp(buf, ref + offset, length)) bad++;
+}
+
+static void run(int write, int requests) {
+	uint64_t offset, bytes = 0;
+	uint32_t length, j;
+	double start = now();
+	int n;
+
+	for (n = 0; n < requests; n++) {
+		length = 1 + random()%MAX_LEN;
+		offset = random()%(size - length + 1);
+
+		if (write) {
+			for (j = 0; j < length; j++)
+				buf[j] = ref[offset + j] = random();
+			if (libscubed3_pwrite(p, buf, length, offset) != length)
+				die("short write");
+		} else check(offset, length);
+		bytes += length;
+	}
+
+	printf("%s: %d requests, %.1f MiB/s\n", write?"write":"read",
+			requests, bytes/(now() - start)/(1<<20));
+}
+
+/* the unwritten parts of the partition are unknown, read them */
+static void learn(uint64_t offset, uint64_t length) {
+	if (libscubed3_pread(p, ref + offset, length, offset) != length)
+		die("short read");
+}
+
+static void verify(void) {
+	uint64_t offset;
+
+	for (offset = 0; offset < size; offset += MAX_LEN)
+		check(offset, size - offset < MAX_LEN?size - offset:MAX_LEN);
+}
+
+int main(int argc, char **argv) {
+	uint32_t blocks = argc > 2?atoi(argv[2]):16;
+	int requests = argc > 3?atoi(argv[3]):1000;
+	libscubed3_opts_t o;
+	libscubed3_stats_t s;
+	char key[32];
+	FILE *fp;
+
+	if (argc < 2) die("usage: libtest BASE [BLOCKS] [REQUESTS] [ENGINE]");
+
+	if (!(fp = fopen("/dev/urandom", "r")) ||
+			fread(key, sizeof(key), 1, fp) != 1)
+		die("unable to read key from /dev/urandom");
+	fclose(fp);
+
+	libscubed3_opts_default(&o);
+	o.engine = argc > 4?argv[4]:NULL;
+	base = libscubed3_base_open(argv[1], &o);
+	if (blocks < 2 || blocks > libscubed3_base_macroblocks(base))
+		die("BLOCKS out of range");
+
+	if (libscubed3_open(base, "test", CIPHER, key, sizeof(key),
+				LIBSCUBED3_CREATE, &p) ||
+			libscubed3_resize(p, blocks, 1))
+		die("unable to create partition");
+	size = libscubed3_size(p);
+	printf("partition of %u blocks, %lu bytes\n", blocks, size);
+	if (size < MAX_LEN) die("partition too small");
+
+	if (!(ref = malloc(size))) die("out of memory");
+	learn(0, size);
+
+	srandom(1);
+	run(1, requests);
+	run(0, requests);
+
+	libscubed3_flush(p);
+	libscubed3_stats(p, &s);
+	printf("%u writes, %lu cache hits, %lu cache misses\n",
+			s.writes, s.cache_hits, s.cache_misses);
+	libscubed3_close(p);
+
+	/* the same key finds the same partition */
+	if (libscubed3_open(base, "test", CIPHER, key, sizeof(key), 0, &p))
+		die("unable to open partition again");
+	if (libscubed3_size(p) != size) die("partition has a different size");
+	verify();
+
+	/* after a trim, the contents are unknown until overwritten */
+	if (libscubed3_trim(p, 0, size/2)) die("trim failed");
+	learn(0, size/2);
+	run(1, requests/4);
+	verify();
+
+	libscubed3_close(p);
+	libscubed3_base_close(base);
+
+	printf("%d bad\n", bad);
+
+	return bad != 0;
+}
@@ -0,0 +1,333 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <assert.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* a small NBD client for the NBD server of scubed3, it negotiates
+ * structured replies, writes and reads random ranges of the export
+ * with up to DEPTH requests in flight and checks what it reads,
+ * then checks that flush and trim work
+ *
+ * usage: nbdtest SOCKET EXPORT [REQUESTS] [DEPTH]
+ *
+ * the export is overwritten */
+
+#define NBD_MAGIC			0x4e42444d41474943ULL
+#define NBD_IHAVEOPT			0x49484156454f5054ULL
+#define NBD_REP_MAGIC			0x0003e889045565a9ULL
+#define NBD_REQUEST_MAGIC		0x25609513
+#define NBD_SIMPLE_REPLY_MAGIC		0x67446698
+#define NBD_STRUCTURED_REPLY_MAGIC	0x668e33ef
+
+#define NBD_OPT_GO			7
+#define NBD_OPT_STRUCTURED_REPLY	8
+#define NBD_REP_ACK			1
+#define NBD_REP_INFO			3
+#define NBD_INFO_EXPORT			0
+
+#define NBD_CMD_READ			0
+#define NBD_CMD_WRITE			1
+#define NBD_CMD_DISC			2
+#define NBD_CMD_FLUSH			3
+#define NBD_CMD_TRIM			4
+
+#define NBD_REPLY_FLAG_DONE		1
+#define NBD_REPLY_TYPE_OFFSET_DATA	1
+#define NBD_REPLY_TYPE_ERROR		(1<<15|1)
+
+#define MAX_DEPTH 64
+#define MAX_LEN (256<<10)
+#define MAX_SIZE (256ULL<<20)
+
+static int s;
+static uint64_t size;
+static char *ref;
+
+typedef struct slot_s {
+	int busy;
+	uint16_t type;
+	uint64_t offset;
+	uint32_t length;
+	char buf[MAX_LEN];
+} slot_t;
+
+static slot_t slots[MAX_DEPTH];
+static int depth = 8, in_flight, bad, learn;
+
+static void die(const char *msg) {
+	fprintf(stderr, "nbdtest: %s\n", msg);
+	exit(1);
+}
+
+static void put16(char *p, uint16_t v) { p[0] = v>>8; p[1] = v; }
+static void put32(char *p, uint32_t v) { put16(p, v>>16); put16(p + 2, v); }
+static void put64(char *p, uint64_t v) { put32(p, v>>32); put32(p + 4, v); }
+static uint16_t get16(const char *p) {
+	return (uint16_t)(uint8_t)p[0]<<8|(uint8_t)p[1];
+}
+static uint32_t get32(const char *p) {
+	return (uint32_t)get16(p)<<16|get16(p + 2);
+}
+static uint64_t get64(const char *p) {
+	return (uint64_t)get32(p)<<32|get32(p + 4);
+}
+
+static void xsend(const void *buf, size_t len) {
+	ssize_t n;
+	while (len) {
+		if ((n = send(s, buf, len, 0)) <= 0) die("send failed");
+		buf += n;
+		len -= n;
+	}
+}
+
+static void xrecv(void *buf, size_t len) {
+	ssize_t n;
+	while (len) {
+		if ((n = recv(s, buf, len, 0)) <= 0) die("recv failed");
+		buf += n;
+		len -= n;
+	}
+}
+
+static void option(uint32_t opt, const void *data, uint32_t len) {
+	char hdr[16];
+	put64(hdr, NBD_IHAVEOPT);
+	put32(hdr + 8, opt);
+	put32(hdr + 12, len);
+	xsend(hdr, sizeof(hdr));
+	xsend(data, len);
+}
+
+/* returns the type of the reply, the data goes in buf */
+static uint32_t option_reply(char *buf, uint32_t max) {
+	char hdr[20];
+	uint32_t len;
+	xrecv(hdr, sizeof(hdr));
+	if (get64(hdr) != NBD_REP_MAGIC) die("bad option reply magic");
+	if ((len = get32(hdr + 16)) > max) die("option reply too long");
+	xrecv(buf, len);
+	return get32(hdr + 12);
+}
+
+static uint16_t handshake(const char *export) {
+	char buf[1024];
+	uint32_t type, len = strlen(export);
+	uint16_t flags = 0;
+
+	xrecv(buf, 18);
+	if (get64(buf) != NBD_MAGIC || get64(buf + 8) != NBD_IHAVEOPT)
+		die("not an NBD server");
+	put32(buf, 3); /* fixed newstyle, no zeroes */
+	xsend(buf, 4);
+
+	option(NBD_OPT_STRUCTURED_REPLY, NULL, 0);
+	if (option_reply(buf, sizeof(buf)) != NBD_REP_ACK)
+		die("no structured replies");
+
+	put32(buf, len);
+	memcpy(buf + 4, export, len);
+	put16(buf + 4 + len, 0);
+	option(NBD_OPT_GO, buf, len + 6);
+	while ((type = option_reply(buf, sizeof(buf))) != NBD_REP_ACK) {
+		if (type != NBD_REP_INFO) die("export refused");
+		if (get16(buf) == NBD_INFO_EXPORT) {
+			size = get64(buf + 2);
+			flags = get16(buf + 10);
+		}
+	}
+
+	return flags;
+}
+
+static void request(int i, uint16_t type, uint64_t offset, uint32_t length) {
+	char hdr[28];
+	slot_t *sl = &slots[i];
+
+	sl->busy = 1;
+	sl->type = type;
+	sl->offset = offset;
+	sl->length = length;
+	in_flight++;
+
+	put32(hdr, NBD_REQUEST_MAGIC);
+	put16(hdr + 4, 0);
+	put16(hdr + 6, type);
+	put64(hdr + 8, i);
+	put64(hdr + 16, offset);
+	put32(hdr + 24, length);
+	xsend(hdr, sizeof(hdr));
+	if (type == NBD_CMD_WRITE) xsend(sl->buf, length);
+}
+
+/* receive one reply (all chunks of it) and check reads */
+static void reply(void) {
+	char hdr[20], tmp[8];
+	uint64_t handle;
+	uint32_t len, err = 0;
+	uint16_t flags, type;
+	slot_t *sl;
+
+	do {
+		xrecv(hdr, 16);
+		handle = get64(hdr + 8);
+		if (handle >= depth || !slots[handle].busy) die("bad handle");
+		sl = &slots[handle];
+
+		if (get32(hdr) == NBD_SIMPLE_REPLY_MAGIC) {
+			if ((err = get32(hdr + 4))) break;
+			if (sl->type == NBD_CMD_READ) xrecv(sl->buf, sl->length);
+			break;
+		}
+
+		if (get32(hdr) != NBD_STRUCTURED_REPLY_MAGIC)
+			die("bad reply magic");
+		xrecv(hdr + 16, 4);
+		flags = get16(hdr + 4);
+		type = get16(hdr + 6);
+		len = get32(hdr + 16);
+		if (type == NBD_REPLY_TYPE_OFFSET_DATA) {
+			xrecv(tmp, 8);
+			if (get64(tmp) < sl->offset || get64(tmp) - sl->offset
+					+ len - 8 > sl->length)
+				die("data chunk out of range");
+			xrecv(sl->buf + get64(tmp) - sl->offset, len - 8);
+		} else if (type == NBD_REPLY_TYPE_ERROR) {
+			char msg[len];
+			xrecv(msg, len);
+			err = get32(msg);
+		} else {
+			char skip[len];
+			xrecv(skip, len);
+		}
+	} while (!(flags&NBD_REPLY_FLAG_DONE));
+
+	if (err) {
+		fprintf(stderr, "nbdtest: request failed with error %u\n", err);
+		bad++;
+	} else if (sl->type == NBD_CMD_READ && learn)
+		memcpy(ref + sl->offset, sl->buf, sl->length);
+	else if (sl->type == NBD_CMD_READ &&
+			memcmp(sl->buf, ref + sl->offset, sl->length)) bad++;
+
+	sl->busy = 0;
+	in_flight--;
+}
+
+/* in flight writes must not overlap, or we don't know the outcome */
+static int free_slot(uint64_t offset, uint32_t length) {
+	int i, free = -1;
+
+	for (i = 0; i < depth; i++) {
+		if (!slots[i].busy) {
+			if (free < 0) free = i;
+			continue;
+		}
+		if (slots[i].type == NBD_CMD_WRITE &&
+				offset < slots[i].offset + slots[i].length &&
+				slots[i].offset < offset + length) return -1;
+	}
+
+	return free;
+}
+
+static void drain(void) {
+	while (in_flight) reply();
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static void run(uint16_t type, int requests, uint64_t area) {
+	uint64_t offset, bytes = 0;
+	uint32_t length, j;
+	double start = now();
+	int i, n;
+
+	for (n = 0; n < requests; n++) {
+		length = 1 + random()%MAX_LEN;
+		if (length > area) length = area;
+		offset = random()%(area - length + 1);
+
+		while ((i = free_slot(offset, length)) < 0) reply();
+
+		if (type == NBD_CMD_WRITE) for (j = 0; j < length; j++)
+			slots[i].buf[j] = ref[offset + j] = random();
+		request(i, type, offset, length);
+		bytes += length;
+	}
+	drain();
+
+	printf("%s: %d requests, %.1f MiB/s\n",
+			type == NBD_CMD_WRITE?"write":"read", requests,
+			bytes/(now() - start)/(1<<20));
+}
+
+static void learn_area(uint64_t area) {
+	uint64_t off;
+	int i;
+
+	learn = 1;
+	for (off = 0; off < area; off += MAX_LEN) {
+		while ((i = free_slot(0, 0)) < 0) reply();
+		request(i, NBD_CMD_READ, off,
+				area - off < MAX_LEN?area - off:MAX_LEN);
+	}
+	drain();
+	learn = 0;
+}
+
+int main(int argc, char **argv) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int requests = argc > 3?atoi(argv[3]):1000;
+	uint64_t area;
+
+	if (argc < 3) die("usage: nbdtest SOCKET EXPORT [REQUESTS] [DEPTH]");
+	if (argc > 4) depth = atoi(argv[4]);
+	if (depth < 1 || depth > MAX_DEPTH) die("DEPTH out of range");
+
+	if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) die("socket failed");
+	strncpy(addr.sun_path, argv[1], sizeof(addr.sun_path) - 1);
+	if (connect(s, (struct sockaddr*)&addr, sizeof(addr)) == -1)
+		die("connect failed");
+
+	if (handshake(argv[2])&2) die("export is readonly");
+	area = size < MAX_SIZE?size:MAX_SIZE;
+	printf("export %s, %lu bytes, testing %lu bytes with depth %d\n",
+			argv[2], size, area, depth);
+	if (!area) die("export is empty");
+
+	/* the unwritten parts of the area are unknown, read them first */
+	if (!(ref = malloc(area))) die("out of memory");
+	learn_area(area);
+
+	srandom(1);
+	run(NBD_CMD_WRITE, requests, area);
+	run(NBD_CMD_READ, requests, area);
+
+	request(0, NBD_CMD_FLUSH, 0, 0);
+	drain();
+
+	/* after a trim, the contents are unknown until overwritten */
+	request(0, NBD_CMD_TRIM, 0, area/2);
+	drain();
+	learn_area(area/2);
+	run(NBD_CMD_WRITE, requests/4, area/2);
+	run(NBD_CMD_READ, requests, area);
+
+	request(0, NBD_CMD_DISC, 0, 0);
+	close(s);
+
+	printf("%d bad\n", bad);
+
+	return bad != 0;
+}
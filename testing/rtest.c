@@ -4,17 +4,20 @@
 #include <assert.h>
 
 #include "verbose.h"
+#include "gcry.h"
 #include "random.h"
 
 #define COUNT 16
 #define STEPS 1000000
 
 int main(int argc, char *argv[]) {
-	random_t r;
+	random_t r, s;
 	int freq[COUNT] = { };
 
 	verbose_init(argv[0]);
 
+	gcry_global_init();
+
 	random_init(&r);
 
 	for (int i = 0; i < STEPS; i++) {
@@ -29,5 +32,20 @@ int main(int argc, char *argv[]) {
 		VERBOSE("freq[%d]=%d", i, freq[i]);
 	}
 
+	/* the same seed gives the same numbers, also after a reseed */
+	random_init_seed(&r, 42);
+	random_init_seed(&s, 42);
+	for (int i = 0; i < STEPS; i++)
+		if (random_uint32(&r) != random_uint32(&s))
+			FATAL("seeded generators differ at %d", i);
+	random_free(&s);
+
+	random_init_seed(&s, 43);
+	if (random_uint32(&r) == random_uint32(&s) &&
+			random_uint32(&r) == random_uint32(&s))
+		FATAL("different seeds give the same numbers");
+	random_free(&s);
+	random_free(&r);
+
 	exit(0);
 }
@@ -4,6 +4,7 @@
 #include <assert.h>
 
 #include "verbose.h"
+#include "gcry.h"
 #include "random.h"
 #include "blockio.h"
 #include "juggler.h"
@@ -46,6 +47,8 @@ int main(int argc, char *argv[]) {
 
 	verbose_init(argv[0]);
 
+	gcry_global_init();
+
 	random_init(&r);
 
 	juggler_init(&j, &r);